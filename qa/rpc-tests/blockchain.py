@@ -40,7 +40,7 @@ class BlockchainTest(BitcoinTestFramework):
 
     def run_test(self):
         node = self.nodes[0]
-        res = node.gettxoutsetinfo()
+        res = node.gettxoutsetinfo("hash_serialized")
 
         assert_equal(res[u'total_amount'], decimal.Decimal('2181.25000000')) # 150*12.5 + 49*6.25
         assert_equal(res[u'transactions'], 200)
@@ -50,6 +50,12 @@ class BlockchainTest(BitcoinTestFramework):
         assert_equal(len(res[u'bestblock']), 64)
         assert_equal(len(res[u'hash_serialized']), 64)
 
+        # The running totals match those of the walk over all outputs.
+        fast = node.gettxoutsetinfo()
+        for key in [u'height', u'bestblock', u'txouts', u'bytes_serialized', u'muhash', u'total_amount']:
+            assert_equal(fast[key], res[key])
+        assert(u'hash_serialized' not in fast)
+
 
 if __name__ == '__main__':
     BlockchainTest().main()
@@ -191,9 +191,15 @@ case "$1" in
             solveequihash)
                 zcash_rpc_slow zcbenchmark solveequihash 50 "${@:3}"
                 ;;
+            solveequihashbucket)
+                zcash_rpc_slow zcbenchmark solveequihashbucket 50 "${@:3}"
+                ;;
             verifyequihash)
                 zcash_rpc zcbenchmark verifyequihash 1000
                 ;;
+            verifyinvalidequihash)
+                zcash_rpc zcbenchmark verifyinvalidequihash 1000
+                ;;
             validatelargetx)
                 zcash_rpc zcbenchmark validatelargetx 10 "${@:3}"
                 ;;
@@ -216,6 +222,12 @@ case "$1" in
             listunspent)
                 zcash_rpc zcbenchmark listunspent 10
                 ;;
+            verifysaplingspend)
+                zcash_rpc zcbenchmark verifysaplingspend 1000 "${@:3}"
+                ;;
+            verifysaplingoutput)
+                zcash_rpc zcbenchmark verifysaplingoutput 1000 "${@:3}"
+                ;;
             *)
                 zcashd_stop
                 echo "Bad arguments to time."
@@ -241,6 +253,9 @@ case "$1" in
             solveequihash)
                 zcash_rpc_slow zcbenchmark solveequihash 1 "${@:3}"
                 ;;
+            solveequihashbucket)
+                zcash_rpc_slow zcbenchmark solveequihashbucket 1 "${@:3}"
+                ;;
             verifyequihash)
                 zcash_rpc zcbenchmark verifyequihash 1
                 ;;
@@ -152,19 +152,17 @@ bool AMQPPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
 {
     LogPrint("amqp", "amqp: Publish rawblock %s\n", pindex->GetBlockHash().GetHex());
 
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    std::shared_ptr<const std::vector<unsigned char> > data;
     {
         LOCK(cs_main);
-        CBlock block;
-        if(!ReadBlockFromDisk(block, pindex)) {
+        data = ReadRawBlockFromDiskCached(pindex);
+        if(!data) {
             LogPrint("amqp", "amqp: Can't read block from disk");
             return false;
         }
-
-        ss << block;
     }
 
-    return SendMessage(MSG_RAWBLOCK, &(*ss.begin()), ss.size());
+    return SendMessage(MSG_RAWBLOCK, data->data(), data->size());
 }
 
 bool AMQPPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &transaction)
@@ -0,0 +1,123 @@
+// Copyright (c) 2018 The Zero developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+#include "core_memusage.h"
+#include "memusage.h"
+
+CBlockCache::CBlockCache(size_t nMaxUsageIn) : nUsage(0), nMaxUsage(nMaxUsageIn), nHits(0), nMisses(0) {}
+
+void CBlockCache::SetMaxUsage(size_t nMaxUsageIn)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    nMaxUsage = nMaxUsageIn;
+    Trim();
+}
+
+void CBlockCache::Trim()
+{
+    while (nUsage > nMaxUsage) {
+        nUsage -= entries.back().nUsage;
+        index.erase(entries.back().hash);
+        entries.pop_back();
+    }
+}
+
+std::list<CBlockCache::Entry>::iterator CBlockCache::Find(const uint256& hash, bool fDecoded)
+{
+    std::unordered_map<uint256, std::list<Entry>::iterator, EntryHasher>::iterator it = index.find(hash);
+    if (it == index.end() || (fDecoded ? !it->second->block : !it->second->raw)) {
+        nMisses++;
+        return entries.end();
+    }
+    nHits++;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second;
+}
+
+CBlockCache::Entry& CBlockCache::Insert(const uint256& hash)
+{
+    std::unordered_map<uint256, std::list<Entry>::iterator, EntryHasher>::iterator it = index.find(hash);
+    if (it != index.end()) {
+        entries.splice(entries.begin(), entries, it->second);
+        return *it->second;
+    }
+    entries.push_front(Entry());
+    entries.front().hash = hash;
+    entries.front().nUsage = 0;
+    index.insert(std::make_pair(hash, entries.begin()));
+    return entries.front();
+}
+
+void CBlockCache::Update(Entry& entry)
+{
+    size_t nEntryUsage = memusage::MallocUsage(sizeof(Entry) + 2 * sizeof(void*)) +
+                         memusage::MallocUsage(sizeof(std::pair<const uint256, std::list<Entry>::iterator>) + sizeof(void*));
+    if (entry.block) {
+        nEntryUsage += memusage::MallocUsage(sizeof(CBlock)) + RecursiveDynamicUsage(*entry.block) +
+                       memusage::DynamicUsage(entry.block->nSolution);
+    }
+    if (entry.raw)
+        nEntryUsage += memusage::MallocUsage(sizeof(std::vector<unsigned char>)) + memusage::DynamicUsage(*entry.raw);
+    nUsage += nEntryUsage - entry.nUsage;
+    entry.nUsage = nEntryUsage;
+
+    // This may drop the entry itself, if it is larger than the whole cache.
+    Trim();
+}
+
+CBlockCache::BlockPtr CBlockCache::GetBlock(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    std::list<Entry>::iterator it = Find(hash, true);
+    return it != entries.end() ? it->block : BlockPtr();
+}
+
+CBlockCache::RawBlockPtr CBlockCache::GetRawBlock(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    std::list<Entry>::iterator it = Find(hash, false);
+    return it != entries.end() ? it->raw : RawBlockPtr();
+}
+
+void CBlockCache::InsertBlock(const uint256& hash, const BlockPtr& block)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (nMaxUsage == 0)
+        return;
+    Entry& entry = Insert(hash);
+    entry.block = block;
+    Update(entry);
+}
+
+void CBlockCache::InsertRawBlock(const uint256& hash, const RawBlockPtr& raw)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (nMaxUsage == 0)
+        return;
+    Entry& entry = Insert(hash);
+    entry.raw = raw;
+    Update(entry);
+}
+
+void CBlockCache::Clear()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    entries.clear();
+    index.clear();
+    nUsage = 0;
+}
+
+CBlockCache::Stats CBlockCache::GetStats() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    Stats stats;
+    stats.nBlocks = entries.size();
+    stats.nUsage = nUsage;
+    stats.nMaxUsage = nMaxUsage;
+    stats.nHits = nHits;
+    stats.nMisses = nMisses;
+    return stats;
+}
@@ -0,0 +1,91 @@
+// Copyright (c) 2018 The Zero developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKCACHE_H
+#define BITCOIN_BLOCKCACHE_H
+
+#include "primitives/block.h"
+#include "uint256.h"
+
+#include <stdint.h>
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+/** Default for -blockcachesize, the memory for recently read blocks in megabytes */
+static const int64_t DEFAULT_BLOCK_CACHE_SIZE = 32;
+
+/**
+ * Recently read blocks, by hash, bounded by their memory usage.
+ *
+ * A block can be held decoded, for callers that look at its transactions,
+ * and as its serialized bytes, for peers that only need those; either form
+ * is only made when first asked for. The least recently used blocks are
+ * dropped once the cache goes over its size. Blocks are shared, never
+ * modified, so they stay valid for their users after they are dropped.
+ * Thread-safe.
+ */
+class CBlockCache
+{
+public:
+    typedef std::shared_ptr<const CBlock> BlockPtr;
+    typedef std::shared_ptr<const std::vector<unsigned char> > RawBlockPtr;
+
+    struct Stats {
+        size_t nBlocks;
+        size_t nUsage;
+        size_t nMaxUsage;
+        uint64_t nHits;
+        uint64_t nMisses;
+    };
+
+private:
+    struct Entry {
+        uint256 hash;
+        BlockPtr block;
+        RawBlockPtr raw;
+        size_t nUsage;
+    };
+
+    struct EntryHasher
+    {
+        size_t operator()(const uint256& hash) const { return hash.GetCheapHash(); }
+    };
+
+    mutable boost::mutex cs;
+    //! Entries from most to least recently used
+    std::list<Entry> entries;
+    std::unordered_map<uint256, std::list<Entry>::iterator, EntryHasher> index;
+    size_t nUsage;
+    size_t nMaxUsage;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    std::list<Entry>::iterator Find(const uint256& hash, bool fDecoded);
+    Entry& Insert(const uint256& hash);
+    void Update(Entry& entry);
+    void Trim();
+
+public:
+    explicit CBlockCache(size_t nMaxUsageIn);
+
+    void SetMaxUsage(size_t nMaxUsageIn);
+
+    //! The block, if held decoded; counts a hit or a miss
+    BlockPtr GetBlock(const uint256& hash);
+    //! The serialized block, if held; counts a hit or a miss
+    RawBlockPtr GetRawBlock(const uint256& hash);
+
+    void InsertBlock(const uint256& hash, const BlockPtr& block);
+    void InsertRawBlock(const uint256& hash, const RawBlockPtr& raw);
+
+    void Clear();
+    Stats GetStats() const;
+};
+
+#endif // BITCOIN_BLOCKCACHE_H
@@ -0,0 +1,199 @@
+// Copyright (c) 2018 The Zero developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockimport.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "consensus/consensus.h"
+#include "crypto/common.h"
+#include "main.h"
+#include "pow.h"
+#include "streams.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <boost/bind.hpp>
+
+CBlockFileReader::CBlockFileReader(FILE* fileIn, const CMessageHeader::MessageStartChars& messageStartIn, bool fParallelIn) :
+    file(fileIn), sync(std::make_shared<Sync>()), nPendingSize(0), fReaderDone(false), fStopReader(false), fParallel(fParallelIn)
+{
+    memcpy(messageStart, messageStartIn, MESSAGE_START_SIZE);
+    long nStartPos = ftell(file);
+    readerThread = boost::thread(boost::bind(&CBlockFileReader::ThreadRead, this, nStartPos < 0 ? 0 : nStartPos));
+}
+
+CBlockFileReader::~CBlockFileReader()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(sync->cs);
+        fStopReader = true;
+    }
+    sync->cond.notify_all();
+    if (readerThread.joinable())
+        readerThread.join();
+    fclose(file);
+}
+
+void CBlockFileReader::Decode(Entry& entry)
+{
+    try {
+        CDataStream ssBlock(entry.vchBlock.data(), entry.vchBlock.data() + entry.vchBlock.size(), SER_DISK, CLIENT_VERSION);
+        std::shared_ptr<CBlock> block = std::make_shared<CBlock>();
+        ssBlock >> *block;
+        entry.nRead = entry.vchBlock.size() - ssBlock.size();
+        entry.imported.hash = block->GetHash();
+        entry.imported.fPOWValid = CheckEquihashSolution(block.get(), Params()) &&
+                                   CheckProofOfWork(entry.imported.hash, block->nBits, Params().GetConsensus());
+        entry.imported.block = block;
+    } catch (const std::exception& e) {
+        entry.strError = e.what();
+    }
+    std::vector<char>().swap(entry.vchBlock);
+}
+
+void CBlockFileReader::DecodeJob(const std::shared_ptr<Sync>& sync, const std::shared_ptr<Entry>& entry)
+{
+    Decode(*entry);
+    boost::unique_lock<boost::mutex> lock(sync->cs);
+    entry->fDone = true;
+    sync->cond.notify_all();
+}
+
+void CBlockFileReader::ThreadRead(uint64_t nStartPos)
+{
+    RenameThread("zcash-loadblkrd");
+    std::vector<char> vchBuf(BLOCK_IMPORT_READ_SIZE);
+    // vchBuf[nBegin, nEnd) holds the file from nBufPos + nBegin
+    uint64_t nBufPos = nStartPos;
+    size_t nBegin = 0, nEnd = 0;
+    bool fEOF = false;
+
+    // Make nNeed bytes available from nBegin, if the file has them.
+    auto fill = [&](size_t nNeed) -> bool {
+        while (nEnd - nBegin < nNeed && !fEOF) {
+            if (nBegin > 0) {
+                memmove(&vchBuf[0], &vchBuf[nBegin], nEnd - nBegin);
+                nBufPos += nBegin;
+                nEnd -= nBegin;
+                nBegin = 0;
+            }
+            size_t nRead = fread(&vchBuf[nEnd], 1, vchBuf.size() - nEnd, file);
+            if (nRead == 0)
+                fEOF = true;
+            nEnd += nRead;
+        }
+        return nEnd - nBegin >= nNeed;
+    };
+
+    while (true) {
+        // locate a header
+        if (!fill(MESSAGE_START_SIZE + sizeof(uint32_t)))
+            break;
+        const char* pch = (const char*)memchr(&vchBuf[nBegin], messageStart[0], nEnd - nBegin);
+        if (pch == NULL) {
+            nBegin = nEnd;
+            continue;
+        }
+        nBegin = pch - &vchBuf[0];
+        if (!fill(MESSAGE_START_SIZE + sizeof(uint32_t)))
+            break;
+        if (memcmp(&vchBuf[nBegin], messageStart, MESSAGE_START_SIZE)) {
+            nBegin++;
+            continue;
+        }
+        // read size
+        unsigned int nSize = ReadLE32((const unsigned char*)&vchBuf[nBegin + MESSAGE_START_SIZE]);
+        if (nSize < 80 || nSize > MAX_BLOCK_SIZE || !fill(MESSAGE_START_SIZE + sizeof(uint32_t) + nSize)) {
+            nBegin++;
+            continue;
+        }
+
+        std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+        size_t nBlockBegin = nBegin + MESSAGE_START_SIZE + sizeof(uint32_t);
+        entry->nPos = nBufPos + nBlockBegin;
+        entry->vchBlock.assign(vchBuf.begin() + nBlockBegin, vchBuf.begin() + nBlockBegin + nSize);
+        entry->imported.nPos = entry->nPos;
+        entry->imported.nSize = nSize;
+        nBegin = nBlockBegin + nSize;
+        if (!fParallel) {
+            Decode(*entry);
+            entry->fDone = true;
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(sync->cs);
+            while (!fStopReader && !pending.empty() && nPendingSize + nSize > BLOCK_IMPORT_READ_AHEAD)
+                sync->cond.wait(lock);
+            if (fStopReader)
+                return;
+            pending.push_back(entry);
+            nPendingSize += nSize;
+            sync->cond.notify_all();
+        }
+        if (fParallel && !QueueCheckJob(std::bind(&CBlockFileReader::DecodeJob, sync, entry)))
+            DecodeJob(sync, entry);
+    }
+
+    boost::unique_lock<boost::mutex> lock(sync->cs);
+    fReaderDone = true;
+    sync->cond.notify_all();
+}
+
+void CBlockFileReader::Restart(uint64_t nPos)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(sync->cs);
+        fStopReader = true;
+    }
+    sync->cond.notify_all();
+    if (readerThread.joinable())
+        readerThread.join();
+
+    {
+        boost::unique_lock<boost::mutex> lock(sync->cs);
+        pending.clear();
+        nPendingSize = 0;
+        fReaderDone = false;
+        fStopReader = false;
+    }
+    if (fseek(file, nPos, SEEK_SET) != 0) {
+        boost::unique_lock<boost::mutex> lock(sync->cs);
+        fReaderDone = true;
+        return;
+    }
+    readerThread = boost::thread(boost::bind(&CBlockFileReader::ThreadRead, this, nPos));
+}
+
+bool CBlockFileReader::Next(CImportedBlock& imported)
+{
+    while (true) {
+        std::shared_ptr<Entry> entry;
+        {
+            boost::unique_lock<boost::mutex> lock(sync->cs);
+            while (!(pending.empty() ? fReaderDone : pending.front()->fDone))
+                sync->cond.wait(lock);
+            if (pending.empty())
+                return false;
+            entry = pending.front();
+            pending.pop_front();
+            nPendingSize -= entry->imported.nSize;
+            sync->cond.notify_all();
+        }
+
+        uint64_t nHeaderPos = entry->nPos - MESSAGE_START_SIZE - sizeof(uint32_t);
+        if (!entry->strError.empty()) {
+            LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, entry->strError);
+            Restart(nHeaderPos + 1);
+            continue;
+        }
+        // A block shorter than its stated size is followed by whatever
+        // comes after it, rather than by the end of the stated size.
+        if (entry->nRead < entry->imported.nSize)
+            Restart(entry->nPos + entry->nRead);
+        imported = entry->imported;
+        return true;
+    }
+}
@@ -0,0 +1,112 @@
+// Copyright (c) 2018 The Zero developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKIMPORT_H
+#define BITCOIN_BLOCKIMPORT_H
+
+#include "primitives/block.h"
+#include "protocol.h"
+#include "uint256.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+/** Size of the sequential reads of a block file being imported */
+static const size_t BLOCK_IMPORT_READ_SIZE = 16 * 1024 * 1024;
+/** Memory for the blocks read ahead of the one being imported */
+static const size_t BLOCK_IMPORT_READ_AHEAD = 64 * 1024 * 1024;
+
+/** A block read from a block file by CBlockFileReader. */
+struct CImportedBlock
+{
+    std::shared_ptr<CBlock> block;
+    uint256 hash;
+    //! Position of the block in the file, after its message start and size
+    uint64_t nPos;
+    //! Serialized size of the block
+    unsigned int nSize;
+    //! Whether the Equihash solution and proof of work were found valid
+    bool fPOWValid;
+
+    CImportedBlock() : nPos(0), nSize(0), fPOWValid(false) {}
+};
+
+/**
+ * Reads the blocks of a block file in file order, for -reindex and
+ * -loadblock.
+ *
+ * A reader thread, which only does I/O, looks for blocks in the file with
+ * large sequential reads, and the -par threads (QueueCheckJob) deserialize
+ * them and check their proof of work while the caller imports the blocks
+ * before them. A block that cannot be deserialized is skipped, and the file
+ * is searched again from the byte after its message start, as a file read
+ * with CBufferedFile would be. Without -par threads, the reader thread
+ * deserializes the blocks itself.
+ */
+class CBlockFileReader
+{
+private:
+    struct Entry
+    {
+        uint64_t nPos;
+        std::vector<char> vchBlock;
+        CImportedBlock imported;
+        //! Bytes of vchBlock used by the block
+        size_t nRead;
+        //! Empty unless the block could not be deserialized
+        std::string strError;
+        bool fDone;
+
+        Entry() : nPos(0), nRead(0), fDone(false) {}
+    };
+
+    FILE* file;
+    CMessageHeader::MessageStartChars messageStart;
+
+    //! Shared with the decoding jobs, which may outlive the reader at shutdown
+    struct Sync
+    {
+        boost::mutex cs;
+        boost::condition_variable cond;
+    };
+
+    std::shared_ptr<Sync> sync;
+    //! Blocks found and not yet taken by Next(), in file order
+    std::deque<std::shared_ptr<Entry> > pending;
+    size_t nPendingSize;
+    bool fReaderDone;
+    bool fStopReader;
+    //! Whether blocks are decoded on the -par threads
+    bool fParallel;
+
+    boost::thread readerThread;
+
+    static void Decode(Entry& entry);
+    static void DecodeJob(const std::shared_ptr<Sync>& sync, const std::shared_ptr<Entry>& entry);
+    void ThreadRead(uint64_t nStartPos);
+    //! Drop the blocks read so far and read again from nPos.
+    void Restart(uint64_t nPos);
+
+    CBlockFileReader(const CBlockFileReader&);
+    CBlockFileReader& operator=(const CBlockFileReader&);
+
+public:
+    //! Takes over fileIn, and closes it when destroyed.
+    CBlockFileReader(FILE* fileIn, const CMessageHeader::MessageStartChars& messageStartIn, bool fParallelIn);
+    ~CBlockFileReader();
+
+    //! Get the next block of the file. Returns false at the end of the file.
+    bool Next(CImportedBlock& imported);
+};
+
+#endif // BITCOIN_BLOCKIMPORT_H
@@ -5,8 +5,36 @@
 
 #include "chain.h"
 
+#include "main.h"
+#include "txdb.h"
+
 using namespace std;
 
+CBlockHeader CBlockIndex::GetBlockHeader() const
+{
+    CBlockHeader block;
+    block.nVersion       = nVersion;
+    if (pprev)
+        block.hashPrevBlock = pprev->GetBlockHash();
+    block.hashMerkleRoot = hashMerkleRoot;
+    block.hashFinalSaplingRoot   = hashFinalSaplingRoot;
+    block.nTime          = nTime;
+    block.nBits          = nBits;
+    block.nNonce         = nNonce;
+    block.nSolution      = GetSolution();
+    return block;
+}
+
+std::vector<unsigned char> CBlockIndex::GetSolution() const
+{
+    if (!fSolutionTrimmed)
+        return nSolution;
+    std::vector<unsigned char> solution;
+    if (!pblocktree->ReadBlockSolution(GetBlockHash(), solution))
+        throw std::runtime_error(strprintf("%s: failed to read solution of block %s", __func__, GetBlockHash().ToString()));
+    return solution;
+}
+
 /**
  * CChain implementation
  */
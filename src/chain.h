@@ -183,8 +183,12 @@ public:
     unsigned int nTime;
     unsigned int nBits;
     uint256 nNonce;
+    //! Empty once trimmed; use GetSolution() to read it
     std::vector<unsigned char> nSolution;
 
+    //! (memory only) Whether nSolution was dropped to be read back from the block tree DB
+    bool fSolutionTrimmed;
+
     //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
     uint32_t nSequenceId;
 
@@ -217,6 +221,7 @@ public:
         nBits          = 0;
         nNonce         = uint256();
         nSolution.clear();
+        fSolutionTrimmed = false;
     }
 
     CBlockIndex()
@@ -255,19 +260,18 @@ public:
         return ret;
     }
 
-    CBlockHeader GetBlockHeader() const
+    //! Build the full header, reading the solution back from disk if it was trimmed.
+    CBlockHeader GetBlockHeader() const;
+
+    //! The Equihash solution, read back from the block tree DB if it was trimmed.
+    std::vector<unsigned char> GetSolution() const;
+
+    //! Drop the solution from memory. Only valid once this entry has been
+    //! written to the block tree DB.
+    void TrimSolution()
     {
-        CBlockHeader block;
-        block.nVersion       = nVersion;
-        if (pprev)
-            block.hashPrevBlock = pprev->GetBlockHash();
-        block.hashMerkleRoot = hashMerkleRoot;
-        block.hashFinalSaplingRoot   = hashFinalSaplingRoot;
-        block.nTime          = nTime;
-        block.nBits          = nBits;
-        block.nNonce         = nNonce;
-        block.nSolution      = nSolution;
-        return block;
+        std::vector<unsigned char>().swap(nSolution);
+        fSolutionTrimmed = true;
     }
 
     uint256 GetBlockHash() const
@@ -347,6 +351,10 @@ public:
 
     explicit CDiskBlockIndex(const CBlockIndex* pindex) : CBlockIndex(*pindex) {
         hashPrev = (pprev ? pprev->GetBlockHash() : uint256());
+        if (fSolutionTrimmed) {
+            nSolution = pindex->GetSolution();
+            fSolutionTrimmed = false;
+        }
     }
 
     ADD_SERIALIZE_METHODS;
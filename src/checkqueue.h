@@ -6,6 +6,8 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <deque>
+#include <functional>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -16,25 +18,130 @@
 template <typename T>
 class CCheckQueueControl;
 
+class CCheckQueueBase;
+
+/**
+ * Pool of worker threads shared by several check queues.
+ * Each worker takes work from whichever of the queues has some, so the
+ * number of verification threads is the number of threads running
+ * Thread(), however many kinds of checks are being done at the same time.
+ */
+class CCheckQueueWorkers
+{
+private:
+    friend class CCheckQueueBase;
+    template <typename T> friend class CCheckQueue;
+    friend class CJobQueue;
+
+    //! Mutex to protect the inner state of the pool and of its queues
+    boost::mutex mutex;
+
+    //! Worker threads block on this when out of work
+    boost::condition_variable condWorker;
+
+    //! The queues served by the pool
+    std::vector<CCheckQueueBase*> vQueues;
+
+    //! The number of workers that are idle.
+    int nIdle;
+
+    //! The queue to look at first, so that every queue gets served.
+    size_t nNext;
+
+public:
+    CCheckQueueWorkers() : nIdle(0), nNext(0) {}
+
+    //! Worker thread
+    inline void Thread();
+};
+
+/** A queue of work served by the threads of a CCheckQueueWorkers. */
+class CCheckQueueBase
+{
+private:
+    friend class CCheckQueueWorkers;
+
+protected:
+    CCheckQueueWorkers* pworkers;
+
+    CCheckQueueBase() : pworkers(NULL) {}
+
+    //! Start being served by the threads of workers.
+    void Attach(CCheckQueueWorkers& workers)
+    {
+        boost::unique_lock<boost::mutex> lock(workers.mutex);
+        pworkers = &workers;
+        workers.vQueues.push_back(this);
+    }
+
+    //! Stop being served by the threads of the pool.
+    void Detach()
+    {
+        if (pworkers == NULL)
+            return;
+        boost::unique_lock<boost::mutex> lock(pworkers->mutex);
+        pworkers->vQueues.erase(std::find(pworkers->vQueues.begin(), pworkers->vQueues.end(), this));
+        pworkers = NULL;
+    }
+
+    virtual ~CCheckQueueBase()
+    {
+        Detach();
+    }
+
+    //! Whether there is work a worker can take. Called with the pool's mutex held.
+    virtual bool HasWork() const = 0;
+
+    /**
+     * Do some of the queued work. Called by a worker with the pool's mutex
+     * held by lock, which may be released while working but has to be held
+     * again on return.
+     */
+    virtual void Work(boost::unique_lock<boost::mutex>& lock) = 0;
+};
+
+void CCheckQueueWorkers::Thread()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (true) {
+        CCheckQueueBase* pqueue = NULL;
+        for (size_t i = 0; i < vQueues.size() && pqueue == NULL; i++) {
+            CCheckQueueBase* pcandidate = vQueues[(nNext + i) % vQueues.size()];
+            if (pcandidate->HasWork())
+                pqueue = pcandidate;
+        }
+        if (pqueue == NULL) {
+            nIdle++;
+            try {
+                condWorker.wait(lock); // wait
+            } catch (...) {
+                nIdle--;
+                throw;
+            }
+            nIdle--;
+            continue;
+        }
+        nNext++;
+        pqueue->Work(lock);
+    }
+}
+
 /** 
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
   *
   * One thread (the master) is assumed to push batches of verifications
-  * onto the queue, where they are processed by N-1 worker threads. When
-  * the master is done adding work, it temporarily joins the worker pool
-  * as an N'th worker, until all jobs are done.
+  * onto the queue, where they are processed by the threads of the worker
+  * pool. When the master is done adding work, it temporarily joins the
+  * pool as one more worker, until all jobs are done.
   */
 template <typename T>
-class CCheckQueue
+class CCheckQueue : public CCheckQueueBase
 {
 private:
-    //! Mutex to protect the inner state
-    boost::mutex mutex;
-
-    //! Worker threads block on this when out of work
-    boost::condition_variable condWorker;
+    //! The pool of a queue that is not given one
+    CCheckQueueWorkers ownWorkers;
 
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
@@ -43,10 +150,7 @@ private:
     //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
     std::vector<T> queue;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
-
-    //! The total number of workers (including the master).
+    //! The total number of threads (including the master) working on this queue.
     int nTotal;
 
     //! The temporary evaluation result.
@@ -59,116 +163,186 @@ private:
      */
     unsigned int nTodo;
 
-    //! Whether we're shutting down.
-    bool fQuit;
-
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
-    /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    /**
+     * Internal function that does bulk of the verification work.
+     * A worker returns to the pool once the queue is empty; the master
+     * waits until all the verifications are done.
+     */
+    bool Loop(boost::unique_lock<boost::mutex>& lock, bool fMaster)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
         unsigned int nNow = 0;
         bool fOk = true;
+        nTotal++;
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
+            // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
+            if (nNow) {
+                fAllOk &= fOk;
+                nTodo -= nNow;
+                if (nTodo == 0 && !fMaster)
+                    // We processed the last element; inform the master it can exit and return the result
+                    condMaster.notify_one();
+            }
+            // logically, the do loop starts here
+            while (queue.empty()) {
+                if (!fMaster || nTodo == 0) {
+                    nTotal--;
+                    bool fRet = fAllOk;
+                    // reset the status for new work later
+                    if (fMaster)
+                        fAllOk = true;
+                    // return the current status
+                    return fRet;
                 }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                condMaster.wait(lock); // wait
+            }
+            // Decide how many work units to process now.
+            // * Do not try to do everything at once, but aim for increasingly smaller batches so
+            //   all workers finish approximately simultaneously.
+            // * Try to account for idle jobs which will instantly start helping.
+            // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
+            nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + pworkers->nIdle + 1)));
+            vChecks.resize(nNow);
+            for (unsigned int i = 0; i < nNow; i++) {
+                // We want the lock on the mutex to be as short as possible, so swap jobs from the global
+                // queue to the local batch vector instead of copying.
+                vChecks[i].swap(queue.back());
+                queue.pop_back();
             }
+            // Check whether we need to do work at all
+            fOk = fAllOk;
+            lock.unlock();
             // execute work
             BOOST_FOREACH (T& check, vChecks)
                 if (fOk)
                     fOk = check();
             vChecks.clear();
+            lock.lock();
         } while (true);
     }
 
+protected:
+    bool HasWork() const
+    {
+        return !queue.empty();
+    }
+
+    void Work(boost::unique_lock<boost::mutex>& lock)
+    {
+        Loop(lock, false);
+    }
+
 public:
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    //! Create a new check queue, with its own pool of workers running Thread()
+    CCheckQueue(unsigned int nBatchSizeIn) : nTotal(0), fAllOk(true), nTodo(0), nBatchSize(nBatchSizeIn)
+    {
+        Attach(ownWorkers);
+    }
+
+    //! Create a new check queue, served by the threads of workers
+    CCheckQueue(CCheckQueueWorkers& workers, unsigned int nBatchSizeIn) : nTotal(0), fAllOk(true), nTodo(0), nBatchSize(nBatchSizeIn)
+    {
+        Attach(workers);
+    }
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        pworkers->Thread();
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        boost::unique_lock<boost::mutex> lock(pworkers->mutex);
+        return Loop(lock, true);
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
+        boost::unique_lock<boost::mutex> lock(pworkers->mutex);
         BOOST_FOREACH (T& check, vChecks) {
             queue.push_back(T());
             check.swap(queue.back());
         }
         nTodo += vChecks.size();
         if (vChecks.size() == 1)
-            condWorker.notify_one();
+            pworkers->condWorker.notify_one();
         else if (vChecks.size() > 1)
-            condWorker.notify_all();
+            pworkers->condWorker.notify_all();
     }
 
     ~CCheckQueue()
     {
+        // ownWorkers goes away before the base class does
+        Detach();
     }
 
     bool IsIdle()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        boost::unique_lock<boost::mutex> lock(pworkers->mutex);
+        return (nTotal == 0 && nTodo == 0 && fAllOk == true);
     }
 
 };
 
+/**
+ * Queue for jobs that have to be run by the threads of a worker pool, with
+ * no master waiting for them: each job reports its own result. Jobs are run
+ * in the order they were added.
+ */
+class CJobQueue : public CCheckQueueBase
+{
+private:
+    std::deque<std::function<void()> > queue;
+
+protected:
+    bool HasWork() const
+    {
+        return !queue.empty();
+    }
+
+    void Work(boost::unique_lock<boost::mutex>& lock)
+    {
+        // Run one job at a time, so that the pool gets back to the other queues in between
+        std::function<void()> job;
+        job.swap(queue.front());
+        queue.pop_front();
+        lock.unlock();
+        try {
+            job();
+        } catch (...) {
+            lock.lock();
+            throw;
+        }
+        lock.lock();
+    }
+
+public:
+    CJobQueue(CCheckQueueWorkers& workers)
+    {
+        Attach(workers);
+    }
+
+    ~CJobQueue()
+    {
+        Detach();
+    }
+
+    //! Add a job to the queue
+    void Add(const std::function<void()>& job)
+    {
+        boost::unique_lock<boost::mutex> lock(pworkers->mutex);
+        queue.push_back(job);
+        pworkers->condWorker.notify_one();
+    }
+};
+
 /** 
  * RAII-style controller object for a CCheckQueue that guarantees the passed
  * queue is finished before continuing.
@@ -720,7 +720,7 @@ invalidsolution:
 #endif // ENABLE_MINING
 
 template<unsigned int N, unsigned int K>
-bool Equihash<N,K>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln)
+bool Equihash<N,K>::IsValidSolution(const eh_HashState& base_state, const std::vector<unsigned char>& soln)
 {
     if (soln.size() != SolutionWidth) {
         LogPrint("pow", "Invalid solution length: %d (expected %d)\n",
@@ -728,43 +728,95 @@ bool Equihash<N,K>::IsValidSolution(const eh_HashState& base_state, std::vector<
         return false;
     }
 
-    std::vector<FullStepRow<FinalFullWidth>> X;
-    X.reserve(1 << K);
-    unsigned char tmpHash[HashOutput];
-    for (eh_index i : GetIndicesFromMinimal(soln, CollisionBitLength)) {
-        GenerateHash(base_state, i/IndicesPerHashOutput, tmpHash, HashOutput);
-        X.emplace_back(tmpHash+((i % IndicesPerHashOutput) * N/8),
-                       N/8, HashLength, CollisionBitLength, i);
-    }
+    // Everything below has a size known at compile time, so it is kept in
+    // fixed-size stack arrays. Once two subtrees are merged, their indices
+    // are just their leaves in order, so the index tree can be checked on
+    // the decoded indices directly.
+    enum : size_t { Leaves=1 << K };
+    eh_index indices[Leaves];
 
-    size_t hashLen = HashLength;
-    size_t lenIndices = sizeof(eh_index);
-    while (X.size() > 1) {
-        std::vector<FullStepRow<FinalFullWidth>> Xc;
-        for (int i = 0; i < X.size(); i += 2) {
-            if (!HasCollision(X[i], X[i+1], CollisionByteLength)) {
-                LogPrint("pow", "Invalid solution: invalid collision length between StepRows\n");
-                LogPrint("pow", "X[i]   = %s\n", X[i].GetHex(hashLen));
-                LogPrint("pow", "X[i+1] = %s\n", X[i+1].GetHex(hashLen));
-                return false;
+    // Decode the minimal encoding of the (CollisionBitLength+1)-bit indices
+    {
+        const uint32_t index_mask = ((uint32_t)1 << (CollisionBitLength+1)) - 1;
+        uint32_t acc_value = 0;
+        size_t acc_bits = 0;
+        size_t j = 0;
+        for (size_t i = 0; i < SolutionWidth; i++) {
+            acc_value = (acc_value << 8) | soln[i];
+            acc_bits += 8;
+            if (acc_bits >= CollisionBitLength+1) {
+                acc_bits -= CollisionBitLength+1;
+                indices[j++] = (acc_value >> acc_bits) & index_mask;
             }
-            if (X[i+1].IndicesBefore(X[i], hashLen, lenIndices)) {
+        }
+        assert(j == Leaves);
+    }
+
+    // Check the ordering and distinctness of the indices before doing any
+    // hashing, so that malformed solutions are rejected cheaply.
+    for (size_t r = 0; r < K; r++) {
+        for (size_t i = 0; i < Leaves; i += (size_t)2 << r) {
+            if (indices[i + ((size_t)1 << r)] < indices[i]) {
                 LogPrint("pow", "Invalid solution: Index tree incorrectly ordered\n");
                 return false;
             }
-            if (!DistinctIndices(X[i], X[i+1], hashLen, lenIndices)) {
-                LogPrint("pow", "Invalid solution: duplicate indices\n");
+        }
+    }
+    {
+        eh_index sorted[Leaves];
+        std::copy(indices, indices + Leaves, sorted);
+        std::sort(sorted, sorted + Leaves);
+        if (std::adjacent_find(sorted, sorted + Leaves) != sorted + Leaves) {
+            LogPrint("pow", "Invalid solution: duplicate indices\n");
+            return false;
+        }
+    }
+
+    // Build the tree depth-first, merging two subtrees as soon as both are
+    // complete, so that at most K+1 partial hashes are live at any time and
+    // a bad collision is found without hashing the rest of the solution.
+    // At level r, the first r*CollisionByteLength bytes of a hash have
+    // already collided and are ignored.
+    unsigned char hashes[K+1][HashLength];
+    size_t levels[K+1];
+    size_t depth = 0;
+
+    // A BLAKE2b output holds the hashes of IndicesPerHashOutput consecutive
+    // indices, so it is only recomputed when the next leaf needs another one.
+    unsigned char tmpHash[HashOutput];
+    for (size_t i = 0; i < Leaves; i++) {
+        eh_index block = indices[i] / IndicesPerHashOutput;
+        if (i == 0 || block != indices[i-1] / IndicesPerHashOutput) {
+            GenerateHash(base_state, block, tmpHash, HashOutput);
+        }
+        ExpandArray(tmpHash + (indices[i] % IndicesPerHashOutput) * N/8, N/8,
+                    hashes[depth], HashLength, CollisionBitLength);
+        levels[depth++] = 0;
+
+        while (depth >= 2 && levels[depth-1] == levels[depth-2]) {
+            const size_t offset = levels[depth-1] * CollisionByteLength;
+            unsigned char* a = hashes[depth-2];
+            const unsigned char* b = hashes[depth-1];
+            if (memcmp(a + offset, b + offset, CollisionByteLength) != 0) {
+                LogPrint("pow", "Invalid solution: invalid collision length between StepRows\n");
+                LogPrint("pow", "X[i]   = %s\n", HexStr(a + offset, a + HashLength));
+                LogPrint("pow", "X[i+1] = %s\n", HexStr(b + offset, b + HashLength));
                 return false;
             }
-            Xc.emplace_back(X[i], X[i+1], hashLen, lenIndices, CollisionByteLength);
+            for (size_t j = offset + CollisionByteLength; j < HashLength; j++) {
+                a[j] ^= b[j];
+            }
+            levels[depth-2]++;
+            depth--;
         }
-        X = Xc;
-        hashLen -= CollisionByteLength;
-        lenIndices *= 2;
     }
 
-    assert(X.size() == 1);
-    return X[0].IsZero(hashLen);
+    assert(depth == 1 && levels[0] == K);
+    for (size_t j = K * CollisionByteLength; j < HashLength; j++) {
+        if (hashes[0][j] != 0)
+            return false;
+    }
+    return true;
 }
 
 // Explicit instantiations for Equihash<96,3>
@@ -777,7 +829,7 @@ template bool Equihash<96,3>::OptimisedSolve(const eh_HashState& base_state,
                                              const std::function<bool(std::vector<unsigned char>)> validBlock,
                                              const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
-template bool Equihash<96,3>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+template bool Equihash<96,3>::IsValidSolution(const eh_HashState& base_state, const std::vector<unsigned char>& soln);
 
 // Explicit instantiations for Equihash<200,9>
 template int Equihash<200,9>::InitialiseState(eh_HashState& base_state);
@@ -789,7 +841,7 @@ template bool Equihash<200,9>::OptimisedSolve(const eh_HashState& base_state,
                                               const std::function<bool(std::vector<unsigned char>)> validBlock,
                                               const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
-template bool Equihash<200,9>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+template bool Equihash<200,9>::IsValidSolution(const eh_HashState& base_state, const std::vector<unsigned char>& soln);
 
 // Explicit instantiations for Equihash<96,5>
 template int Equihash<96,5>::InitialiseState(eh_HashState& base_state);
@@ -801,7 +853,7 @@ template bool Equihash<96,5>::OptimisedSolve(const eh_HashState& base_state,
                                              const std::function<bool(std::vector<unsigned char>)> validBlock,
                                              const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
-template bool Equihash<96,5>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+template bool Equihash<96,5>::IsValidSolution(const eh_HashState& base_state, const std::vector<unsigned char>& soln);
 
 // Explicit instantiations for Equihash<48,5>
 template int Equihash<48,5>::InitialiseState(eh_HashState& base_state);
@@ -813,7 +865,7 @@ template bool Equihash<48,5>::OptimisedSolve(const eh_HashState& base_state,
                                              const std::function<bool(std::vector<unsigned char>)> validBlock,
                                              const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
-template bool Equihash<48,5>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+template bool Equihash<48,5>::IsValidSolution(const eh_HashState& base_state, const std::vector<unsigned char>& soln);
 
 // Explicit instantiations for Equihash<192,7>
 template int Equihash<192,7>::InitialiseState(eh_HashState& base_state);
@@ -825,4 +877,4 @@ template bool Equihash<192,7>::OptimisedSolve(const eh_HashState& base_state,
                                              const std::function<bool(std::vector<unsigned char>)> validBlock,
                                              const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
-template bool Equihash<192,7>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+template bool Equihash<192,7>::IsValidSolution(const eh_HashState& base_state, const std::vector<unsigned char>& soln);
@@ -0,0 +1,403 @@
+// Copyright (c) 2018 The Zero developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#include "compat/endian.h"
+#include "crypto/equihash_bucket.h"
+#include "util.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <set>
+#include <thread>
+
+#ifdef ENABLE_MINING
+static EhSolverCancelledException bucket_solver_cancelled;
+
+namespace {
+
+/** Blocks until all threads working on a nonce have reached it. */
+class SolverBarrier
+{
+private:
+    std::mutex mutex;
+    std::condition_variable cond;
+    const unsigned int nThreads;
+    unsigned int nWaiting;
+    unsigned int nGeneration;
+
+public:
+    SolverBarrier(unsigned int nThreadsIn) : nThreads(nThreadsIn), nWaiting(0), nGeneration(0) {}
+
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        unsigned int nGenerationIn = nGeneration;
+        if (++nWaiting == nThreads) {
+            nWaiting = 0;
+            nGeneration++;
+            cond.notify_all();
+        } else {
+            cond.wait(lock, [this, nGenerationIn] { return nGeneration != nGenerationIn; });
+        }
+    }
+};
+
+constexpr size_t CeilLog2(size_t x, size_t bits = 0)
+{
+    return ((size_t)1 << bits) >= x ? bits : CeilLog2(x, bits + 1);
+}
+
+/** Reads len (at most 4) bytes as a big-endian integer. */
+inline uint32_t ReadDigit(const unsigned char* p, size_t len)
+{
+    uint32_t v = 0;
+    for (size_t i = 0; i < len; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+}
+
+/**
+ * Layout of the rows of round r. A row is its tree reference followed by the
+ * hash bits from the current digit's X bits onward, padded at the front to a
+ * whole number of words so that the hash of the next round is a suffix of the
+ * current one.
+ */
+template<unsigned int N, unsigned int K>
+struct BucketLayout
+{
+    typedef EquihashBucketSolver<N,K> Solver;
+
+    static constexpr size_t StoredBytes(size_t r)
+    {
+        return Solver::HashLength - r*Solver::CollisionByteLength - Solver::BucketBytes;
+    }
+    static constexpr size_t HashWords(size_t r) { return (StoredBytes(r) + 3)/4; }
+    static constexpr size_t Pad(size_t r) { return 4*HashWords(r) - StoredBytes(r); }
+    static constexpr size_t RowWords(size_t r) { return 1 + HashWords(r); }
+    /** Words at the front of a bucket holding the trees of earlier rounds */
+    static constexpr size_t TreeWords(size_t r) { return (r/2)*Solver::Slots; }
+    /** Checks that no round overwrites the trees of an earlier round */
+    static constexpr bool Fits(size_t r = 0)
+    {
+        return r >= K || (r/2 + RowWords(r) <= RowWords(r & 1) && Fits(r + 1));
+    }
+
+    enum : size_t { SlotBits=CeilLog2(Solver::Slots) };
+    enum : size_t { DeltaBits=32 - Solver::BucketBits - SlotBits };
+    enum : size_t { MaxDelta=((size_t)1 << DeltaBits) - 1 };
+    enum : size_t { MaxHashWords=(Solver::HashLength + 3)/4 };
+
+    /** Reference to the pair of rows (s0, s0 + delta) of a bucket in the previous round */
+    static uint32_t Tree(size_t bucket, size_t s0, size_t delta)
+    {
+        return (((bucket << SlotBits) | s0) << DeltaBits) | delta;
+    }
+    static size_t TreeBucket(uint32_t tree) { return tree >> (SlotBits + DeltaBits); }
+    static size_t TreeSlot(uint32_t tree) { return (tree >> DeltaBits) & (((size_t)1 << SlotBits) - 1); }
+    static size_t TreeDelta(uint32_t tree) { return tree & MaxDelta; }
+};
+
+template<unsigned int N, unsigned int K>
+struct EquihashBucketSolver<N,K>::WorkerScratch
+{
+    /** X bits of each row of the bucket being collided */
+    uint16_t xbits[Slots];
+    /** Rows of the bucket, sorted by their X bits */
+    uint16_t order[Slots];
+    uint32_t trees[Slots];
+    uint16_t xcount[XValues];
+};
+
+template<unsigned int N, unsigned int K>
+EquihashBucketSolver<N,K>::EquihashBucketSolver(unsigned int nThreadsIn) :
+    nThreads(std::max(nThreadsIn, 1U))
+{
+    typedef BucketLayout<N,K> Layout;
+    BOOST_STATIC_ASSERT(Slots < 65536);
+    BOOST_STATIC_ASSERT(Layout::DeltaBits >= 3);
+    BOOST_STATIC_ASSERT(Layout::Fits());
+
+    for (size_t p = 0; p < 2; p++) {
+        bucketWords[p] = Slots * Layout::RowWords(p);
+        rows[p].reset(new uint32_t[Buckets * bucketWords[p]]);
+        bucketRows[p].reset(new std::atomic<uint32_t>[Buckets]);
+    }
+    for (unsigned int i = 0; i < nThreads; i++) {
+        scratch.emplace_back(new WorkerScratch());
+    }
+}
+
+template<unsigned int N, unsigned int K>
+EquihashBucketSolver<N,K>::~EquihashBucketSolver()
+{
+}
+
+template<unsigned int N, unsigned int K>
+size_t EquihashBucketSolver<N,K>::MemoryUsage() const
+{
+    return Buckets * (bucketWords[0] + bucketWords[1]) * sizeof(uint32_t);
+}
+
+template<unsigned int N, unsigned int K>
+uint32_t* EquihashBucketSolver<N,K>::Bucket(size_t r, size_t bucket) const
+{
+    return rows[r & 1].get() + bucket * bucketWords[r & 1] + BucketLayout<N,K>::TreeWords(r);
+}
+
+template<unsigned int N, unsigned int K>
+uint32_t EquihashBucketSolver<N,K>::NextSlot(size_t r, size_t bucket)
+{
+    std::atomic<uint32_t>& count = bucketRows[r & 1][bucket];
+    if (nThreads == 1) {
+        uint32_t slot = count.load(std::memory_order_relaxed);
+        count.store(slot + 1, std::memory_order_relaxed);
+        return slot;
+    }
+    return count.fetch_add(1, std::memory_order_relaxed);
+}
+
+template<unsigned int N, unsigned int K>
+size_t EquihashBucketSolver<N,K>::TakeRows(size_t r, size_t bucket)
+{
+    std::atomic<uint32_t>& count = bucketRows[r & 1][bucket];
+    size_t n = count.load(std::memory_order_relaxed);
+    count.store(0, std::memory_order_relaxed);
+    return std::min(n, (size_t)Slots);
+}
+
+template<unsigned int N, unsigned int K>
+void EquihashBucketSolver<N,K>::GenerateRows(unsigned int id)
+{
+    typedef BucketLayout<N,K> Layout;
+    const size_t rowWords = Layout::RowWords(0);
+    const size_t pad = Layout::Pad(0);
+    const size_t nBlocks = (InitialRows + IndicesPerHashOutput - 1) / IndicesPerHashOutput;
+    const size_t begin = nBlocks * id / nThreads;
+    const size_t end = nBlocks * (id + 1) / nThreads;
+
+    unsigned char hash[HashOutput];
+    for (size_t g = begin; g < end; g++) {
+        eh_HashState blockState = state;
+        eh_index leg = htole32(g);
+        crypto_generichash_blake2b_update(&blockState, (const unsigned char*)&leg, sizeof(eh_index));
+        crypto_generichash_blake2b_final(&blockState, hash, HashOutput);
+        for (size_t i = 0; i < IndicesPerHashOutput; i++) {
+            size_t index = g * IndicesPerHashOutput + i;
+            if (index >= InitialRows) {
+                break;
+            }
+            const unsigned char* ph = hash + i * HashLength;
+            size_t bucket = ReadDigit(ph, CollisionByteLength) >> XBits;
+            uint32_t slot = NextSlot(0, bucket);
+            if (slot >= Slots) {
+                continue;
+            }
+            uint32_t* row = Bucket(0, bucket) + slot * rowWords;
+            row[0] = index;
+            row[1] = 0;
+            memcpy((unsigned char*)(row + 1) + pad, ph + BucketBytes, Layout::StoredBytes(0));
+        }
+    }
+}
+
+template<unsigned int N, unsigned int K>
+void EquihashBucketSolver<N,K>::CollideBucket(unsigned int id, size_t r, size_t b)
+{
+    typedef BucketLayout<N,K> Layout;
+    WorkerScratch& s = *scratch[id];
+    const size_t n = TakeRows(r, b);
+    uint32_t* bucket = Bucket(r, b);
+    const size_t rowWords = Layout::RowWords(r);
+    const size_t hashWords = Layout::HashWords(r);
+    const size_t pad = Layout::Pad(r);
+
+    // Counting sort of the rows by their X bits
+    std::fill(s.xcount, s.xcount + XValues, 0);
+    for (size_t i = 0; i < n; i++) {
+        const unsigned char* hash = (const unsigned char*)(bucket + i * rowWords + 1);
+        uint16_t x = ReadDigit(hash + pad, CollisionByteLength - BucketBytes) & (XValues - 1);
+        s.xbits[i] = x;
+        s.xcount[x]++;
+    }
+    uint16_t pos = 0;
+    for (size_t x = 0; x < XValues; x++) {
+        uint16_t count = s.xcount[x];
+        s.xcount[x] = pos;
+        pos += count;
+    }
+    for (size_t i = 0; i < n; i++) {
+        s.order[s.xcount[s.xbits[i]]++] = i;
+    }
+    for (size_t i = 0; i < n; i++) {
+        s.trees[i] = bucket[s.order[i] * rowWords];
+    }
+
+    // Rows with the same X bits collide on the whole digit
+    const bool fFinal = (r + 1 == K);
+    const size_t nextRowWords = fFinal ? 0 : Layout::RowWords(r + 1);
+    const size_t dropWords = fFinal ? 0 : hashWords - Layout::HashWords(r + 1);
+    const size_t nextDigit = pad + CollisionByteLength - BucketBytes;
+    for (size_t i = 0; i < n; ) {
+        const uint16_t x = s.xbits[s.order[i]];
+        size_t j = i + 1;
+        while (j < n && s.xbits[s.order[j]] == x) {
+            j++;
+        }
+        for (size_t a = i; a + 1 < j; a++) {
+            const uint32_t* hash0 = bucket + s.order[a] * rowWords + 1;
+            const size_t last = std::min(j, a + 1 + Layout::MaxDelta);
+            for (size_t c = a + 1; c < last; c++) {
+                const uint32_t* hash1 = bucket + s.order[c] * rowWords + 1;
+                if (fFinal) {
+                    if (std::equal(hash0, hash0 + hashWords, hash1)) {
+                        Candidate(s.trees[a], s.trees[c]);
+                    }
+                    continue;
+                }
+                // Equal hashes only lead to trivial solutions with repeated indices
+                if (hash0[hashWords - 1] == hash1[hashWords - 1]) {
+                    continue;
+                }
+                uint32_t xhash[Layout::MaxHashWords];
+                for (size_t w = 0; w < hashWords; w++) {
+                    xhash[w] = hash0[w] ^ hash1[w];
+                }
+                size_t nextBucket = ReadDigit((const unsigned char*)xhash + nextDigit, CollisionByteLength) >> XBits;
+                uint32_t slot = NextSlot(r + 1, nextBucket);
+                if (slot >= Slots) {
+                    continue;
+                }
+                uint32_t* row = Bucket(r + 1, nextBucket) + slot * nextRowWords;
+                row[0] = Layout::Tree(b, a, c - a);
+                std::copy(xhash + dropWords, xhash + hashWords, row + 1);
+            }
+        }
+        i = j;
+    }
+
+    // The rows are no longer needed, keep only their trees
+    if (!fFinal) {
+        std::copy(s.trees, s.trees + n, bucket);
+    }
+}
+
+template<unsigned int N, unsigned int K>
+void EquihashBucketSolver<N,K>::CollideRound(unsigned int id, size_t r)
+{
+    const size_t begin = Buckets * id / nThreads;
+    const size_t end = Buckets * (id + 1) / nThreads;
+    for (size_t b = begin; b < end; b++) {
+        CollideBucket(id, r, b);
+    }
+}
+
+template<unsigned int N, unsigned int K>
+void EquihashBucketSolver<N,K>::ListIndices(size_t r, uint32_t tree, eh_index* indices) const
+{
+    typedef BucketLayout<N,K> Layout;
+    if (r == 0) {
+        indices[0] = tree;
+        return;
+    }
+    const uint32_t* trees = Bucket(r - 1, Layout::TreeBucket(tree));
+    const size_t s0 = Layout::TreeSlot(tree);
+    const size_t half = (size_t)1 << (r - 1);
+    ListIndices(r - 1, trees[s0], indices);
+    ListIndices(r - 1, trees[s0 + Layout::TreeDelta(tree)], indices + half);
+    if (indices[0] > indices[half]) {
+        std::swap_ranges(indices, indices + half, indices + half);
+    }
+}
+
+template<unsigned int N, unsigned int K>
+void EquihashBucketSolver<N,K>::Candidate(uint32_t left, uint32_t right)
+{
+    const size_t half = SolutionIndices / 2;
+    std::vector<eh_index> indices(SolutionIndices);
+    ListIndices(K - 1, left, indices.data());
+    ListIndices(K - 1, right, indices.data() + half);
+    if (indices[0] > indices[half]) {
+        std::swap_ranges(indices.begin(), indices.begin() + half, indices.begin() + half);
+    }
+
+    std::vector<eh_index> sorted(indices);
+    std::sort(sorted.begin(), sorted.end());
+    if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(csSolutions);
+    solutions.push_back(indices);
+}
+
+template<unsigned int N, unsigned int K>
+bool EquihashBucketSolver<N,K>::Solve(const eh_HashState& base_state,
+                                      const std::function<bool(std::vector<unsigned char>)> validBlock,
+                                      const std::function<bool(EhSolverCancelCheck)> cancelled)
+{
+    state = base_state;
+    solutions.clear();
+    for (size_t p = 0; p < 2; p++) {
+        for (size_t b = 0; b < Buckets; b++) {
+            bucketRows[p][b].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    SolverBarrier barrier(nThreads);
+    std::atomic<bool> fCancelled(false);
+    auto worker = [this, &barrier, &fCancelled, &cancelled](unsigned int id) {
+        GenerateRows(id);
+        for (size_t r = 0; r < K; r++) {
+            // Only the calling thread checks, so that all threads agree
+            if (id == 0 && cancelled(r == 0 ? ListGeneration : RoundEnd)) {
+                fCancelled = true;
+            }
+            barrier.Wait();
+            if (fCancelled) {
+                return;
+            }
+            CollideRound(id, r);
+        }
+    };
+
+    LogPrint("pow", "Running bucket solver on %d threads\n", nThreads);
+    std::vector<std::thread> threads;
+    for (unsigned int id = 1; id < nThreads; id++) {
+        threads.emplace_back(worker, id);
+    }
+    worker(0);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    if (fCancelled || cancelled(FinalColliding)) {
+        throw bucket_solver_cancelled;
+    }
+
+    LogPrint("pow", "Found %d solutions\n", solutions.size());
+    std::set<std::vector<unsigned char>> solns;
+    for (const std::vector<eh_index>& indices : solutions) {
+        solns.insert(GetMinimalFromIndices(indices, CollisionBitLength));
+    }
+    for (const std::vector<unsigned char>& soln : solns) {
+        if (validBlock(soln)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Explicit instantiations for EquihashBucketSolver<96,5>
+template class EquihashBucketSolver<96,5>;
+
+// Explicit instantiations for EquihashBucketSolver<192,7>
+template class EquihashBucketSolver<192,7>;
+#endif // ENABLE_MINING
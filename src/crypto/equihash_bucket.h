@@ -0,0 +1,120 @@
+// Copyright (c) 2018 The Zero developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_EQUIHASH_BUCKET_H
+#define BITCOIN_EQUIHASH_BUCKET_H
+
+#include "crypto/equihash.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <boost/static_assert.hpp>
+
+#ifdef ENABLE_MINING
+/**
+ * Bucket-sort Equihash solver.
+ *
+ * Every round keeps its rows in 2^BucketBits buckets keyed by the leading
+ * bits of the digit being collided, so that a round only ever looks at one
+ * small bucket at a time. Inside a bucket the rows are counting-sorted by the
+ * remaining bits of the digit, and each colliding pair is written straight
+ * into the bucket of the next round selected by its XOR.
+ *
+ * Rows of consecutive rounds are kept in two buffers that are reused in turn.
+ * After a bucket has been processed its (sorted) tree references are written
+ * over the front of the bucket, where the rows of later rounds in the same
+ * buffer will not reach because hashes get shorter every round. The buffers
+ * are allocated once and reused for every nonce, and several threads can
+ * cooperate on one nonce by splitting the buckets of each round between them.
+ *
+ * The solver only handles parameters with byte aligned digits of at least 16
+ * bits, like the (192,7) parameters used by mainnet and testnet. Solutions can
+ * be lost when a bucket overflows, which is rare enough not to matter.
+ */
+template<unsigned int N, unsigned int K>
+class EquihashBucketSolver
+{
+private:
+    BOOST_STATIC_ASSERT(K < N);
+    BOOST_STATIC_ASSERT(N % 8 == 0);
+    BOOST_STATIC_ASSERT((N/(K+1)) % 8 == 0);
+    BOOST_STATIC_ASSERT(N/(K+1) >= 16);
+    BOOST_STATIC_ASSERT((N/(K+1)) + 1 < 8*sizeof(eh_index));
+
+public:
+    enum : size_t { CollisionBitLength=N/(K+1) };
+    enum : size_t { CollisionByteLength=CollisionBitLength/8 };
+    enum : size_t { HashLength=N/8 };
+    enum : size_t { IndicesPerHashOutput=512/N };
+    enum : size_t { HashOutput=IndicesPerHashOutput*N/8 };
+    enum : size_t { InitialRows=(size_t)1 << (CollisionBitLength + 1) };
+    enum : size_t { SolutionIndices=(size_t)1 << K };
+
+    /** Leading bits of a digit used to pick the bucket of a row */
+    enum : size_t { BucketBits=CollisionBitLength/2 };
+    enum : size_t { Buckets=(size_t)1 << BucketBits };
+    /** Remaining bits of a digit, collided inside a bucket */
+    enum : size_t { XBits=CollisionBitLength-BucketBits };
+    enum : size_t { XValues=(size_t)1 << XBits };
+    /** Whole bytes of a digit covered by the bucket bits, never stored */
+    enum : size_t { BucketBytes=BucketBits/8 };
+    /** Expected rows per bucket, plus headroom for the variance */
+    enum : size_t { RowsPerBucket=InitialRows/Buckets };
+    enum : size_t { Slots=RowsPerBucket + RowsPerBucket/8 + 64 };
+
+    EquihashBucketSolver(unsigned int nThreads = 1);
+    ~EquihashBucketSolver();
+
+    /**
+     * Solves for one nonce; base_state must already include the nonce.
+     * Candidate solutions are passed to validBlock on the calling thread,
+     * after all worker threads have finished.
+     */
+    bool Solve(const eh_HashState& base_state,
+               const std::function<bool(std::vector<unsigned char>)> validBlock,
+               const std::function<bool(EhSolverCancelCheck)> cancelled);
+
+    unsigned int Threads() const { return nThreads; }
+    /** Bytes allocated for the row buffers */
+    size_t MemoryUsage() const;
+
+private:
+    struct WorkerScratch;
+
+    unsigned int nThreads;
+    /** Row buffers of the even and odd rounds */
+    std::unique_ptr<uint32_t[]> rows[2];
+    size_t bucketWords[2];
+    /** Number of rows written to each bucket of the even and odd rounds */
+    std::unique_ptr<std::atomic<uint32_t>[]> bucketRows[2];
+    std::vector<std::unique_ptr<WorkerScratch>> scratch;
+
+    eh_HashState state;
+    std::mutex csSolutions;
+    std::vector<std::vector<eh_index>> solutions;
+
+    uint32_t* Bucket(size_t r, size_t bucket) const;
+    uint32_t* BucketTrees(size_t r, size_t bucket) const;
+    uint32_t NextSlot(size_t r, size_t bucket);
+    size_t TakeRows(size_t r, size_t bucket);
+
+    void GenerateRows(unsigned int id);
+    void CollideBucket(unsigned int id, size_t r, size_t bucket);
+    void CollideRound(unsigned int id, size_t r);
+    void ListIndices(size_t r, uint32_t tree, eh_index* indices) const;
+    void Candidate(uint32_t left, uint32_t right);
+};
+
+/** Returns true if the bucket solver supports the given parameters. */
+inline bool EhBucketSolverSupported(unsigned int n, unsigned int k)
+{
+    return n == 192 && k == 7;
+}
+#endif // ENABLE_MINING
+
+#endif // BITCOIN_EQUIHASH_BUCKET_H
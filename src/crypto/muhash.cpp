@@ -0,0 +1,163 @@
+// Copyright (c) 2018 The Zero developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/muhash.h"
+
+#include "crypto/sha256.h"
+#include "crypto/sha512.h"
+
+#include <string.h>
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; ++i)
+        limbs[i] = 0;
+}
+
+bool Num3072::IsOverflow() const
+{
+    if (limbs[0] <= (limb_t)0 - 1 - MAX_PRIME_DIFF)
+        return false;
+    for (int i = 1; i < LIMBS; ++i) {
+        if (limbs[i] != (limb_t)0 - 1)
+            return false;
+    }
+    return true;
+}
+
+void Num3072::FullReduce()
+{
+    // Subtracting the prime is adding MAX_PRIME_DIFF and dropping 2^3072.
+    limb_t carry = MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS && carry; ++i) {
+        limbs[i] += carry;
+        carry = limbs[i] < carry ? 1 : 0;
+    }
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    // Schoolbook product, into twice the limbs.
+    limb_t t[2 * LIMBS];
+    memset(t, 0, sizeof(t));
+    for (int i = 0; i < LIMBS; ++i) {
+        limb_t carry = 0;
+        for (int j = 0; j < LIMBS; ++j) {
+            double_limb_t v = (double_limb_t)limbs[i] * a.limbs[j] + t[i + j] + carry;
+            t[i + j] = (limb_t)v;
+            carry = (limb_t)(v >> LIMB_SIZE);
+        }
+        t[i + LIMBS] = carry;
+    }
+
+    // 2^3072 is MAX_PRIME_DIFF modulo the prime, so the upper half folds
+    // into the lower half multiplied by it.
+    limb_t carry = 0;
+    for (int i = 0; i < LIMBS; ++i) {
+        double_limb_t v = (double_limb_t)t[i + LIMBS] * MAX_PRIME_DIFF + t[i] + carry;
+        limbs[i] = (limb_t)v;
+        carry = (limb_t)(v >> LIMB_SIZE);
+    }
+    while (carry) {
+        double_limb_t v = (double_limb_t)carry * MAX_PRIME_DIFF;
+        int i = 0;
+        for (; i < LIMBS && v; ++i) {
+            v += limbs[i];
+            limbs[i] = (limb_t)v;
+            v >>= LIMB_SIZE;
+        }
+        carry = (limb_t)v;
+    }
+    if (IsOverflow())
+        FullReduce();
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // a^(p - 2) by square and multiply; all limbs of p - 2 but the lowest
+    // have every bit set.
+    Num3072 result;
+    for (int i = LIMBS - 1; i >= 0; --i) {
+        limb_t e = i == 0 ? (limb_t)0 - MAX_PRIME_DIFF - 2 : (limb_t)0 - 1;
+        for (int b = LIMB_SIZE - 1; b >= 0; --b) {
+            result.Multiply(result);
+            if ((e >> b) & 1)
+                result.Multiply(*this);
+        }
+    }
+    return result;
+}
+
+void Num3072::FromBytes(const unsigned char data[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; ++i) {
+        limb_t limb = 0;
+        for (int j = LIMB_SIZE / 8 - 1; j >= 0; --j)
+            limb = (limb << 8) | data[i * (LIMB_SIZE / 8) + j];
+        limbs[i] = limb;
+    }
+    if (IsOverflow())
+        FullReduce();
+}
+
+void Num3072::ToBytes(unsigned char out[BYTE_SIZE]) const
+{
+    for (int i = 0; i < LIMBS; ++i) {
+        limb_t limb = limbs[i];
+        for (int j = 0; j < LIMB_SIZE / 8; ++j) {
+            out[i * (LIMB_SIZE / 8) + j] = (unsigned char)limb;
+            limb >>= 8;
+        }
+    }
+}
+
+Num3072 MuHash3072::ToNum3072(const unsigned char hash[32])
+{
+    // Expand the element hash with SHA-512 in counter mode.
+    unsigned char data[Num3072::BYTE_SIZE];
+    for (unsigned char i = 0; i < Num3072::BYTE_SIZE / CSHA512::OUTPUT_SIZE; ++i)
+        CSHA512().Write(hash, 32).Write(&i, 1).Finalize(data + i * CSHA512::OUTPUT_SIZE);
+    Num3072 num;
+    num.FromBytes(data);
+    return num;
+}
+
+MuHash3072& MuHash3072::Insert(const unsigned char hash[32])
+{
+    numerator.Multiply(ToNum3072(hash));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const unsigned char hash[32])
+{
+    denominator.Multiply(ToNum3072(hash));
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator*=(const MuHash3072& other)
+{
+    numerator.Multiply(other.numerator);
+    denominator.Multiply(other.denominator);
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator/=(const MuHash3072& other)
+{
+    // other may be this set
+    Num3072 otherNumerator = other.numerator;
+    numerator.Multiply(other.denominator);
+    denominator.Multiply(otherNumerator);
+    return *this;
+}
+
+void MuHash3072::Finalize(unsigned char hash[OUTPUT_SIZE])
+{
+    numerator.Multiply(denominator.GetInverse());
+    denominator.SetToOne();
+
+    unsigned char data[Num3072::BYTE_SIZE];
+    numerator.ToBytes(data);
+    CSHA256().Write(data, sizeof(data)).Finalize(hash);
+}
@@ -0,0 +1,110 @@
+// Copyright (c) 2018 The Zero developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_MUHASH_H
+#define BITCOIN_CRYPTO_MUHASH_H
+
+#if defined(HAVE_CONFIG_H)
+#include "bitcoin-config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** An integer modulo the prime 2^3072 - 1103717. */
+class Num3072
+{
+public:
+#ifdef __SIZEOF_INT128__
+    typedef unsigned __int128 double_limb_t;
+    typedef uint64_t limb_t;
+    static const int LIMBS = 48;
+    static const int LIMB_SIZE = 64;
+#else
+    typedef uint64_t double_limb_t;
+    typedef uint32_t limb_t;
+    static const int LIMBS = 96;
+    static const int LIMB_SIZE = 32;
+#endif
+    static const size_t BYTE_SIZE = 384;
+    //! 2^3072 minus the modulus
+    static const limb_t MAX_PRIME_DIFF = 1103717;
+
+    limb_t limbs[LIMBS];
+
+    Num3072() { SetToOne(); }
+
+    void SetToOne();
+    //! Multiply by a, modulo the prime.
+    void Multiply(const Num3072& a);
+    //! The multiplicative inverse, by exponentiation. This is slow.
+    Num3072 GetInverse() const;
+
+    //! Little endian, fully reduced.
+    void FromBytes(const unsigned char data[BYTE_SIZE]);
+    void ToBytes(unsigned char out[BYTE_SIZE]) const;
+
+private:
+    bool IsOverflow() const;
+    void FullReduce();
+};
+
+/**
+ * Hash of a set of elements that can be updated one element at a time, in
+ * any order.
+ *
+ * Each element, given as a 32-byte hash, is expanded to a number modulo a
+ * 3072-bit prime; the set hash is the product of those numbers. Removing an
+ * element divides by its number. Divisions are kept in a separate
+ * denominator so that each update is a single multiplication, and the one
+ * inversion needed is done by Finalize. Finding two sets with the same hash
+ * is believed to be as hard as the discrete logarithm in that group.
+ */
+class MuHash3072
+{
+private:
+    Num3072 numerator;
+    Num3072 denominator;
+
+    static Num3072 ToNum3072(const unsigned char hash[32]);
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+
+    //! The hash of the empty set.
+    MuHash3072() {}
+
+    MuHash3072& Insert(const unsigned char hash[32]);
+    MuHash3072& Remove(const unsigned char hash[32]);
+
+    //! Add all elements of another set.
+    MuHash3072& operator*=(const MuHash3072& other);
+    //! Remove all elements of another set.
+    MuHash3072& operator/=(const MuHash3072& other);
+
+    //! Compute the 32-byte hash of the set; also simplifies the state.
+    void Finalize(unsigned char hash[OUTPUT_SIZE]);
+
+    template<typename Stream>
+    void Serialize(Stream& s) const
+    {
+        unsigned char data[Num3072::BYTE_SIZE];
+        numerator.ToBytes(data);
+        s.write((const char*)data, sizeof(data));
+        denominator.ToBytes(data);
+        s.write((const char*)data, sizeof(data));
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s)
+    {
+        unsigned char data[Num3072::BYTE_SIZE];
+        s.read((char*)data, sizeof(data));
+        numerator.FromBytes(data);
+        s.read((char*)data, sizeof(data));
+        denominator.FromBytes(data);
+    }
+};
+
+#endif // BITCOIN_CRYPTO_MUHASH_H
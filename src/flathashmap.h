@@ -0,0 +1,354 @@
+// Copyright (c) 2018 The Zero developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FLATHASHMAP_H
+#define BITCOIN_FLATHASHMAP_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Unordered map with open addressing, for the coins cache.
+ *
+ * The table is a flat array of 8-byte slots, probed linearly. A slot holds
+ * the low 32 bits of the key's hash and the index of the element in a pool,
+ * so a probe only touches an element when those bits match. Elements are
+ * allocated in chunks and never move, which keeps references and pointers to
+ * them valid until they are erased, like those of std::unordered_map.
+ *
+ * Erasing leaves a marker in the slot, so erasing never invalidates other
+ * iterators, and the common "it = erase(it)" or "erase(it++)" loops work.
+ * Inserting may rehash the table and invalidate all iterators (but not
+ * references). clear() releases all memory, so a flushed cache shrinks.
+ */
+template <typename K, typename V, typename Hash>
+class flathashmap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const K, V> value_type;
+    typedef size_t size_type;
+    typedef Hash hasher;
+
+private:
+    struct Slot {
+        //! Element index + FIRST_INDEX, or EMPTY / ERASED
+        uint32_t index;
+        uint32_t hash;
+    };
+    enum : uint32_t { EMPTY = 0, ERASED = 1, FIRST_INDEX = 2 };
+
+    typedef typename std::aligned_storage<sizeof(value_type), std::alignment_of<value_type>::value>::type Storage;
+    //! Elements per chunk: a power of two, about 8 KiB worth
+    enum : size_t { CHUNK_SHIFT = sizeof(value_type) >= 2048 ? 2 : sizeof(value_type) >= 512 ? 4 : sizeof(value_type) >= 128 ? 6 : 7 };
+    enum : size_t { CHUNK_SIZE = (size_t)1 << CHUNK_SHIFT };
+
+    Slot* slots;
+    size_t nSlots;
+    size_t nElements;
+    size_t nErased;
+    std::vector<Storage*> chunks;
+    //! Pool indexes never used so far start here; freed ones are listed in vFree
+    uint32_t nPoolUsed;
+    std::vector<uint32_t> vFree;
+    Hash hash_function;
+
+    value_type* element(uint32_t index) const
+    {
+        return reinterpret_cast<value_type*>(&chunks[index >> CHUNK_SHIFT][index & (CHUNK_SIZE - 1)]);
+    }
+
+    uint32_t allocate()
+    {
+        if (!vFree.empty()) {
+            uint32_t index = vFree.back();
+            vFree.pop_back();
+            return index;
+        }
+        if ((nPoolUsed >> CHUNK_SHIFT) == chunks.size()) {
+            assert(nPoolUsed < UINT32_MAX - CHUNK_SIZE - FIRST_INDEX);
+            chunks.push_back(new Storage[CHUNK_SIZE]);
+        }
+        return nPoolUsed++;
+    }
+
+    /** Slot holding key, or where it would be inserted if missing. */
+    size_t probe(const K& key, uint32_t h, bool& found) const
+    {
+        size_t mask = nSlots - 1;
+        size_t pos = h & mask;
+        size_t posFree = nSlots;
+        while (true) {
+            const Slot& slot = slots[pos];
+            if (slot.index == EMPTY) {
+                found = false;
+                return posFree != nSlots ? posFree : pos;
+            }
+            if (slot.index == ERASED) {
+                if (posFree == nSlots)
+                    posFree = pos;
+            } else if (slot.hash == h && element(slot.index - FIRST_INDEX)->first == key) {
+                found = true;
+                return pos;
+            }
+            pos = (pos + 1) & mask;
+        }
+    }
+
+    void rehash(size_t nSlotsNew)
+    {
+        Slot* slotsNew = new Slot[nSlotsNew];
+        memset(slotsNew, 0, nSlotsNew * sizeof(Slot));
+        size_t mask = nSlotsNew - 1;
+        for (size_t i = 0; i < nSlots; i++) {
+            if (slots[i].index < FIRST_INDEX)
+                continue;
+            size_t pos = slots[i].hash & mask;
+            while (slotsNew[pos].index != EMPTY)
+                pos = (pos + 1) & mask;
+            slotsNew[pos] = slots[i];
+        }
+        delete[] slots;
+        slots = slotsNew;
+        nSlots = nSlotsNew;
+        nErased = 0;
+    }
+
+    /** Make room for one more element, keeping slots at most 3/4 in use. */
+    void reserve_one()
+    {
+        if ((nElements + nErased + 1) * 4 <= nSlots * 3)
+            return;
+        size_t nSlotsNew = 16;
+        while ((nElements + 1) * 2 > nSlotsNew)
+            nSlotsNew *= 2;
+        rehash(nSlotsNew);
+    }
+
+    void release(size_t pos)
+    {
+        uint32_t index = slots[pos].index - FIRST_INDEX;
+        element(index)->~value_type();
+        vFree.push_back(index);
+        nElements--;
+        slots[pos].index = ERASED;
+        nErased++;
+        // Markers right before an empty slot are not in the way of any
+        // probe, so they can be turned back into empty slots.
+        size_t mask = nSlots - 1;
+        if (slots[(pos + 1) & mask].index != EMPTY)
+            return;
+        while (slots[pos].index == ERASED) {
+            slots[pos].index = EMPTY;
+            nErased--;
+            pos = (pos - 1) & mask;
+        }
+    }
+
+public:
+    template <bool Const>
+    class iter
+    {
+    private:
+        typedef typename std::conditional<Const, const flathashmap*, flathashmap*>::type map_pointer;
+        map_pointer map;
+        size_t pos;
+        friend class flathashmap;
+        friend class iter<!Const>;
+
+        void skip()
+        {
+            while (pos < map->nSlots && map->slots[pos].index < FIRST_INDEX)
+                pos++;
+        }
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef typename flathashmap::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef typename std::conditional<Const, const value_type*, value_type*>::type pointer;
+        typedef typename std::conditional<Const, const value_type&, value_type&>::type reference;
+
+        iter() : map(NULL), pos(0) {}
+        iter(map_pointer mapIn, size_t posIn) : map(mapIn), pos(posIn) { skip(); }
+        //! iterator converts to const_iterator
+        template <bool C = Const, typename std::enable_if<C, int>::type = 0>
+        iter(const iter<false>& other) : map(other.map), pos(other.pos) {}
+
+        reference operator*() const { return *map->element(map->slots[pos].index - FIRST_INDEX); }
+        pointer operator->() const { return map->element(map->slots[pos].index - FIRST_INDEX); }
+        iter& operator++() { pos++; skip(); return *this; }
+        iter operator++(int) { iter copy(*this); ++(*this); return copy; }
+        template <bool C>
+        bool operator==(const iter<C>& other) const { return pos == other.pos; }
+        template <bool C>
+        bool operator!=(const iter<C>& other) const { return pos != other.pos; }
+    };
+    typedef iter<false> iterator;
+    typedef iter<true> const_iterator;
+
+    explicit flathashmap(const Hash& hashIn = Hash()) : slots(NULL), nSlots(0), nElements(0), nErased(0), nPoolUsed(0), hash_function(hashIn) {}
+
+    flathashmap(const flathashmap& other) : slots(NULL), nSlots(0), nElements(0), nErased(0), nPoolUsed(0), hash_function(other.hash_function)
+    {
+        for (const_iterator it = other.begin(); it != other.end(); it++)
+            insert(*it);
+    }
+
+    flathashmap(flathashmap&& other) : flathashmap(other.hash_function)
+    {
+        swap(other);
+    }
+
+    flathashmap& operator=(flathashmap other)
+    {
+        swap(other);
+        return *this;
+    }
+
+    ~flathashmap()
+    {
+        clear();
+    }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, nSlots); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, nSlots); }
+
+    size_type size() const { return nElements; }
+    bool empty() const { return nElements == 0; }
+
+    iterator find(const K& key)
+    {
+        if (nElements == 0)
+            return end();
+        bool found;
+        size_t pos = probe(key, (uint32_t)hash_function(key), found);
+        return found ? iterator(this, pos) : end();
+    }
+
+    const_iterator find(const K& key) const
+    {
+        return const_cast<flathashmap*>(this)->find(key);
+    }
+
+    size_type count(const K& key) const { return find(key) != end() ? 1 : 0; }
+
+    /** Construct an element in place, unless one with the same key exists. */
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args)
+    {
+        reserve_one();
+        uint32_t index = allocate();
+        value_type* value = element(index);
+        try {
+            new (value) value_type(std::forward<Args>(args)...);
+        } catch (...) {
+            vFree.push_back(index);
+            throw;
+        }
+        uint32_t h = (uint32_t)hash_function(value->first);
+        bool found;
+        size_t pos = probe(value->first, h, found);
+        if (found) {
+            value->~value_type();
+            vFree.push_back(index);
+            return std::make_pair(iterator(this, pos), false);
+        }
+        if (slots[pos].index == ERASED)
+            nErased--;
+        slots[pos].index = index + FIRST_INDEX;
+        slots[pos].hash = h;
+        nElements++;
+        return std::make_pair(iterator(this, pos), true);
+    }
+
+    template <typename P>
+    std::pair<iterator, bool> insert(P&& value)
+    {
+        iterator it = find(value.first);
+        if (it != end())
+            return std::make_pair(it, false);
+        return emplace(std::forward<P>(value));
+    }
+
+    V& operator[](const K& key)
+    {
+        iterator it = find(key);
+        if (it != end())
+            return it->second;
+        return emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple()).first->second;
+    }
+
+    iterator erase(const_iterator it)
+    {
+        release(it.pos);
+        return iterator(this, it.pos + 1);
+    }
+
+    iterator erase(iterator it)
+    {
+        return erase(const_iterator(it));
+    }
+
+    size_type erase(const K& key)
+    {
+        iterator it = find(key);
+        if (it == end())
+            return 0;
+        erase(it);
+        return 1;
+    }
+
+    /** Remove all elements and release all memory. */
+    void clear()
+    {
+        for (size_t i = 0; i < nSlots; i++) {
+            if (slots[i].index >= FIRST_INDEX)
+                element(slots[i].index - FIRST_INDEX)->~value_type();
+        }
+        for (size_t i = 0; i < chunks.size(); i++)
+            delete[] chunks[i];
+        delete[] slots;
+        slots = NULL;
+        nSlots = 0;
+        nElements = 0;
+        nErased = 0;
+        std::vector<Storage*>().swap(chunks);
+        nPoolUsed = 0;
+        std::vector<uint32_t>().swap(vFree);
+    }
+
+    void swap(flathashmap& other)
+    {
+        std::swap(slots, other.slots);
+        std::swap(nSlots, other.nSlots);
+        std::swap(nElements, other.nElements);
+        std::swap(nErased, other.nErased);
+        chunks.swap(other.chunks);
+        std::swap(nPoolUsed, other.nPoolUsed);
+        vFree.swap(other.vFree);
+        std::swap(hash_function, other.hash_function);
+    }
+
+    //! Sizes of the blocks of memory held, for memusage::DynamicUsage
+    size_t slots_memory() const { return nSlots * sizeof(Slot); }
+    size_t chunk_memory() const { return CHUNK_SIZE * sizeof(Storage); }
+    size_t chunk_count() const { return chunks.size(); }
+    size_t chunk_list_memory() const { return chunks.capacity() * sizeof(Storage*); }
+    size_t free_list_memory() const { return vFree.capacity() * sizeof(uint32_t); }
+};
+
+#endif // BITCOIN_FLATHASHMAP_H
@@ -549,6 +549,45 @@ TEST(checktransaction_tests, non_canonical_ed25519_signature) {
     ContextualCheckTransaction(tx, state, 0, 100, []() { return false; });
 }
 
+TEST(checktransaction_tests, InvalidSaplingSpendDescription) {
+    SelectParams(CBaseChainParams::REGTEST);
+    uint32_t consensusBranchId = NetworkUpgradeInfo[Consensus::UPGRADE_SAPLING].nBranchId;
+
+    CMutableTransaction mtx = GetValidTransaction();
+    mtx.fOverwintered = true;
+    mtx.nVersionGroupId = SAPLING_VERSION_GROUP_ID;
+    mtx.nVersion = SAPLING_TX_VERSION;
+    mtx.vjoinsplit.clear();
+    mtx.vShieldedSpend.resize(1);
+    CTransaction tx(mtx);
+
+    // Checked inline, the failure is reported through the validation state
+    {
+        MockCValidationState state;
+        EXPECT_CALL(state, DoS(100, false, REJECT_INVALID, "bad-txns-sapling-spend-description-invalid", false)).Times(1);
+        EXPECT_FALSE(ContextualCheckSaplingProofs(tx, state, consensusBranchId));
+    }
+
+    // Deferred, a single check is queued for the whole transaction
+    {
+        MockCValidationState state;
+        std::vector<CSaplingCheck> vChecks;
+        EXPECT_TRUE(ContextualCheckSaplingProofs(tx, state, consensusBranchId, &vChecks));
+        ASSERT_EQ(vChecks.size(), 1);
+        EXPECT_FALSE(vChecks[0]());
+        EXPECT_EQ(vChecks[0].GetSaplingError(), SAPLING_ERR_SPEND);
+    }
+
+    // Transactions without Sapling descriptions queue nothing
+    {
+        MockCValidationState state;
+        std::vector<CSaplingCheck> vChecks;
+        CTransaction sproutTx(GetValidTransaction());
+        EXPECT_TRUE(ContextualCheckSaplingProofs(sproutTx, state, consensusBranchId, &vChecks));
+        EXPECT_TRUE(vChecks.empty());
+    }
+}
+
 TEST(checktransaction_tests, OverwinterConstructors) {
     CMutableTransaction mtx;
     mtx.fOverwintered = true;
@@ -0,0 +1,29 @@
+#include <gtest/gtest.h>
+
+#include "proofcache.h"
+#include "random.h"
+#include "util.h"
+
+TEST(proofcache_tests, InsertAndLookup) {
+    uint256 txid = GetRandHash();
+    uint32_t branchId = 0x76b809bb;
+
+    EXPECT_FALSE(ProofCacheContains(txid, branchId, PROOF_CACHE_SAPLING));
+    ProofCacheInsert(txid, branchId, PROOF_CACHE_SAPLING);
+    EXPECT_TRUE(ProofCacheContains(txid, branchId, PROOF_CACHE_SAPLING));
+
+    // Entries are specific to the consensus branch and the kind of proof
+    EXPECT_FALSE(ProofCacheContains(txid, branchId + 1, PROOF_CACHE_SAPLING));
+    EXPECT_FALSE(ProofCacheContains(txid, branchId, PROOF_CACHE_SPROUT));
+    EXPECT_FALSE(ProofCacheContains(GetRandHash(), branchId, PROOF_CACHE_SAPLING));
+}
+
+TEST(proofcache_tests, DisabledCache) {
+    mapArgs["-maxproofcachesize"] = "0";
+
+    uint256 txid = GetRandHash();
+    ProofCacheInsert(txid, 0, PROOF_CACHE_SPROUT);
+    EXPECT_FALSE(ProofCacheContains(txid, 0, PROOF_CACHE_SPROUT));
+
+    mapArgs.erase("-maxproofcachesize");
+}
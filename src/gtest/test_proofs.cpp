@@ -517,6 +517,102 @@ TEST(proofs, zksnark_serializes_properly)
     }
 }
 
+TEST(proofs, multi_miller_loop)
+{
+    std::vector<curve_pp::G1_precomp_type> prec_P;
+    std::vector<curve_pp::G2_precomp_type> prec_Q;
+    curve_GT expected = curve_GT::one();
+
+    for (size_t i = 0; i < 5; i++) {
+        auto P = curve_G1::random_element();
+        auto Q = curve_G2::random_element();
+        prec_P.push_back(curve_pp::precompute_G1(P));
+        prec_Q.push_back(curve_pp::precompute_G2(Q));
+        expected = expected * curve_pp::reduced_pairing(P, Q);
+
+        ASSERT_TRUE(
+            curve_pp::final_exponentiation(curve_pp::multi_miller_loop(prec_P, prec_Q)) ==
+            expected
+        );
+    }
+}
+
+TEST(proofs, batch_verification)
+{
+    auto example = libsnark::generate_r1cs_example_with_field_input<curve_Fr>(250, 4);
+    example.constraint_system.swap_AB_if_beneficial();
+    auto kp = libsnark::r1cs_ppzksnark_generator<curve_pp>(example.constraint_system);
+    auto vkprecomp = libsnark::r1cs_ppzksnark_verifier_process_vk(kp.vk);
+
+    std::vector<libsnark::r1cs_ppzksnark_proof<curve_pp>> proofs;
+    for (size_t i = 0; i < 4; i++) {
+        proofs.push_back(libsnark::r1cs_ppzksnark_prover<curve_pp>(
+            kp.pk,
+            example.primary_input,
+            example.auxiliary_input,
+            example.constraint_system
+        ));
+    }
+
+    {
+        auto verifier = ProofVerifier::Batch();
+        for (auto& proof : proofs) {
+            ASSERT_TRUE(verifier.check(kp.vk, vkprecomp, example.primary_input, proof));
+        }
+        ASSERT_TRUE(verifier.verify_batch());
+        // The batch is emptied by verify_batch()
+        ASSERT_TRUE(verifier.verify_batch());
+    }
+
+    // A single invalid proof causes the whole batch to fail
+    {
+        auto badproof = PHGRProof::random_invalid().to_libsnark_proof<libsnark::r1cs_ppzksnark_proof<curve_pp>>();
+        auto verifier = ProofVerifier::Batch();
+        for (auto& proof : proofs) {
+            verifier.check(kp.vk, vkprecomp, example.primary_input, proof);
+        }
+        verifier.check(kp.vk, vkprecomp, example.primary_input, badproof);
+        ASSERT_FALSE(verifier.verify_batch());
+    }
+
+    // ... as does a valid proof for a different primary input
+    {
+        auto primary_input = example.primary_input;
+        primary_input[0] = primary_input[0] + curve_Fr::one();
+        auto verifier = ProofVerifier::Batch();
+        for (auto& proof : proofs) {
+            verifier.check(kp.vk, vkprecomp, example.primary_input, proof);
+        }
+        verifier.check(kp.vk, vkprecomp, primary_input, proofs[0]);
+        ASSERT_FALSE(verifier.verify_batch());
+    }
+
+    // ... or a proof with any one of its elements altered
+    for (size_t i = 0; i < 6; i++) {
+        auto proof = proofs[1];
+        switch (i) {
+            case 0: proof.g_A.g = proof.g_A.g + curve_G1::one(); break;
+            case 1: proof.g_A.h = proof.g_A.h + curve_G1::one(); break;
+            case 2: proof.g_B.h = proof.g_B.h + curve_G1::one(); break;
+            case 3: proof.g_C.h = proof.g_C.h + curve_G1::one(); break;
+            case 4: proof.g_H = proof.g_H + curve_G1::one(); break;
+            case 5: proof.g_K = proof.g_K + curve_G1::one(); break;
+        }
+
+        auto verifier = ProofVerifier::Batch();
+        verifier.check(kp.vk, vkprecomp, example.primary_input, proofs[0]);
+        verifier.check(kp.vk, vkprecomp, example.primary_input, proof);
+        ASSERT_FALSE(verifier.verify_batch());
+    }
+
+    // Verifiers that aren't batching have nothing to verify afterwards
+    {
+        auto verifier = ProofVerifier::Strict();
+        ASSERT_TRUE(verifier.check(kp.vk, vkprecomp, example.primary_input, proofs[0]));
+        ASSERT_TRUE(verifier.verify_batch());
+    }
+}
+
 TEST(proofs, g1_deserialization)
 {
     CompressedG1 g;
@@ -0,0 +1,85 @@
+// Copyright (c) 2018 The Zero developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_LRUCACHE_H
+#define BITCOIN_LRUCACHE_H
+
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * STL-like map container that keeps at most N elements, dropping the least
+ * recently used one when a new element does not fit. Lookups count as use.
+ * Not thread-safe; callers provide their own locking.
+ */
+template <typename K, typename V, typename Hash = std::hash<K> >
+class lrucache
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const key_type, mapped_type> value_type;
+    typedef typename std::list<value_type>::size_type size_type;
+
+protected:
+    //! Elements from most to least recently used
+    std::list<value_type> items;
+    typedef typename std::list<value_type>::iterator iterator;
+    std::unordered_map<K, iterator, Hash> index;
+    size_type nMaxSize;
+
+public:
+    lrucache(size_type nMaxSizeIn = 1) : nMaxSize(nMaxSizeIn) {}
+    size_type size() const { return items.size(); }
+    bool empty() const { return items.empty(); }
+    size_type max_size() const { return nMaxSize; }
+    bool contains(const key_type& k) const { return index.count(k) != 0; }
+
+    /** Copy the value of k into v and mark it most recently used. */
+    bool get(const key_type& k, mapped_type& v)
+    {
+        typename std::unordered_map<K, iterator, Hash>::iterator it = index.find(k);
+        if (it == index.end())
+            return false;
+        items.splice(items.begin(), items, it->second);
+        v = it->second->second;
+        return true;
+    }
+
+    /** Insert or replace the value of k, and mark it most recently used. */
+    void insert(const key_type& k, const mapped_type& v)
+    {
+        typename std::unordered_map<K, iterator, Hash>::iterator it = index.find(k);
+        if (it != index.end()) {
+            it->second->second = v;
+            items.splice(items.begin(), items, it->second);
+            return;
+        }
+        items.push_front(value_type(k, v));
+        index.insert(std::make_pair(k, items.begin()));
+        while (items.size() > nMaxSize) {
+            index.erase(items.back().first);
+            items.pop_back();
+        }
+    }
+
+    void erase(const key_type& k)
+    {
+        typename std::unordered_map<K, iterator, Hash>::iterator it = index.find(k);
+        if (it == index.end())
+            return;
+        items.erase(it->second);
+        index.erase(it);
+    }
+
+    void clear()
+    {
+        index.clear();
+        items.clear();
+    }
+};
+
+#endif // BITCOIN_LRUCACHE_H
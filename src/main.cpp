@@ -10,6 +10,7 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockimport.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -21,6 +22,7 @@
 #include "metrics.h"
 #include "net.h"
 #include "pow.h"
+#include "proofcache.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "ui_interface.h"
@@ -71,6 +73,7 @@ bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
+bool fCheckBlockReads = DEFAULT_CHECK_BLOCK_READS;
 bool fCheckpointsEnabled = true;
 bool fCoinbaseEnforcedProtectionEnabled = true;
 size_t nCoinCacheUsage = 5000 * 300;
@@ -86,14 +89,16 @@ unsigned int expiryDelta = DEFAULT_TX_EXPIRY_DELTA;
 CFeeRate minRelayTxFee = CFeeRate(DEFAULT_MIN_RELAY_TX_FEE);
 
 CTxMemPool mempool(::minRelayTxFee);
+CBlockCache blockcache(DEFAULT_BLOCK_CACHE_SIZE << 20);
 
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
 };
 map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);;
 void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+void EraseTxProofChecksFor(NodeId nodeId) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 /**
  * Returns true if there are nRequired or more blocks of minVersion or above
@@ -146,6 +151,12 @@ namespace {
       */
     multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
 
+    /**
+     * Block at which the chain state was loaded from a snapshot, if it was.
+     * Blocks up to it were never downloaded or connected by this node.
+     */
+    CBlockIndex *pindexSnapshot = NULL;
+
     CCriticalSection cs_LastBlockFile;
     std::vector<CBlockFileInfo> vinfoBlockFile;
     int nLastBlockFile = 0;
@@ -214,6 +225,38 @@ namespace {
 
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
+
+    /**
+     * Shielded transactions received from peers have their context-free
+     * checks and proofs verified on the -par threads, without cs_main, before
+     * the message handler thread accepts them to the mempool. The proofs that
+     * pass are recorded in the proof cache, so AcceptToMemoryPool does not
+     * verify them again. Protected by cs_txproofcheck.
+     */
+    struct CTxProofCheck {
+        CTransactionRef tx;
+        uint32_t consensusBranchId;
+        //! The result of the checks, once done
+        CValidationState state;
+    };
+    /** The peers a transaction being checked was received from. */
+    struct CTxProofCheckPeers {
+        //! The peer the transaction is processed for
+        NodeId nodeId;
+        //! Peers that sent it too, in order, to take over if nodeId disconnects
+        std::vector<NodeId> vFallback;
+    };
+    CWaitableCriticalSection cs_txproofcheck;
+    //! Transactions waiting for a TxProofCheckJob
+    std::deque<CTxProofCheck> queueTxProofCheck;
+    //! Checked transactions, waiting for ProcessMessages of the peer they are processed for
+    map<NodeId, std::deque<CTxProofCheck> > mapTxProofChecked;
+    //! Transactions queued, being checked or checked and not processed yet
+    map<uint256, CTxProofCheckPeers> mapTxProofCheckInFlight;
+    //! Number of the transactions in mapTxProofCheckInFlight processed for each peer
+    map<NodeId, unsigned int> mapTxProofChecksPerPeer;
+    //! Height of the tip, for the branch the Sapling proofs are checked against
+    std::atomic<int> nTxProofCheckTipHeight(-1);
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -333,6 +376,7 @@ void FinalizeNode(NodeId nodeid) {
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
+    EraseTxProofChecksFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
 
     mapNodeState.erase(nodeid);
@@ -561,6 +605,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
     return chain.Genesis();
 }
 
+CCoinsViewDB *pcoinsdbview = NULL;
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
@@ -569,8 +614,9 @@ CBlockTreeDB *pblocktree = NULL;
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+bool AddOrphanTx(const CTransactionRef& ptx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
+    const CTransaction& tx = *ptx;
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
@@ -589,7 +635,7 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
+    mapOrphanTransactions[hash].tx = ptx;
     mapOrphanTransactions[hash].fromPeer = peer;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
@@ -604,7 +650,7 @@ void static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
         return;
-    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
+    BOOST_FOREACH(const CTxIn& txin, it->second.tx->vin)
     {
         map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
         if (itPrev == mapOrphanTransactionsByPrev.end())
@@ -625,7 +671,7 @@ void EraseOrphansFor(NodeId peer)
         map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
         if (maybeErase->second.fromPeer == peer)
         {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
+            EraseOrphanTx(maybeErase->second.tx->GetHash());
             ++nErased;
         }
     }
@@ -883,6 +929,7 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
  * 2. ProcessNewBlock calls AcceptBlock, which calls CheckBlock (which calls CheckTransaction)
  *    and ContextualCheckBlock (which calls this function).
  * 3. The isInitBlockDownload argument is only to assist with testing.
+ * 4. Sapling proofs and signatures are not checked here; see ContextualCheckSaplingProofs.
  */
 bool ContextualCheckTransaction(
         const CTransaction& tx,
@@ -973,25 +1020,19 @@ bool ContextualCheckTransaction(
                             REJECT_INVALID, "bad-txns-oversize");
     }
 
-    uint256 dataToBeSigned;
-
-    if (!tx.vjoinsplit.empty() ||
-        !tx.vShieldedSpend.empty() ||
-        !tx.vShieldedOutput.empty())
+    if (!tx.vjoinsplit.empty())
     {
         auto consensusBranchId = CurrentEpochBranchId(nHeight, Params().GetConsensus());
         // Empty output script.
         CScript scriptCode;
+        uint256 dataToBeSigned;
         try {
             dataToBeSigned = SignatureHash(scriptCode, tx, NOT_AN_INPUT, SIGHASH_ALL, 0, consensusBranchId);
         } catch (std::logic_error ex) {
             return state.DoS(100, error("CheckTransaction(): error computing signature hash"),
                                 REJECT_INVALID, "error-computing-signature-hash");
         }
-    }
 
-    if (!tx.vjoinsplit.empty())
-    {
         BOOST_STATIC_ASSERT(crypto_sign_PUBLICKEYBYTES == 32);
 
         // We rely on libsodium to check that the signature is canonical.
@@ -1006,61 +1047,120 @@ bool ContextualCheckTransaction(
         }
     }
 
-    if (!tx.vShieldedSpend.empty() ||
-        !tx.vShieldedOutput.empty())
-    {
-        auto ctx = librustzcash_sapling_verification_ctx_init();
-
-        for (const SpendDescription &spend : tx.vShieldedSpend) {
-            if (!librustzcash_sapling_check_spend(
-                ctx,
-                spend.cv.begin(),
-                spend.anchor.begin(),
-                spend.nullifier.begin(),
-                spend.rk.begin(),
-                spend.zkproof.begin(),
-                spend.spendAuthSig.begin(),
-                dataToBeSigned.begin()
-            ))
-            {
-                librustzcash_sapling_verification_ctx_free(ctx);
-                return state.DoS(100, error("ContextualCheckTransaction(): Sapling spend description invalid"),
-                                      REJECT_INVALID, "bad-txns-sapling-spend-description-invalid");
-            }
-        }
+    return true;
+}
 
-        for (const OutputDescription &output : tx.vShieldedOutput) {
-            if (!librustzcash_sapling_check_output(
-                ctx,
-                output.cv.begin(),
-                output.cm.begin(),
-                output.ephemeralKey.begin(),
-                output.zkproof.begin()
-            ))
-            {
-                librustzcash_sapling_verification_ctx_free(ctx);
-                return state.DoS(100, error("ContextualCheckTransaction(): Sapling output description invalid"),
-                                      REJECT_INVALID, "bad-txns-sapling-output-description-invalid");
-            }
-        }
+bool CSaplingCheck::operator()() {
+    // Empty output script.
+    CScript scriptCode;
+    uint256 dataToBeSigned;
+    try {
+        dataToBeSigned = SignatureHash(scriptCode, *ptxTo, NOT_AN_INPUT, SIGHASH_ALL, 0, consensusBranchId);
+    } catch (std::logic_error ex) {
+        error = SAPLING_ERR_SIGHASH;
+        return false;
+    }
 
-        if (!librustzcash_sapling_final_check(
+    auto ctx = librustzcash_sapling_verification_ctx_init();
+
+    for (const SpendDescription &spend : ptxTo->vShieldedSpend) {
+        if (!librustzcash_sapling_check_spend(
             ctx,
-            tx.valueBalance,
-            tx.bindingSig.begin(),
+            spend.cv.begin(),
+            spend.anchor.begin(),
+            spend.nullifier.begin(),
+            spend.rk.begin(),
+            spend.zkproof.begin(),
+            spend.spendAuthSig.begin(),
             dataToBeSigned.begin()
         ))
         {
             librustzcash_sapling_verification_ctx_free(ctx);
-            return state.DoS(100, error("ContextualCheckTransaction(): Sapling binding signature invalid"),
-                                  REJECT_INVALID, "bad-txns-sapling-binding-signature-invalid");
+            error = SAPLING_ERR_SPEND;
+            return false;
+        }
+    }
+
+    for (const OutputDescription &output : ptxTo->vShieldedOutput) {
+        if (!librustzcash_sapling_check_output(
+            ctx,
+            output.cv.begin(),
+            output.cm.begin(),
+            output.ephemeralKey.begin(),
+            output.zkproof.begin()
+        ))
+        {
+            librustzcash_sapling_verification_ctx_free(ctx);
+            error = SAPLING_ERR_OUTPUT;
+            return false;
         }
+    }
 
+    if (!librustzcash_sapling_final_check(
+        ctx,
+        ptxTo->valueBalance,
+        ptxTo->bindingSig.begin(),
+        dataToBeSigned.begin()
+    ))
+    {
         librustzcash_sapling_verification_ctx_free(ctx);
+        error = SAPLING_ERR_BINDING_SIG;
+        return false;
     }
+
+    librustzcash_sapling_verification_ctx_free(ctx);
+    error = SAPLING_ERR_OK;
     return true;
 }
 
+bool ContextualCheckSaplingProofs(const CTransaction& tx, CValidationState &state, uint32_t consensusBranchId,
+                                  std::vector<CSaplingCheck> *pvChecks)
+{
+    if (tx.vShieldedSpend.empty() && tx.vShieldedOutput.empty())
+        return true;
+
+    if (ProofCacheContains(tx.GetHash(), consensusBranchId, PROOF_CACHE_SAPLING))
+        return true;
+
+    CSaplingCheck check(tx, consensusBranchId);
+    if (pvChecks) {
+        pvChecks->push_back(CSaplingCheck());
+        check.swap(pvChecks->back());
+        return true;
+    }
+
+    if (check())
+        return true;
+
+    switch (check.GetSaplingError()) {
+    case SAPLING_ERR_SIGHASH:
+        return state.DoS(100, error("ContextualCheckSaplingProofs(): error computing signature hash"),
+                              REJECT_INVALID, "error-computing-signature-hash");
+    case SAPLING_ERR_SPEND:
+        return state.DoS(100, error("ContextualCheckSaplingProofs(): Sapling spend description invalid"),
+                              REJECT_INVALID, "bad-txns-sapling-spend-description-invalid");
+    case SAPLING_ERR_OUTPUT:
+        return state.DoS(100, error("ContextualCheckSaplingProofs(): Sapling output description invalid"),
+                              REJECT_INVALID, "bad-txns-sapling-output-description-invalid");
+    default:
+        return state.DoS(100, error("ContextualCheckSaplingProofs(): Sapling binding signature invalid"),
+                              REJECT_INVALID, "bad-txns-sapling-binding-signature-invalid");
+    }
+}
+
+
+/** Ensure that the zk-SNARKs of the JoinSplits of a transaction verify */
+static bool VerifyJoinSplits(const CTransaction& tx, CValidationState &state,
+                             libzcash::ProofVerifier& verifier)
+{
+    BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
+        if (!joinsplit.Verify(*pzcashParams, verifier, tx.joinSplitPubKey)) {
+            return state.DoS(100, error("CheckTransaction(): joinsplit does not verify"),
+                                REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
+        }
+    }
+    return true;
+}
 
 bool CheckTransaction(const CTransaction& tx, CValidationState &state,
                       libzcash::ProofVerifier& verifier)
@@ -1072,16 +1172,86 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state,
 
     if (!CheckTransactionWithoutProofVerification(tx, state)) {
         return false;
+    } else if (!tx.vjoinsplit.empty() && ProofCacheContains(tx.GetHash(), 0, PROOF_CACHE_SPROUT)) {
+        // The zk-SNARKs were already verified when the transaction was accepted to the mempool
+        return true;
     } else {
-        // Ensure that zk-SNARKs verify
-        BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
-            if (!joinsplit.Verify(*pzcashParams, verifier, tx.joinSplitPubKey)) {
-                return state.DoS(100, error("CheckTransaction(): joinsplit does not verify"),
-                                    REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
-            }
+        return VerifyJoinSplits(tx, state, verifier);
+    }
+}
+
+/**
+ * Reject a block in which a batch of JoinSplit proofs failed to verify, giving
+ * the same reason as CheckTransaction does for the first invalid transaction.
+ */
+static bool RejectJoinSplitProofs(const CBlock& block, CValidationState &state)
+{
+    auto verifier = libzcash::ProofVerifier::Strict();
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+        const CTransaction& tx = *ptx;
+        if (!CheckTransaction(tx, state, verifier))
+            return false;
+    }
+    return state.DoS(100, error("CheckJoinSplitProofs(): joinsplit batch does not verify"),
+                     REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
+}
+
+bool CJoinSplitCheck::operator()() {
+    auto verifier = libzcash::ProofVerifier::Batch();
+    BOOST_FOREACH(const CTransaction* ptx, vptxTo) {
+        BOOST_FOREACH(const JSDescription &joinsplit, ptx->vjoinsplit) {
+            if (!joinsplit.Verify(*pzcashParams, verifier, ptx->joinSplitPubKey))
+                return false;
+        }
+    }
+    return verifier.verify_batch();
+}
+
+bool CheckJoinSplitProofs(const CBlock& block, CValidationState &state,
+                          std::vector<CJoinSplitCheck> *pvChecks)
+{
+    std::vector<const CTransaction*> vptx;
+    size_t nProofs = 0;
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+        const CTransaction& tx = *ptx;
+        if (tx.vjoinsplit.empty() || !boost::get<libzcash::PHGRProof>(&tx.vjoinsplit[0].proof))
+            continue;
+        if (ProofCacheContains(tx.GetHash(), 0, PROOF_CACHE_SPROUT))
+            continue;
+        vptx.push_back(&tx);
+        nProofs += tx.vjoinsplit.size();
+    }
+
+    // Spread the proofs over the verification threads, while keeping enough
+    // of them in each batch for the shared final exponentiation to pay off.
+    size_t nThreads = pvChecks ? std::max(nScriptCheckThreads, 1) : 1;
+    size_t nBatchSize = std::max<size_t>(MIN_JOINSPLIT_CHECK_BATCH_SIZE, (nProofs + nThreads - 1) / nThreads);
+
+    std::vector<CJoinSplitCheck> vChecks;
+    std::vector<const CTransaction*> vptxBatch;
+    size_t nBatchProofs = 0;
+    BOOST_FOREACH(const CTransaction* ptx, vptx) {
+        vptxBatch.push_back(ptx);
+        nBatchProofs += ptx->vjoinsplit.size();
+        if (nBatchProofs >= nBatchSize) {
+            vChecks.push_back(CJoinSplitCheck(vptxBatch));
+            vptxBatch.clear();
+            nBatchProofs = 0;
         }
+    }
+    if (!vptxBatch.empty())
+        vChecks.push_back(CJoinSplitCheck(vptxBatch));
+
+    if (pvChecks) {
+        pvChecks->swap(vChecks);
         return true;
     }
+
+    BOOST_FOREACH(CJoinSplitCheck& check, vChecks) {
+        if (!check())
+            return RejectJoinSplitProofs(block, state);
+    }
+    return true;
 }
 
 bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state)
@@ -1348,10 +1518,17 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+/** Evict transactions from the pool until it fits in -maxmempool. */
+static void LimitMempoolSize(CTxMemPool& pool)
+{
+    pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransactionRef &ptx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
+    const CTransaction& tx = *ptx;
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
@@ -1382,6 +1559,17 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         return error("AcceptToMemoryPool: ContextualCheckTransaction failed");
     }
 
+    if (!ContextualCheckSaplingProofs(tx, state, consensusBranchId)) {
+        return error("AcceptToMemoryPool: ContextualCheckSaplingProofs failed");
+    }
+
+    // Remember that the proofs are valid so that they are not verified again
+    // when this transaction is included in a block.
+    if (!tx.vjoinsplit.empty())
+        ProofCacheInsert(tx.GetHash(), 0, PROOF_CACHE_SPROUT);
+    if (!tx.vShieldedSpend.empty() || !tx.vShieldedOutput.empty())
+        ProofCacheInsert(tx.GetHash(), consensusBranchId, PROOF_CACHE_SAPLING);
+
     // DoS mitigation: reject transactions expiring soon
     // Note that if a valid transaction belonging to the wallet is in the mempool and the node is shutdown,
     // upon restart, CWalletTx::AcceptToMemoryPool() will be invoked which might result in rejection.
@@ -1448,15 +1636,16 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
         view.SetBackend(viewMemPool);
 
-        // do we already have it?
-        if (view.HaveCoins(hash))
-            return false;
-
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!view.HaveCoin(txin.prevout)) {
+                // Are inputs missing because we already have the tx?
+                for (size_t out = 0; out < tx.vout.size(); out++) {
+                    // Optimistically just do efficient check of cache for outputs
+                    if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out)))
+                        return false;
+                }
+                // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false;
@@ -1501,14 +1690,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 
         CAmount nValueOut = tx.GetValueOut();
         CAmount nFees = nValueIn-nValueOut;
+        // nModifiedFees includes any fee delta from prioritisetransaction
+        CAmount nModifiedFees = nFees;
+        double nPriorityDummy = 0;
+        pool.ApplyDeltas(hash, nPriorityDummy, nModifiedFees);
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
         // Keep track of transactions that spend a coinbase, which we re-scan
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
@@ -1519,7 +1712,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         // it has passed ContextualCheckInputs and therefore this is correct.
         auto consensusBranchId = CurrentEpochBranchId(chainActive.Height() + 1, Params().GetConsensus());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), fSpendsCoinbase, consensusBranchId);
+        CTxMemPoolEntry entry(ptx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), fSpendsCoinbase, nSigOps, consensusBranchId);
         unsigned int nSize = entry.GetTxSize();
 
         // Accept a tx if it contains joinsplits and has at least the default fee specified by z_sendmany.
@@ -1534,6 +1727,15 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                 REJECT_INSUFFICIENTFEE, "insufficient fee");
         }
 
+        // Don't accept it if it pays less than what the pool evicted to stay
+        // under -maxmempool. Eviction uses modified fees, so this does too.
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
+            return state.DoS(0, error("AcceptToMemoryPool: mempool min fee not met %s, %d < %d",
+                                      hash.ToString(), nModifiedFees, mempoolRejectFee),
+                             REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+        }
+
         // Require that free transactions have sufficient priority to be mined in the next block.
         if (GetBoolArg("-relaypriority", false) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1571,6 +1773,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
             return state.Error("AcceptToMemoryPool: " + errmsg);
         }
 
+        // Calculate in-mempool ancestors, up to a limit.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+            return state.DoS(0, error("AcceptToMemoryPool: %s %s", hash.ToString(), errString),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         PrecomputedTransactionData txdata(tx);
@@ -1594,7 +1808,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         }
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
+        pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
+
+        // Trim the pool, and check whether the transaction was evicted
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1602,6 +1823,12 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fOverrideMempoolLimit)
+{
+    return AcceptToMemoryPool(pool, state, MakeTransactionRef(tx), fLimitFree, pfMissingInputs, fRejectAbsurdFee, fOverrideMempoolLimit);
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1639,18 +1866,19 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
         int nHeight = -1;
         {
             CCoinsViewCache &view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
+            const Coin& coin = AccessByTxid(view, hash);
+            if (!coin.IsSpent())
+                nHeight = coin.nHeight;
         }
         if (nHeight > 0)
             pindexSlow = chainActive[nHeight];
     }
 
     if (pindexSlow) {
-        CBlock block;
-        if (ReadBlockFromDisk(block, pindexSlow)) {
-            BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+        std::shared_ptr<const CBlock> pblock = ReadBlockFromDiskCached(pindexSlow);
+        if (pblock) {
+            BOOST_FOREACH(const CTransactionRef& ptx, pblock->vtx) {
+                const CTransaction& tx = *ptx;
                 if (tx.GetHash() == hash) {
                     txOut = tx;
                     hashBlock = pindexSlow->GetBlockHash();
@@ -1694,7 +1922,7 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::M
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
+static bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, bool fCheckPOW)
 {
     block.SetNull();
 
@@ -1712,16 +1940,26 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     }
 
     // Check the header
-    if (!(CheckEquihashSolution(&block, Params()) &&
+    if (fCheckPOW &&
+        !(CheckEquihashSolution(&block, Params()) &&
           CheckProofOfWork(block.GetHash(), block.nBits, Params().GetConsensus())))
         return error("ReadBlockFromDisk: Errors in block header at %s", pos.ToString());
 
     return true;
 }
 
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
+{
+    return ReadBlockFromDisk(block, pos, true);
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
+    // The Equihash solution and proof of work of any header in the block tree
+    // were checked before it was added, and the block hash commits to both, so
+    // comparing it with the index is enough to detect a corrupted block file.
+    bool fCheckPOW = fCheckBlockReads || !pindex->IsValid(BLOCK_VALID_TREE);
+    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), fCheckPOW))
         return false;
     if (block.GetHash() != pindex->GetBlockHash())
         return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
@@ -1729,6 +1967,76 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& data, const CBlockIndex* pindex)
+{
+    // Blocks are preceded by the message start and their size.
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    if (pos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return error("ReadRawBlockFromDisk: invalid position %s", pos.ToString());
+    pos.nPos -= MESSAGE_START_SIZE + sizeof(unsigned int);
+
+    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("ReadRawBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+
+    CBlockHeader header;
+    try {
+        CMessageHeader::MessageStartChars pchMessageStart;
+        unsigned int nSize;
+        filein >> FLATDATA(pchMessageStart) >> nSize;
+        if (memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0 ||
+            nSize > MAX_BLOCK_SIZE)
+            return error("ReadRawBlockFromDisk: no block at %s", pindex->GetBlockPos().ToString());
+        data.resize(nSize);
+        filein.read((char*)begin_ptr(data), nSize);
+        CDataStream ssHeader(data, SER_DISK, CLIENT_VERSION);
+        ssHeader >> header;
+    }
+    catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pindex->GetBlockPos().ToString());
+    }
+
+    // As in ReadBlockFromDisk, the hash of the header is enough to detect
+    // a corrupted block file, unless the header was never checked or
+    // -checkblockreads asks for its Equihash solution and proof of work.
+    if (fCheckBlockReads || !pindex->IsValid(BLOCK_VALID_TREE)) {
+        if (!(CheckEquihashSolution(&header, Params()) &&
+              CheckProofOfWork(header.GetHash(), header.nBits, Params().GetConsensus())))
+            return error("ReadRawBlockFromDisk: Errors in block header at %s", pindex->GetBlockPos().ToString());
+    }
+    if (header.GetHash() != pindex->GetBlockHash())
+        return error("ReadRawBlockFromDisk: GetHash() doesn't match index for %s at %s",
+                pindex->ToString(), pindex->GetBlockPos().ToString());
+    return true;
+}
+
+std::shared_ptr<const CBlock> ReadBlockFromDiskCached(const CBlockIndex* pindex, bool fFillCache)
+{
+    uint256 hash = pindex->GetBlockHash();
+    std::shared_ptr<const CBlock> pblock = blockcache.GetBlock(hash);
+    if (pblock)
+        return pblock;
+    std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
+    if (!ReadBlockFromDisk(*pblockRead, pindex))
+        return std::shared_ptr<const CBlock>();
+    if (fFillCache)
+        blockcache.InsertBlock(hash, pblockRead);
+    return pblockRead;
+}
+
+std::shared_ptr<const std::vector<unsigned char> > ReadRawBlockFromDiskCached(const CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    std::shared_ptr<const std::vector<unsigned char> > data = blockcache.GetRawBlock(hash);
+    if (data)
+        return data;
+    std::shared_ptr<std::vector<unsigned char> > dataRead = std::make_shared<std::vector<unsigned char> >();
+    if (!ReadRawBlockFromDisk(*dataRead, pindex))
+        return std::shared_ptr<const std::vector<unsigned char> >();
+    blockcache.InsertRawBlock(hash, dataRead);
+    return dataRead;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     CAmount nSubsidy = 10 * COIN;
@@ -1937,20 +2245,10 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
+            txundo.vprevout.push_back(Coin());
             // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
 
@@ -1958,7 +2256,7 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     inputs.SetNullifiers(tx, true);
 
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
@@ -1999,14 +2297,14 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
-            if (coins->IsCoinBase()) {
+            if (coin.IsCoinBase()) {
                 // Ensure that coinbases are matured
-                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY) {
+                if (nSpendHeight - coin.nHeight < COINBASE_MATURITY) {
                     return state.Invalid(
-                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight),
+                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coin.nHeight),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
                 }
 
@@ -2022,8 +2320,8 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs(): txin values out of range"),
                                  REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
@@ -2083,11 +2381,11 @@ bool ContextualCheckInputs(
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, consensusBranchId, &txdata);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore, consensusBranchId, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2099,7 +2397,7 @@ bool ContextualCheckInputs(
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
+                        CScriptCheck check2(coin.out, tx, i,
                                 flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, consensusBranchId, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -2197,39 +2495,35 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 } // anon namespace
 
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint.
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
  * @return True on success.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static bool ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
-    }
-    if (coins->IsAvailable(out.n))
+    if (view.HaveCoin(out))
         fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
+
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height and coinbase). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (alternate.IsSpent())
+            return error("%s: undo data adding output to missing transaction", __func__);
+        undo.nHeight = alternate.nHeight;
+        undo.fCoinBase = alternate.fCoinBase;
+    }
+    view.AddCoin(out, std::move(undo), !fClean);
 
     return fClean;
 }
 
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+bool DisconnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -2250,26 +2544,19 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
-        const CTransaction &tx = block.vtx[i];
+        const CTransaction &tx = *block.vtx[i];
         uint256 hash = tx.GetHash();
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                if (!is_spent || tx.vout[o] != coin.out || pindex->nHeight != (int)coin.nHeight || tx.IsCoinBase() != (bool)coin.fCoinBase)
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+            }
         }
 
         // unspend nullifiers
@@ -2277,13 +2564,12 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
+                if (!ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out))
                     fClean = false;
             }
         }
@@ -2339,11 +2625,26 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+// All the verification work shares the -par worker threads
+static CCheckQueueWorkers checkqueueworkers;
+static CCheckQueue<CScriptCheck> scriptcheckqueue(checkqueueworkers, 128);
+static CCheckQueue<CSaplingCheck> saplingcheckqueue(checkqueueworkers, 8);
+// Each CJoinSplitCheck is already a batch of several proofs
+static CCheckQueue<CJoinSplitCheck> joinsplitcheckqueue(checkqueueworkers, 1);
+static CCheckQueue<CHeaderCheck> headercheckqueue(checkqueueworkers, 16);
+static CJobQueue checkjobqueue(checkqueueworkers);
+
+void ThreadCheckQueue() {
+    RenameThread("zcash-checkq");
+    checkqueueworkers.Thread();
+}
 
-void ThreadScriptCheck() {
-    RenameThread("zcash-scriptch");
-    scriptcheckqueue.Thread();
+bool QueueCheckJob(const std::function<void()>& job)
+{
+    if (nScriptCheckThreads == 0)
+        return false;
+    checkjobqueue.Add(job);
+    return true;
 }
 
 //
@@ -2428,13 +2729,23 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    auto verifier = libzcash::ProofVerifier::Strict();
     auto disabledVerifier = libzcash::ProofVerifier::Disabled();
 
-    // Check it again to verify JoinSplit proofs, and in case a previous version let a bad block in
-    if (!CheckBlock(block, state, fExpensiveChecks ? verifier : disabledVerifier, !fJustCheck, !fJustCheck))
+    // Check it again in case a previous version let a bad block in. Groth JoinSplit
+    // proofs are always verified here; PHGR ones are verified below, in batches.
+    if (!CheckBlock(block, state, disabledVerifier, !fJustCheck, !fJustCheck))
         return false;
 
+    // Queue the PHGR JoinSplit proofs first, so that the worker threads verify
+    // them while the transactions are being connected.
+    CCheckQueueControl<CJoinSplitCheck> joinSplitControl(fExpensiveChecks && nScriptCheckThreads ? &joinsplitcheckqueue : NULL);
+    if (fExpensiveChecks) {
+        std::vector<CJoinSplitCheck> vJoinSplitChecks;
+        if (!CheckJoinSplitProofs(block, state, nScriptCheckThreads ? &vJoinSplitChecks : NULL))
+            return false;
+        joinSplitControl.Add(vJoinSplitChecks);
+    }
+
     // verify that the view's current state corresponds to the previous block
     uint256 hashPrevBlock = pindex->pprev == NULL ? uint256() : pindex->pprev->GetBlockHash();
     assert(hashPrevBlock == view.GetBestBlock());
@@ -2455,11 +2766,13 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
-    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-        const CCoins* coins = view.AccessCoins(tx.GetHash());
-        if (coins && !coins->IsPruned())
-            return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                             REJECT_INVALID, "bad-txns-BIP30");
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+        const CTransaction& tx = *ptx;
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                 REJECT_INVALID, "bad-txns-BIP30");
+        }
     }
 
     unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
@@ -2469,10 +2782,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     CBlockUndo blockundo;
 
     CCheckQueueControl<CScriptCheck> control(fExpensiveChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    CCheckQueueControl<CSaplingCheck> saplingControl(nScriptCheckThreads ? &saplingcheckqueue : NULL);
 
     int64_t nTimeStart = GetTimeMicros();
     CAmount nFees = 0;
     int nInputs = 0;
+    int nSaplingDescriptions = 0;
     unsigned int nSigOps = 0;
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
@@ -2507,9 +2822,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        const CTransaction &tx = block.vtx[i];
+        const CTransaction &tx = *block.vtx[i];
 
         nInputs += tx.vin.size();
+        nSaplingDescriptions += tx.vShieldedSpend.size() + tx.vShieldedOutput.size();
         nSigOps += GetLegacySigOpCount(tx);
         if (nSigOps > MAX_BLOCK_SIGOPS)
             return state.DoS(100, error("ConnectBlock(): too many sigops"),
@@ -2537,6 +2853,13 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
         txdata.emplace_back(tx);
 
+        // Sapling proofs are verified in ConnectBlock rather than ContextualCheckBlock
+        // so that they can run on the worker threads alongside the script checks.
+        std::vector<CSaplingCheck> vSaplingChecks;
+        if (!ContextualCheckSaplingProofs(tx, state, consensusBranchId, nScriptCheckThreads ? &vSaplingChecks : NULL))
+            return false;
+        saplingControl.Add(vSaplingChecks);
+
         if (!tx.IsCoinBase())
         {
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
@@ -2591,16 +2914,32 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime1 - nTimeStart), 0.001 * (nTime1 - nTimeStart) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime1 - nTimeStart) / (nInputs-1), nTimeConnect * 0.000001);
 
     CAmount blockReward = nFees + GetBlockSubsidy(pindex->nHeight, chainparams.GetConsensus());
-    if (block.vtx[0].GetValueOut() > blockReward)
+    if (block.vtx[0]->GetValueOut() > blockReward)
         return state.DoS(100,
                          error("ConnectBlock(): coinbase pays too much (actual=%d vs limit=%d)",
-                               block.vtx[0].GetValueOut(), blockReward),
+                               block.vtx[0]->GetValueOut(), blockReward),
                                REJECT_INVALID, "bad-cb-amount");
 
     if (!control.Wait())
         return state.DoS(100, false);
+    int64_t nTimeSaplingStart = GetTimeMicros();
+    if (!saplingControl.Wait()) {
+        // Re-run the checks inline to reject the block with the same reason
+        // as the single-threaded path.
+        BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+            const CTransaction& tx = *ptx;
+            if (!ContextualCheckSaplingProofs(tx, state, consensusBranchId))
+                return false;
+        }
+        return state.DoS(100, false);
+    }
+    int64_t nTimeJoinSplitStart = GetTimeMicros();
+    if (!joinSplitControl.Wait())
+        return RejectJoinSplitProofs(block, state);
     int64_t nTime2 = GetTimeMicros(); nTimeVerify += nTime2 - nTimeStart;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs-1), nTimeVerify * 0.000001);
+    LogPrint("bench", "    - Wait for %u Sapling descriptions: %.2fms\n", nSaplingDescriptions, 0.001 * (nTime2 - nTimeSaplingStart));
+    LogPrint("bench", "    - Wait for JoinSplit proofs: %.2fms\n", 0.001 * (nTime2 - nTimeJoinSplitStart));
 
     if (fJustCheck)
         return true;
@@ -2648,7 +2987,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Watch for changes to the previous coinbase transaction.
     static uint256 hashPrevBestCoinBase;
     GetMainSignals().UpdatedTransaction(hashPrevBestCoinBase);
-    hashPrevBestCoinBase = block.vtx[0].GetHash();
+    hashPrevBestCoinBase = block.vtx[0]->GetHash();
 
     int64_t nTime4 = GetTimeMicros(); nTimeCallbacks += nTime4 - nTime3;
     LogPrint("bench", "    - Callbacks: %.2fms [%.2fs]\n", 0.001 * (nTime4 - nTime3), nTimeCallbacks * 0.000001);
@@ -2726,14 +3065,24 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
                 setDirtyFileInfo.erase(it++);
             }
             std::vector<const CBlockIndex*> vBlocks;
+            std::vector<CBlockIndex*> vWritten;
             vBlocks.reserve(setDirtyBlockIndex.size());
+            vWritten.reserve(setDirtyBlockIndex.size());
             for (set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end(); ) {
                 vBlocks.push_back(*it);
+                vWritten.push_back(*it);
                 setDirtyBlockIndex.erase(it++);
             }
             if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks)) {
                 return AbortNode(state, "Files to write to block index database");
             }
+            // The solutions are on disk now; full headers read them back from there.
+            // Entries short of BLOCK_VALID_SCRIPTS are likely to be written
+            // again, which would read the solution back under cs_main.
+            BOOST_FOREACH(CBlockIndex* pindex, vWritten) {
+                if (pindex->IsValid(BLOCK_VALID_SCRIPTS))
+                    pindex->TrimSolution();
+            }
         }
         // Finally remove any pruned files
         if (fFlushForPrune)
@@ -2742,16 +3091,20 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
+        // With background writes the database is written by another thread;
+        // wait for it when shutting down or pruning.
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinsdbview->WaitForWrites())
+            return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
     if ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000) {
@@ -2780,6 +3133,7 @@ void PruneAndFlush() {
 void static UpdateTip(CBlockIndex *pindexNew) {
     const CChainParams& chainParams = Params();
     chainActive.SetTip(pindexNew);
+    nTxProofCheckTipHeight = chainActive.Height();
 
     // New best block
     nTimeBestReceived = GetTime();
@@ -2824,9 +3178,10 @@ bool static DisconnectTip(CValidationState &state, bool fBare = false) {
     CBlockIndex *pindexDelete = chainActive.Tip();
     assert(pindexDelete);
     // Read block from disk.
-    CBlock block;
-    if (!ReadBlockFromDisk(block, pindexDelete))
+    std::shared_ptr<const CBlock> pblock = ReadBlockFromDiskCached(pindexDelete);
+    if (!pblock)
         return AbortNode(state, "Failed to read block");
+    const CBlock& block = *pblock;
     // Apply the block atomically to the chain state.
     uint256 sproutAnchorBeforeDisconnect = pcoinsTip->GetBestAnchor(SPROUT);
     uint256 saplingAnchorBeforeDisconnect = pcoinsTip->GetBestAnchor(SAPLING);
@@ -2846,13 +3201,24 @@ bool static DisconnectTip(CValidationState &state, bool fBare = false) {
 
     if (!fBare) {
         // Resurrect mempool transactions from the disconnected block.
-        BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-            // ignore validation errors in resurrected transactions
-            list<CTransaction> removed;
+        std::vector<uint256> vHashUpdate;
+        BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+            const CTransaction& tx = *ptx;
+            // ignore validation errors in resurrected transactions; the
+            // pool is trimmed once the reorganization is done
+            list<CTransactionRef> removed;
             CValidationState stateDummy;
-            if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+            if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, ptx, false, NULL, false, true))
                 mempool.remove(tx, removed, true);
-        }
+            else if (mempool.exists(tx.GetHash()))
+                vHashUpdate.push_back(tx.GetHash());
+        }
+        // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+        // no in-mempool children, which is generally not true when adding
+        // previously-confirmed transactions back to the mempool.
+        // UpdateTransactionsFromBlock finds descendants of any transactions in this
+        // block that were added back and cleans up the mempool state.
+        mempool.UpdateTransactionsFromBlock(vHashUpdate);
         if (sproutAnchorBeforeDisconnect != sproutAnchorAfterDisconnect) {
             // The anchor may not change between block disconnects,
             // in which case we don't want to evict from the mempool yet!
@@ -2874,7 +3240,8 @@ bool static DisconnectTip(CValidationState &state, bool fBare = false) {
     assert(pcoinsTip->GetSaplingAnchorAt(pcoinsTip->GetBestAnchor(SAPLING), newSaplingTree));
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+        const CTransaction& tx = *ptx;
         SyncWithWallets(tx, NULL);
     }
     // Update cached incremental witnesses
@@ -2934,7 +3301,7 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     int64_t nTime5 = GetTimeMicros(); nTimeChainState += nTime5 - nTime4;
     LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
     // Remove conflicting transactions from the mempool.
-    list<CTransaction> txConflicted;
+    list<CTransactionRef> txConflicted;
     mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted, !IsInitialBlockDownload());
 
     // Remove transactions that expire at new block height from mempool
@@ -2944,11 +3311,12 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     UpdateTip(pindexNew);
     // Tell wallet about transactions that went from mempool
     // to conflicted:
-    BOOST_FOREACH(const CTransaction &tx, txConflicted) {
-        SyncWithWallets(tx, NULL);
+    BOOST_FOREACH(const CTransactionRef &ptx, txConflicted) {
+        SyncWithWallets(*ptx, NULL);
     }
     // ... and about transactions that got confirmed:
-    BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
+    BOOST_FOREACH(const CTransactionRef& ptx, pblock->vtx) {
+        const CTransaction& tx = *ptx;
         SyncWithWallets(tx, pblock);
     }
     // Update cached incremental witnesses
@@ -3120,6 +3488,7 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
 
     if (fBlocksDisconnected) {
         mempool.removeForReorg(pcoinsTip, chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
+        LimitMempoolSize(mempool);
     }
     mempool.removeWithoutBranchId(
         CurrentEpochBranchId(chainActive.Tip()->nHeight + 1, Params().GetConsensus()));
@@ -3305,7 +3674,8 @@ bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBl
     pindexNew->nChainTx = 0;
     CAmount sproutValue = 0;
     CAmount saplingValue = 0;
-    for (auto tx : block.vtx) {
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
         // Negative valueBalance "takes" money from the transparent value pool
         // and adds it to the Sapling value pool. Positive valueBalance "gives"
         // money to the transparent value pool, removing from the Sapling value
@@ -3527,23 +3897,23 @@ bool CheckBlock(const CBlock& block, CValidationState& state,
                          REJECT_INVALID, "bad-blk-length");
 
     // First transaction must be coinbase, the rest must not be
-    if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
+    if (block.vtx.empty() || !block.vtx[0]->IsCoinBase())
         return state.DoS(100, error("CheckBlock(): first tx is not coinbase"),
                          REJECT_INVALID, "bad-cb-missing");
     for (unsigned int i = 1; i < block.vtx.size(); i++)
-        if (block.vtx[i].IsCoinBase())
+        if (block.vtx[i]->IsCoinBase())
             return state.DoS(100, error("CheckBlock(): more than one coinbase"),
                              REJECT_INVALID, "bad-cb-multiple");
 
     // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-        if (!CheckTransaction(tx, state, verifier))
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx)
+        if (!CheckTransaction(*ptx, state, verifier))
             return error("CheckBlock(): CheckTransaction failed");
 
     unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx)
     {
-        nSigOps += GetLegacySigOpCount(tx);
+        nSigOps += GetLegacySigOpCount(*ptx);
     }
     if (nSigOps > MAX_BLOCK_SIGOPS)
         return state.DoS(100, error("CheckBlock(): out-of-bounds SigOpCount"),
@@ -3596,7 +3966,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     const Consensus::Params& consensusParams = Params().GetConsensus();
 
     // Check that all transactions are finalized
-    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+        const CTransaction& tx = *ptx;
 
         // Check transaction contextually against consensus rules at block height
         if (!ContextualCheckTransaction(tx, state, nHeight, 100)) {
@@ -3619,8 +3990,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     if (nHeight > 0)
     {
         CScript expect = CScript() << nHeight;
-        if (block.vtx[0].vin[0].scriptSig.size() < expect.size() ||
-            !std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin())) {
+        if (block.vtx[0]->vin[0].scriptSig.size() < expect.size() ||
+            !std::equal(expect.begin(), expect.end(), block.vtx[0]->vin[0].scriptSig.begin())) {
             return state.DoS(100, error("%s: block height mismatch in coinbase", __func__), REJECT_INVALID, "bad-cb-height");
         }
     }
@@ -3633,7 +4004,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     if ((nHeight > 0) && (nHeight <= consensusParams.GetLastFoundersRewardBlockHeight())) {
         bool found = false;
 
-        BOOST_FOREACH(const CTxOut& output, block.vtx[0].vout) {
+        BOOST_FOREACH(const CTxOut& output, block.vtx[0]->vout) {
             if (output.scriptPubKey == Params().GetFoundersRewardScriptAtHeight(nHeight)) {
                 if (output.nValue == (GetBlockSubsidy(nHeight, consensusParams) / 5)) {
                     found = true;
@@ -3650,7 +4021,16 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex)
+bool CHeaderCheck::operator()() {
+    const CChainParams& chainparams = Params();
+    *pfValid = CheckEquihashSolution(pheader, chainparams) &&
+               CheckProofOfWork(pheader->GetHash(), pheader->nBits, chainparams.GetConsensus());
+    // Don't stop the queue at the first invalid header: the headers after it
+    // still need their result.
+    return true;
+}
+
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex, bool fCheckPOW)
 {
     const CChainParams& chainparams = Params();
     AssertLockHeld(cs_main);
@@ -3668,7 +4048,7 @@ bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBloc
         return true;
     }
 
-    if (!CheckBlockHeader(block, state))
+    if (!CheckBlockHeader(block, state, fCheckPOW))
         return false;
 
     // Get prev block index
@@ -3694,14 +4074,14 @@ bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBloc
     return true;
 }
 
-bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex, bool fRequested, CDiskBlockPos* dbp)
+bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex, bool fRequested, CDiskBlockPos* dbp, bool fCheckPOW)
 {
     const CChainParams& chainparams = Params();
     AssertLockHeld(cs_main);
 
     CBlockIndex *&pindex = *ppindex;
 
-    if (!AcceptBlockHeader(block, state, &pindex))
+    if (!AcceptBlockHeader(block, state, &pindex, fCheckPOW))
         return false;
 
     // Try to process all requested blocks that we don't have, but only
@@ -3727,7 +4107,7 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
 
     // See method docstring for why this is always disabled
     auto verifier = libzcash::ProofVerifier::Disabled();
-    if ((!CheckBlock(block, state, verifier)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
+    if ((!CheckBlock(block, state, verifier, fCheckPOW)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
             setDirtyBlockIndex.insert(pindex);
@@ -3773,11 +4153,11 @@ static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned
 }
 
 
-bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool fForceProcessing, CDiskBlockPos *dbp)
+bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool fForceProcessing, CDiskBlockPos *dbp, bool fCheckPOW)
 {
     // Preliminary checks
     auto verifier = libzcash::ProofVerifier::Disabled();
-    bool checked = CheckBlock(*pblock, state, verifier);
+    bool checked = CheckBlock(*pblock, state, verifier, fCheckPOW);
 
     {
         LOCK(cs_main);
@@ -3789,7 +4169,7 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool
 
         // Store to disk
         CBlockIndex *pindex = NULL;
-        bool ret = AcceptBlock(*pblock, state, &pindex, fRequested, dbp);
+        bool ret = AcceptBlock(*pblock, state, &pindex, fRequested, dbp, fCheckPOW);
         if (pindex && pfrom) {
             mapBlockSource[pindex->GetBlockHash()] = pfrom->GetId();
         }
@@ -4002,6 +4382,15 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+/** Take pindex as the block a chain state snapshot was loaded at. */
+static void SetSnapshotBlock(CBlockIndex *pindex, uint64_t nChainTx)
+{
+    pindexSnapshot = pindex;
+    // Blocks after it are linked to it as if all blocks up to it had been received.
+    pindex->nChainTx = nChainTx;
+    pindex->nCachedBranchId = CurrentEpochBranchId(pindex->nHeight, Params().GetConsensus());
+}
+
 bool static LoadBlockIndexDB()
 {
     const CChainParams& chainparams = Params();
@@ -4010,6 +4399,10 @@ bool static LoadBlockIndexDB()
 
     boost::this_thread::interruption_point();
 
+    uint256 hashSnapshot;
+    uint64_t nSnapshotChainTx = 0;
+    pblocktree->ReadSnapshotBlock(hashSnapshot, nSnapshotChainTx);
+
     // Calculate nChainWork
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
@@ -4051,6 +4444,8 @@ bool static LoadBlockIndexDB()
                 pindex->nChainSaplingValue = pindex->nSaplingValue;
             }
         }
+        if (!hashSnapshot.IsNull() && pindex->GetBlockHash() == hashSnapshot)
+            SetSnapshotBlock(pindex, nSnapshotChainTx);
         // Construct in-memory chain of branch IDs.
         // Relies on invariant: a block that does not activate a network upgrade
         // will always be valid under the same consensus rules as its parent.
@@ -4139,9 +4534,18 @@ bool static LoadBlockIndexDB()
 
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
+
+    // The best block of the coin database only moves to the snapshot block
+    // with the last batch of a snapshot load. Short of it, the load did not
+    // finish, and the database holds part of the snapshot.
+    if (pindexSnapshot && (it == mapBlockIndex.end() || it->second->GetAncestor(pindexSnapshot->nHeight) != pindexSnapshot))
+        return error("%s: the chain state snapshot of block %s was not completely loaded; restart with -reindex to rebuild the chain state",
+                     __func__, pindexSnapshot->GetBlockHash().ToString());
+
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    nTxProofCheckTipHeight = chainActive.Height();
     // Set hashFinalSproutRoot for the end of best chain
     it->second->hashFinalSproutRoot = pcoinsTip->GetBestAnchor(SPROUT);
 
@@ -4193,6 +4597,9 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
+        // Blocks up to a loaded snapshot were never downloaded.
+        if (pindexSnapshot && pindex->nHeight <= pindexSnapshot->nHeight)
+            break;
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -4269,7 +4676,8 @@ bool RewindBlockIndex(const CChainParams& params, bool& clearWitnessCaches)
             *pindex->nCachedBranchId == CurrentEpochBranchId(pindex->nHeight, consensus);
     };
 
-    int nHeight = 1;
+    // Blocks up to a loaded snapshot were validated by whoever wrote it.
+    int nHeight = pindexSnapshot ? pindexSnapshot->nHeight + 1 : 1;
     while (nHeight <= chainActive.Height()) {
         if (!sufficientlyValidated(chainActive[nHeight])) {
             break;
@@ -4409,6 +4817,7 @@ void UnloadBlockIndex()
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
+    pindexSnapshot = NULL;
     mempool.clear();
     mapOrphanTransactions.clear();
     mapOrphanTransactionsByPrev.clear();
@@ -4441,6 +4850,74 @@ bool LoadBlockIndex()
     return true;
 }
 
+bool LoadChainStateSnapshot(const boost::filesystem::path &path, const uint256 &hashExpected, CChainStateSnapshot &snapshot, CValidationState &state)
+{
+    LOCK(cs_main);
+    if (fTxIndex)
+        return state.Error("A chain state snapshot cannot be loaded with -txindex");
+    if (chainActive.Height() != 0)
+        return state.Error("The chain state is past the genesis block");
+
+    // Check the whole snapshot before changing anything.
+    {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            return state.Error("Cannot open " + path.string());
+        if (!pcoinsdbview->ReadSnapshot(file, snapshot, false))
+            return state.Error("Invalid chain state snapshot");
+    }
+    if (!hashExpected.IsNull() && snapshot.hashContents != hashExpected)
+        return state.Error("Snapshot hash " + snapshot.hashContents.GetHex() + " is not the expected one");
+    BlockMap::iterator mi = mapBlockIndex.find(snapshot.hashBlock);
+    if (mi == mapBlockIndex.end() || !mi->second->IsValid(BLOCK_VALID_TREE) || (mi->second->nStatus & BLOCK_FAILED_MASK))
+        return state.Error("Header of snapshot block " + snapshot.hashBlock.GetHex() + " not received yet");
+    CBlockIndex *pindex = mi->second;
+    if (pindex->nHeight != snapshot.nHeight || snapshot.nChainTx == 0)
+        return state.Error("Snapshot does not match its block");
+
+    if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
+        return false;
+    // Recorded first, so that a partly loaded snapshot is never mistaken
+    // for a chain state connected up to the genesis block.
+    if (!pblocktree->WriteSnapshotBlock(pindex->GetBlockHash(), snapshot.nChainTx))
+        return AbortNode(state, "Failed to write snapshot block");
+    {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull() || !pcoinsdbview->ReadSnapshot(file, snapshot, true))
+            return AbortNode(state, "Failed to load chain state snapshot", _("Error loading the chain state snapshot. You need to rebuild the database using -reindex."));
+    }
+    pcoinsTip->Clear();
+    mempool.clear();
+
+    SetSnapshotBlock(pindex, snapshot.nChainTx);
+    pindex->hashFinalSproutRoot = snapshot.hashSproutAnchor;
+    chainActive.SetTip(pindex);
+
+    // Link the blocks after it that were received already.
+    deque<CBlockIndex*> queue(1, pindex);
+    while (!queue.empty()) {
+        CBlockIndex *pindexLinked = queue.front();
+        queue.pop_front();
+        if (pindexLinked != pindex) {
+            pindexLinked->nChainTx = pindexLinked->pprev->nChainTx + pindexLinked->nTx;
+            setBlockIndexCandidates.insert(pindexLinked);
+        }
+        std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindexLinked);
+        while (range.first != range.second) {
+            std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
+            queue.push_back(it->second);
+            range.first++;
+            mapBlocksUnlinked.erase(it);
+        }
+    }
+    PruneBlockIndexCandidates();
+
+    LogPrintf("%s: loaded snapshot of block %s at height %d\n", __func__, pindex->GetBlockHash().ToString(), pindex->nHeight);
+    GetMainSignals().UpdatedBlockTip(pindex);
+    uiInterface.NotifyBlockTip(pindex->GetBlockHash());
+    return true;
+}
+
 
 bool InitBlockIndex() {
     const CChainParams& chainparams = Params();
@@ -4487,66 +4964,65 @@ bool InitBlockIndex() {
 
 
 
+/** A block read by LoadExternalBlockFile before its parent. */
+struct CUnknownParentBlock
+{
+    //! The block, if it fit in MAX_UNKNOWN_PARENT_BLOCKS_SIZE
+    std::shared_ptr<CBlock> block;
+    unsigned int nSize;
+    bool fPOWValid;
+    //! Where the block is on disk, if reindexing
+    CDiskBlockPos pos;
+
+    CUnknownParentBlock() : nSize(0), fPOWValid(false) {}
+};
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     const CChainParams& chainparams = Params();
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    // Blocks with unknown parent, kept decoded while they fit and otherwise
+    // read again from their disk position (only for reindex)
+    static std::multimap<uint256, CUnknownParentBlock> mapBlocksUnknownParent;
+    static size_t nUnknownParentSize = 0;
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        // Blocks are read and checked ahead on the -par threads; this takes
+        // over fileIn and calls fclose() on it when done
+        CBlockFileReader reader(fileIn, chainparams.MessageStart(), true);
+        CImportedBlock imported;
+        while (reader.Next(imported)) {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
-            }
             try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
                 if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
+                    dbp->nPos = imported.nPos;
+                CBlock& block = *imported.block;
 
                 // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
+                uint256 hash = imported.hash;
                 if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
                     LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
                             block.hashPrevBlock.ToString());
+                    CUnknownParentBlock unknown;
+                    if (nUnknownParentSize + imported.nSize <= MAX_UNKNOWN_PARENT_BLOCKS_SIZE) {
+                        unknown.block = imported.block;
+                        unknown.nSize = imported.nSize;
+                        unknown.fPOWValid = imported.fPOWValid;
+                        nUnknownParentSize += imported.nSize;
+                    }
                     if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+                        unknown.pos = *dbp;
+                    if (unknown.block || dbp)
+                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, unknown));
                     continue;
                 }
 
                 // process in case the block isn't known yet
                 if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
                     CValidationState state;
-                    if (ProcessNewBlock(state, NULL, &block, true, dbp))
+                    if (ProcessNewBlock(state, NULL, &block, true, dbp, !imported.fPOWValid))
                         nLoaded++;
                     if (state.IsError())
                         break;
@@ -4560,18 +5036,29 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 while (!queue.empty()) {
                     uint256 head = queue.front();
                     queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                    std::pair<std::multimap<uint256, CUnknownParentBlock>::iterator, std::multimap<uint256, CUnknownParentBlock>::iterator> range = mapBlocksUnknownParent.equal_range(head);
                     while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second))
+                        std::multimap<uint256, CUnknownParentBlock>::iterator it = range.first;
+                        CUnknownParentBlock& unknown = it->second;
+                        std::shared_ptr<CBlock> pblock = unknown.block;
+                        bool fCheckPOW = !unknown.fPOWValid;
+                        if (pblock) {
+                            nUnknownParentSize -= unknown.nSize;
+                        } else {
+                            pblock = std::make_shared<CBlock>();
+                            if (!ReadBlockFromDisk(*pblock, unknown.pos))
+                                pblock.reset();
+                            fCheckPOW = true;
+                        }
+                        if (pblock)
                         {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
+                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, pblock->GetHash().ToString(),
                                     head.ToString());
                             CValidationState dummy;
-                            if (ProcessNewBlock(dummy, NULL, &block, true, &it->second))
+                            if (ProcessNewBlock(dummy, NULL, pblock.get(), true, unknown.pos.IsNull() ? NULL : &unknown.pos, fCheckPOW))
                             {
                                 nLoaded++;
-                                queue.push_back(block.GetHash());
+                                queue.push_back(pblock->GetHash());
                             }
                         }
                         range.first++;
@@ -4607,6 +5094,12 @@ void static CheckBlockIndex()
         return;
     }
 
+    // The checks below expect every block of the active chain to have been
+    // downloaded, which is not so after loading a chain state snapshot.
+    if (pindexSnapshot) {
+        return;
+    }
+
     // Build forward-pointing map of the entire block tree.
     std::multimap<CBlockIndex*,CBlockIndex*> forward;
     for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); it++) {
@@ -4868,7 +5361,8 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoins(inv.hash);
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) || // Best effort: only try output 0 and 1
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
@@ -4922,14 +5416,20 @@ void static ProcessGetData(CNode* pfrom)
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
+                    // Send block from disk; a full block goes out as it was stored, without decoding it
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    {
+                        std::shared_ptr<const std::vector<unsigned char> > data = ReadRawBlockFromDiskCached((*mi).second);
+                        if (!data)
+                            assert(!"cannot load block from disk");
+                        pfrom->PushMessage("block", CFlatData((void*)begin_ptr(*data), (void*)end_ptr(*data)));
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        std::shared_ptr<const CBlock> pblock = ReadBlockFromDiskCached((*mi).second);
+                        if (!pblock)
+                            assert(!"cannot load block from disk");
+                        const CBlock& block = *pblock;
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -4944,7 +5444,7 @@ void static ProcessGetData(CNode* pfrom)
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
                                 if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
+                                    pfrom->PushMessage("tx", *block.vtx[pair.first]);
                         }
                         // else
                             // no response
@@ -4970,10 +5470,10 @@ void static ProcessGetData(CNode* pfrom)
                 // in mapRelay after a successful relay.
                 bool isExpiringSoon = false;
                 bool pushed = false;
-                CTransaction tx;
-                bool isInMempool = mempool.lookup(inv.hash, tx);
+                CTransactionRef ptx = mempool.get(inv.hash);
+                bool isInMempool = (bool)ptx;
                 if (isInMempool) {
-                    isExpiringSoon = IsExpiringSoonTx(tx, currentHeight + 1);
+                    isExpiringSoon = IsExpiringSoonTx(*ptx, currentHeight + 1);
                 }
 
                 if (!isExpiringSoon) {
@@ -4990,7 +5490,7 @@ void static ProcessGetData(CNode* pfrom)
                         if (isInMempool) {
                             CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                             ss.reserve(1000);
-                            ss << tx;
+                            ss << *ptx;
                             pfrom->PushMessage("tx", ss);
                             pushed = true;
                         }
@@ -5024,6 +5524,305 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/** Check the next transaction of queueTxProofCheck; run by QueueCheckJob. */
+static void TxProofCheckJob()
+{
+    CTxProofCheck check;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_txproofcheck);
+        // The transactions of disconnected peers leave the queue without their job
+        if (queueTxProofCheck.empty())
+            return;
+        check = queueTxProofCheck.front();
+        queueTxProofCheck.pop_front();
+    }
+
+    const CTransaction& tx = *check.tx;
+    auto verifier = libzcash::ProofVerifier::Strict();
+    if (CheckTransactionWithoutProofVerification(tx, check.state) &&
+        VerifyJoinSplits(tx, check.state, verifier) &&
+        ContextualCheckSaplingProofs(tx, check.state, check.consensusBranchId)) {
+        if (!tx.vjoinsplit.empty())
+            ProofCacheInsert(tx.GetHash(), 0, PROOF_CACHE_SPROUT);
+        if (!tx.vShieldedSpend.empty() || !tx.vShieldedOutput.empty())
+            ProofCacheInsert(tx.GetHash(), check.consensusBranchId, PROOF_CACHE_SAPLING);
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(cs_txproofcheck);
+        // Drop the transaction if all its peers have disconnected meanwhile
+        map<uint256, CTxProofCheckPeers>::iterator it = mapTxProofCheckInFlight.find(tx.GetHash());
+        if (it == mapTxProofCheckInFlight.end())
+            return;
+        mapTxProofChecked[it->second.nodeId].push_back(check);
+    }
+    WakeMessageHandler();
+}
+
+/**
+ * Queue a shielded transaction received from pfrom for its proofs to be checked
+ * on the -par threads.
+ * Returns false if the transaction should be processed right away instead.
+ */
+bool QueueTxProofCheck(CNode* pfrom, const CTransactionRef& ptx)
+{
+    const CTransaction& tx = *ptx;
+    if (nScriptCheckThreads == 0)
+        return false;
+    if (tx.vjoinsplit.empty() && tx.vShieldedSpend.empty() && tx.vShieldedOutput.empty())
+        return false;
+
+    uint32_t consensusBranchId = CurrentEpochBranchId(nTxProofCheckTipHeight + 1, Params().GetConsensus());
+    bool fSproutChecked = tx.vjoinsplit.empty() || ProofCacheContains(tx.GetHash(), 0, PROOF_CACHE_SPROUT);
+    bool fSaplingChecked = (tx.vShieldedSpend.empty() && tx.vShieldedOutput.empty()) ||
+                           ProofCacheContains(tx.GetHash(), consensusBranchId, PROOF_CACHE_SAPLING);
+    if (fSproutChecked && fSaplingChecked)
+        return false;
+
+    {
+        boost::unique_lock<boost::mutex> lock(cs_txproofcheck);
+        map<uint256, CTxProofCheckPeers>::iterator it = mapTxProofCheckInFlight.find(tx.GetHash());
+        if (it != mapTxProofCheckInFlight.end()) {
+            // Already sent by another peer; it is processed for that peer once
+            // checked, or for this one if that peer disconnects first
+            CTxProofCheckPeers& peers = it->second;
+            if (peers.nodeId != pfrom->GetId() &&
+                std::find(peers.vFallback.begin(), peers.vFallback.end(), pfrom->GetId()) == peers.vFallback.end())
+                peers.vFallback.push_back(pfrom->GetId());
+            pfrom->setAskFor.erase(tx.GetHash());
+            return true;
+        }
+        // A peer sending more than its share is checked inline, at its own expense
+        if (mapTxProofCheckInFlight.size() >= MAX_TX_PROOF_CHECK_QUEUE)
+            return false;
+        unsigned int& nPeerChecks = mapTxProofChecksPerPeer[pfrom->GetId()];
+        if (nPeerChecks >= MAX_TX_PROOF_CHECK_PER_PEER)
+            return false;
+
+        CTxProofCheck check;
+        check.tx = ptx;
+        check.consensusBranchId = consensusBranchId;
+        queueTxProofCheck.push_back(check);
+        mapTxProofCheckInFlight[tx.GetHash()].nodeId = pfrom->GetId();
+        nPeerChecks++;
+    }
+    QueueCheckJob(&TxProofCheckJob);
+    return true;
+}
+
+/**
+ * Hand the transactions of a disconnected peer waiting for their proofs to be
+ * checked over to the next peer that sent them, or forget them.
+ */
+void EraseTxProofChecksFor(NodeId nodeId)
+{
+    AssertLockHeld(cs_main);
+    bool fHandedOver = false;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_txproofcheck);
+        std::deque<CTxProofCheck> vChecked;
+        map<NodeId, std::deque<CTxProofCheck> >::iterator itChecked = mapTxProofChecked.find(nodeId);
+        if (itChecked != mapTxProofChecked.end()) {
+            vChecked.swap(itChecked->second);
+            mapTxProofChecked.erase(itChecked);
+        }
+        mapTxProofChecksPerPeer.erase(nodeId);
+
+        map<uint256, CTxProofCheckPeers>::iterator it = mapTxProofCheckInFlight.begin();
+        while (it != mapTxProofCheckInFlight.end()) {
+            CTxProofCheckPeers& peers = it->second;
+            peers.vFallback.erase(std::remove(peers.vFallback.begin(), peers.vFallback.end(), nodeId), peers.vFallback.end());
+            if (peers.nodeId != nodeId) {
+                it++;
+            } else if (!peers.vFallback.empty()) {
+                peers.nodeId = peers.vFallback.front();
+                peers.vFallback.erase(peers.vFallback.begin());
+                mapTxProofChecksPerPeer[peers.nodeId]++;
+                it++;
+            } else {
+                // Let another peer announce it again
+                mapAlreadyAskedFor.erase(CInv(MSG_TX, it->first));
+                mapTxProofCheckInFlight.erase(it++);
+            }
+        }
+
+        BOOST_FOREACH(const CTxProofCheck& check, vChecked) {
+            it = mapTxProofCheckInFlight.find(check.tx->GetHash());
+            if (it != mapTxProofCheckInFlight.end()) {
+                mapTxProofChecked[it->second.nodeId].push_back(check);
+                fHandedOver = true;
+            }
+        }
+        std::deque<CTxProofCheck>::iterator itQueue = queueTxProofCheck.begin();
+        while (itQueue != queueTxProofCheck.end()) {
+            if (mapTxProofCheckInFlight.count(itQueue->tx->GetHash()))
+                itQueue++;
+            else
+                itQueue = queueTxProofCheck.erase(itQueue);
+        }
+    }
+    if (fHandedOver)
+        WakeMessageHandler();
+}
+
+/**
+ * Accept a transaction received from pfrom to the mempool, together with the
+ * orphans it was missing, and relay them; or reject it. A state that is
+ * already invalid is the result of the checks of TxProofCheckJob.
+ */
+static void ProcessTransaction(CNode* pfrom, const CTransactionRef& ptx, CValidationState& state)
+{
+    AssertLockHeld(cs_main);
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
+    const CTransaction& tx = *ptx;
+
+    CInv inv(MSG_TX, tx.GetHash());
+    bool fMissingInputs = false;
+
+    pfrom->setAskFor.erase(inv.hash);
+    mapAlreadyAskedFor.erase(inv);
+
+    if (state.IsValid() && !AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, ptx, true, &fMissingInputs))
+    {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx);
+        vWorkQueue.push_back(inv.hash);
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
+            pfrom->id, pfrom->cleanSubVer,
+            tx.GetHash().ToString(),
+            mempool.mapTx.size());
+
+        // Recursively process any orphan transactions that depended on this one
+        set<NodeId> setMisbehaving;
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        {
+            map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
+            if (itByPrev == mapOrphanTransactionsByPrev.end())
+                continue;
+            for (set<uint256>::iterator mi = itByPrev->second.begin();
+                 mi != itByPrev->second.end();
+                 ++mi)
+            {
+                const uint256& orphanHash = *mi;
+                CTransactionRef porphanTx = mapOrphanTransactions[orphanHash].tx;
+                const CTransaction& orphanTx = *porphanTx;
+                NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
+                bool fMissingInputs2 = false;
+                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                // anyone relaying LegitTxX banned)
+                CValidationState stateDummy;
+
+
+                if (setMisbehaving.count(fromPeer))
+                    continue;
+                if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, true, &fMissingInputs2))
+                {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                    RelayTransaction(orphanTx);
+                    vWorkQueue.push_back(orphanHash);
+                    vEraseQueue.push_back(orphanHash);
+                }
+                else if (!fMissingInputs2)
+                {
+                    int nDos = 0;
+                    if (stateDummy.IsInvalid(nDos) && nDos > 0)
+                    {
+                        // Punish peer that gave us an invalid orphan tx
+                        Misbehaving(fromPeer, nDos);
+                        setMisbehaving.insert(fromPeer);
+                        LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                    }
+                    // Has inputs but not accepted to mempool
+                    // Probably non-standard or insufficient fee/priority
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                    vEraseQueue.push_back(orphanHash);
+                    assert(recentRejects);
+                    recentRejects->insert(orphanHash);
+                }
+                mempool.check(pcoinsTip);
+            }
+        }
+
+        BOOST_FOREACH(uint256 hash, vEraseQueue)
+            EraseOrphanTx(hash);
+    }
+    // TODO: currently, prohibit joinsplits and shielded spends/outputs from entering mapOrphans
+    else if (fMissingInputs &&
+             tx.vjoinsplit.empty() &&
+             tx.vShieldedSpend.empty() &&
+             tx.vShieldedOutput.empty())
+    {
+        AddOrphanTx(ptx, pfrom->GetId());
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    } else {
+        assert(recentRejects);
+        recentRejects->insert(tx.GetHash());
+
+        if (pfrom->fWhitelisted) {
+            // Always relay transactions received from whitelisted peers, even
+            // if they were already in the mempool or rejected from it due
+            // to policy, allowing the node to function as a gateway for
+            // nodes hidden behind it.
+            //
+            // Never relay transactions that we would assign a non-zero DoS
+            // score for, as we expect peers to do the same with us in that
+            // case.
+            int nDoS = 0;
+            if (!state.IsInvalid(nDoS) || nDoS == 0) {
+                LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
+                RelayTransaction(tx);
+            } else {
+                LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
+                    tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
+            }
+        }
+    }
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+    {
+        LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->id, pfrom->cleanSubVer,
+            state.GetRejectReason());
+        pfrom->PushMessage("reject", (string)"tx", state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
+/** Process the transactions from pfrom that TxProofCheckJob is done with. */
+void ProcessCheckedTransactions(CNode* pfrom)
+{
+    std::deque<CTxProofCheck> vChecked;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_txproofcheck);
+        map<NodeId, std::deque<CTxProofCheck> >::iterator it = mapTxProofChecked.find(pfrom->GetId());
+        if (it == mapTxProofChecked.end())
+            return;
+        vChecked.swap(it->second);
+        mapTxProofChecked.erase(it);
+        BOOST_FOREACH(const CTxProofCheck& check, vChecked) {
+            if (mapTxProofCheckInFlight.erase(check.tx->GetHash()) == 0)
+                continue;
+            map<NodeId, unsigned int>::iterator itPeer = mapTxProofChecksPerPeer.find(pfrom->GetId());
+            if (itPeer != mapTxProofChecksPerPeer.end() && --itPeer->second == 0)
+                mapTxProofChecksPerPeer.erase(itPeer);
+        }
+    }
+
+    LOCK(cs_main);
+    BOOST_FOREACH(CTxProofCheck& check, vChecked)
+        ProcessTransaction(pfrom, check.tx, check.state);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -5454,134 +6253,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CTransaction tx;
-        vRecv >> tx;
+        CTransactionRef ptx;
+        vRecv >> ptx;
+        const CTransaction& tx = *ptx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
+        // Shielded transactions come back through ProcessCheckedTransactions
+        // once their proofs are checked
+        if (QueueTxProofCheck(pfrom, ptx))
+            return true;
 
-        bool fMissingInputs = false;
+        LOCK(cs_main);
         CValidationState state;
-
-        pfrom->setAskFor.erase(inv.hash);
-        mapAlreadyAskedFor.erase(inv);
-
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
-        {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
-                pfrom->id, pfrom->cleanSubVer,
-                tx.GetHash().ToString(),
-                mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        assert(recentRejects);
-                        recentRejects->insert(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        // TODO: currently, prohibit joinsplits and shielded spends/outputs from entering mapOrphans
-        else if (fMissingInputs &&
-                 tx.vjoinsplit.empty() &&
-                 tx.vShieldedSpend.empty() &&
-                 tx.vShieldedOutput.empty())
-        {
-            AddOrphanTx(tx, pfrom->GetId());
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else {
-            assert(recentRejects);
-            recentRejects->insert(tx.GetHash());
-
-            if (pfrom->fWhitelisted) {
-                // Always relay transactions received from whitelisted peers, even
-                // if they were already in the mempool or rejected from it due
-                // to policy, allowing the node to function as a gateway for
-                // nodes hidden behind it.
-                //
-                // Never relay transactions that we would assign a non-zero DoS
-                // score for, as we expect peers to do the same with us in that
-                // case.
-                int nDoS = 0;
-                if (!state.IsInvalid(nDoS) || nDoS == 0) {
-                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
-                    RelayTransaction(tx);
-                } else {
-                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
-                        tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
-                }
-            }
-        }
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-        {
-            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
-        }
+        ProcessTransaction(pfrom, ptx, state);
     }
 
 
@@ -5601,6 +6287,24 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Verify the Equihash solutions of the headers we don't know yet in
+        // parallel, before taking cs_main to connect them in order. Headers
+        // that fail are checked again by AcceptBlockHeader, which rejects them.
+        std::unique_ptr<bool[]> vfPOWValid(new bool[nCount]());
+        if (nScriptCheckThreads && nCount > 1) {
+            std::vector<CHeaderCheck> vChecks;
+            {
+                LOCK(cs_main);
+                for (unsigned int n = 0; n < nCount; n++) {
+                    if (!mapBlockIndex.count(headers[n].GetHash()))
+                        vChecks.push_back(CHeaderCheck(headers[n], &vfPOWValid[n]));
+                }
+            }
+            CCheckQueueControl<CHeaderCheck> control(&headercheckqueue);
+            control.Add(vChecks);
+            control.Wait();
+        }
+
         LOCK(cs_main);
 
         if (nCount == 0) {
@@ -5609,13 +6313,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         CBlockIndex *pindexLast = NULL;
-        BOOST_FOREACH(const CBlockHeader& header, headers) {
+        for (unsigned int n = 0; n < nCount; n++) {
+            const CBlockHeader& header = headers[n];
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
-            if (!AcceptBlockHeader(header, state, &pindexLast)) {
+            if (!AcceptBlockHeader(header, state, &pindexLast, !vfPOWValid[n])) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
@@ -5701,16 +6406,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         mempool.queryHashes(vtxid);
         vector<CInv> vInv;
         BOOST_FOREACH(uint256& hash, vtxid) {
-            CTransaction tx;
-            bool fInMemPool = mempool.lookup(hash, tx);
-            if (fInMemPool && IsExpiringSoonTx(tx, currentHeight + 1)) {
+            CTransactionRef ptx = mempool.get(hash);
+            bool fInMemPool = (bool)ptx;
+            if (fInMemPool && IsExpiringSoonTx(*ptx, currentHeight + 1)) {
                 continue;
             }
 
             CInv inv(MSG_TX, hash);
             if (pfrom->pfilter) {
                 if (!fInMemPool) continue; // another thread removed since queryHashes, maybe...
-                if (!pfrom->pfilter->IsRelevantAndUpdate(tx)) continue;
+                if (!pfrom->pfilter->IsRelevantAndUpdate(*ptx)) continue;
             }
             vInv.push_back(inv);
             if (vInv.size() == MAX_INV_SZ) {
@@ -5953,6 +6658,8 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
+    ProcessCheckedTransactions(pfrom);
+
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom);
 
@@ -11,6 +11,7 @@
 #endif
 
 #include "amount.h"
+#include "blockcache.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "coins.h"
@@ -29,6 +30,7 @@
 
 #include <algorithm>
 #include <exception>
+#include <functional>
 #include <map>
 #include <set>
 #include <stdint.h>
@@ -41,12 +43,18 @@
 class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
+class CCoinsViewDB;
+class CHeaderCheck;
 class CInv;
+class CJoinSplitCheck;
+class CSaplingCheck;
 class CScriptCheck;
+class CTxUndo;
 class CValidationInterface;
 class CValidationState;
 class PrecomputedTransactionData;
 
+struct CChainStateSnapshot;
 struct CNodeStateStats;
 
 /** Default for -blockmaxsize and -blockminsize, which control the range of sizes the mining code will create **/
@@ -54,6 +62,8 @@ static const unsigned int DEFAULT_BLOCK_MAX_SIZE = MAX_BLOCK_SIZE;
 static const unsigned int DEFAULT_BLOCK_MIN_SIZE = 0;
 /** Default for -blockprioritysize, maximum space for zero/low-fee transactions **/
 static const unsigned int DEFAULT_BLOCK_PRIORITY_SIZE = DEFAULT_BLOCK_MAX_SIZE / 2;
+/** Default for -checkblockreads, re-verifying the proof of work of blocks read from disk */
+static const bool DEFAULT_CHECK_BLOCK_READS = false;
 /** Default for accepting alerts from the P2P network. */
 static const bool DEFAULT_ALERTS = true;
 /** Minimum alert priority for enabling safe mode. */
@@ -66,8 +76,22 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** Default for -minrelaytxfee, minimum relay fee for transactions */
 static const unsigned int DEFAULT_MIN_RELAY_TX_FEE = 100;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** The maximum number of received shielded transactions waiting for their proofs to be checked */
+static const unsigned int MAX_TX_PROOF_CHECK_QUEUE = 1000;
+/** The maximum number of those transactions received from the same peer */
+static const unsigned int MAX_TX_PROOF_CHECK_PER_PEER = 100;
 /** Default for -txexpirydelta, in number of blocks */
 static const unsigned int DEFAULT_TX_EXPIRY_DELTA = 20;
 /** The number of blocks within expiry height when a tx is considered to be expiring soon */
@@ -80,6 +104,8 @@ static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Minimum number of JoinSplit proofs verified together by a CJoinSplitCheck */
+static const unsigned int MIN_JOINSPLIT_CHECK_BATCH_SIZE = 4;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
 /** Number of blocks that can be requested at any given time from a single peer. */
@@ -119,6 +145,7 @@ extern unsigned int expiryDelta;
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
+extern CBlockCache blockcache;
 typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
@@ -133,6 +160,7 @@ extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
+extern bool fCheckBlockReads;
 extern bool fCheckpointsEnabled;
 // TODO: remove this flag by structuring our code such that
 // it is unneeded for testing
@@ -168,6 +196,9 @@ static const unsigned int MIN_BLOCKS_TO_KEEP = 288;
 // Setting the target to > than 550MB will make it likely we can respect the target.
 static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
 
+/** Serialized size of the out of order blocks that block imports keep in memory until their parent is loaded */
+static const size_t MAX_UNKNOWN_PARENT_BLOCKS_SIZE = 128 * 1024 * 1024;
+
 /** Register with a network node to receive its signals */
 void RegisterNodeSignals(CNodeSignals& nodeSignals);
 /** Unregister a network node */
@@ -183,9 +214,10 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
  * @param[in]   pblock  The block we want to process.
  * @param[in]   fForceProcessing Process this block even if unrequested; used for non-network block sources and whitelisted peers.
  * @param[out]  dbp     If pblock is stored to disk (or already there), this will be set to its location.
+ * @param[in]   fCheckPOW Whether to check the Equihash solution and proof of work, false if the caller already did.
  * @return True if state.IsValid()
  */
-bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool fForceProcessing, CDiskBlockPos *dbp);
+bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool fForceProcessing, CDiskBlockPos *dbp, bool fCheckPOW = true);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -202,6 +234,13 @@ bool InitBlockIndex();
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
+/**
+ * Replace the chain state, which must still be at the genesis block, by the
+ * snapshot in a file written by dumpchainstate. The header of the snapshot
+ * block must be known already. If hashExpected is set, the snapshot must
+ * commit to it. Blocks after the snapshot block are connected as usual.
+ */
+bool LoadChainStateSnapshot(const boost::filesystem::path &path, const uint256 &hashExpected, CChainStateSnapshot &snapshot, CValidationState &state);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /**
@@ -211,8 +250,13 @@ bool ProcessMessages(CNode* pfrom);
  * @param[in]   fSendTrickle    When true send the trickled data, otherwise trickle the data until true.
  */
 bool SendMessages(CNode* pto, bool fSendTrickle);
-/** Run an instance of the script checking thread */
-void ThreadScriptCheck();
+/** Run an instance of the worker thread that script, proof and header checks share */
+void ThreadCheckQueue();
+/**
+ * Run job on one of the threads of ThreadCheckQueue. Returns false, without
+ * running it, when there are no such threads.
+ */
+bool QueueCheckJob(const std::function<void()>& job);
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -258,9 +302,12 @@ void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
-/** (try to) add transaction to memory pool **/
+/** (try to) add transaction to memory pool; the pool keeps a reference to ptx rather than a copy **/
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransactionRef &ptx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fOverrideMempoolLimit=false);
+/** (try to) add a copy of the transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+                        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fOverrideMempoolLimit=false);
 
 
 struct CNodeStateStats {
@@ -348,8 +395,27 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, cons
 bool ContextualCheckTransaction(const CTransaction& tx, CValidationState &state, int nHeight, int dosLevel,
                                 bool (*isInitBlockDownload)() = IsInitialBlockDownload);
 
+/**
+ * Check the Sapling spend and output proofs, spend authorization signatures and binding
+ * signature of this transaction. If pvChecks is not NULL, the checks are pushed onto it
+ * instead of being performed inline.
+ */
+bool ContextualCheckSaplingProofs(const CTransaction& tx, CValidationState &state, uint32_t consensusBranchId,
+                                  std::vector<CSaplingCheck> *pvChecks = NULL);
+
+/**
+ * Check the PHGR JoinSplit proofs of the transactions in this block, in batches
+ * that each share a single pairing product check. If pvChecks is not NULL, the
+ * batches are pushed onto it instead of being verified inline. Transactions with
+ * Groth proofs are skipped, as CheckTransaction always verifies those.
+ */
+bool CheckJoinSplitProofs(const CBlock& block, CValidationState &state,
+                          std::vector<CJoinSplitCheck> *pvChecks = NULL);
+
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
+/** As above, recording the spent coins in txundo */
+void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txundo, int nHeight);
 
 /** Transaction validation functions */
 
@@ -419,8 +485,8 @@ private:
 
 public:
     CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), consensusBranchId(0), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, uint32_t consensusBranchIdIn, PrecomputedTransactionData* txdataIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, uint32_t consensusBranchIdIn, PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), consensusBranchId(consensusBranchIdIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
@@ -440,11 +506,104 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+enum SaplingCheckError {
+    SAPLING_ERR_OK = 0,
+    SAPLING_ERR_UNKNOWN,
+    SAPLING_ERR_SIGHASH,
+    SAPLING_ERR_SPEND,
+    SAPLING_ERR_OUTPUT,
+    SAPLING_ERR_BINDING_SIG,
+};
+
+/**
+ * Closure representing the Sapling checks of one transaction: all spend and
+ * output descriptions are verified in a single verification context, which
+ * is then used for the final binding signature check.
+ */
+class CSaplingCheck
+{
+private:
+    const CTransaction *ptxTo;
+    uint32_t consensusBranchId;
+    SaplingCheckError error;
+
+public:
+    CSaplingCheck(): ptxTo(0), consensusBranchId(0), error(SAPLING_ERR_UNKNOWN) {}
+    CSaplingCheck(const CTransaction& txToIn, uint32_t consensusBranchIdIn) :
+        ptxTo(&txToIn), consensusBranchId(consensusBranchIdIn), error(SAPLING_ERR_UNKNOWN) { }
+
+    bool operator()();
+
+    void swap(CSaplingCheck &check) {
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(consensusBranchId, check.consensusBranchId);
+        std::swap(error, check.error);
+    }
+
+    SaplingCheckError GetSaplingError() const { return error; }
+};
+
+/**
+ * Closure representing the JoinSplit proof checks of a group of transactions.
+ * The PHGR proofs of all of them are verified as one batch (see
+ * libzcash::ProofVerifier::Batch()).
+ */
+class CJoinSplitCheck
+{
+private:
+    std::vector<const CTransaction*> vptxTo;
+
+public:
+    CJoinSplitCheck() {}
+    CJoinSplitCheck(const std::vector<const CTransaction*>& vptxToIn) : vptxTo(vptxToIn) { }
+
+    bool operator()();
+
+    void swap(CJoinSplitCheck &check) {
+        vptxTo.swap(check.vptxTo);
+    }
+};
+
+/**
+ * Closure representing the context-free proof of work checks (Equihash
+ * solution and target) of one block header. The result is stored in
+ * *pfValid only, so that the checks of the other headers of the batch are
+ * still run after a failing one.
+ */
+class CHeaderCheck
+{
+private:
+    const CBlockHeader *pheader;
+    bool *pfValid;
+
+public:
+    CHeaderCheck(): pheader(0), pfValid(0) {}
+    CHeaderCheck(const CBlockHeader& headerIn, bool *pfValidIn) :
+        pheader(&headerIn), pfValid(pfValidIn) { }
+
+    bool operator()();
+
+    void swap(CHeaderCheck &check) {
+        std::swap(pheader, check.pheader);
+        std::swap(pfValid, check.pfValid);
+    }
+};
+
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Read the block as serialized on disk, checking only its header, as ReadBlockFromDisk does */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& data, const CBlockIndex* pindex);
+/**
+ * Read a block through the cache of recently read blocks. Returns NULL on
+ * failure. Without fFillCache, a block missing from the cache is not added,
+ * for reads of many old blocks in a row.
+ */
+std::shared_ptr<const CBlock> ReadBlockFromDiskCached(const CBlockIndex* pindex, bool fFillCache = true);
+/** Read the serialized block through the cache of recently read blocks. Returns NULL on failure. */
+std::shared_ptr<const std::vector<unsigned char> > ReadRawBlockFromDiskCached(const CBlockIndex* pindex);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -453,7 +612,7 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
  *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
+bool DisconnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
 
 /** Apply the effects of this block (with given index) on the UTXO set represented by coins */
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false);
@@ -473,13 +632,13 @@ bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex
 
 /**
  * Store block on disk.
- * JoinSplit proofs are never verified, because:
+ * JoinSplit and Sapling proofs are never verified, because:
  * - AcceptBlock doesn't perform script checks either.
- * - The only caller of AcceptBlock verifies JoinSplit proofs elsewhere.
+ * - The only caller of AcceptBlock verifies JoinSplit and Sapling proofs elsewhere.
  * If dbp is non-NULL, the file is known to already reside on disk
  */
-bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex **pindex, bool fRequested, CDiskBlockPos* dbp);
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex **ppindex= NULL);
+bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex **pindex, bool fRequested, CDiskBlockPos* dbp, bool fCheckPOW = true);
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex **ppindex= NULL, bool fCheckPOW = true);
 
 
 
@@ -567,6 +726,9 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex *pindex);
 /** The currently-connected chain of blocks (protected by cs_main). */
 extern CChain chainActive;
 
+/** Global variable that points to the coins database, below pcoinsTip (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
@@ -15,8 +15,10 @@
 #include "consensus/validation.h"
 #ifdef ENABLE_MINING
 #include "crypto/equihash.h"
+#include "crypto/equihash_bucket.h"
 #endif
 #include "hash.h"
+#include "init.h"
 #include "key_io.h"
 #include "main.h"
 #include "metrics.h"
@@ -28,6 +30,7 @@
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include "validationinterface.h"
 #ifdef ENABLE_WALLET
 #include "wallet/wallet.h"
 #endif
@@ -39,6 +42,7 @@
 #ifdef ENABLE_MINING
 #include <functional>
 #endif
+#include <atomic>
 #include <mutex>
 
 using namespace std;
@@ -50,53 +54,500 @@ using namespace std;
 
 //
 // Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// transactions in the memory pool. The mempool keeps, for every transaction,
+// the combined size, fees and sigops of the transaction and its in-mempool
+// ancestors, so CreateNewBlock fills the block with packages: a transaction
+// together with the ancestors that are not in the block yet, best ancestor
+// fee rate first. A child paying a high fee thus gets its parents mined too.
 //
-class COrphan
+
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+namespace {
+
+/**
+ * A mempool transaction whose ancestor state leaves out the ancestors that
+ * are already in the block being assembled.
+ */
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+        nSigOpCountWithAncestors = entry->GetSigOpCountWithAncestors();
+    }
+
+    const CTransaction& GetTx() const { return iter->GetTx(); }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+    unsigned int nSigOpCountWithAncestors;
+};
+
+struct CompareCTxMemPoolIter {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        return &(*a) < &(*b);
+    }
+};
+
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator() (const CTxMemPoolModifiedEntry &entry) const
+    {
+        return entry.iter;
+    }
+};
+
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CompareCTxMemPoolIter
+        >,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            // Reuse same tag from CTxMemPool's similar index
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareTxMemPoolEntryByAncestorFee
+        >
+    >
+> indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion
 {
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    void operator() (CTxMemPoolModifiedEntry &e)
     {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+        e.nSigOpCountWithAncestors -= iter->GetSigOpCount();
     }
+
+    CTxMemPool::txiter iter;
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+// A comparator that sorts transactions based on number of ancestors.
+// This is sufficient to sort an ancestor package in an order that is valid
+// to appear in a block.
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
+
+// We want to sort transactions by coin age priority
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+
+struct TxCoinAgePriorityCompare
+{
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
+    {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByFee()(*(b.second), *(a.second)); //Reverse order to make sort less than
+        return a.first < b.first;
+    }
+};
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+/**
+ * Selects the mempool transactions of a new block, with cs_main and
+ * mempool.cs held: first by coin age priority, up to -blockprioritysize,
+ * then by ancestor package fee rate.
+ */
+class BlockAssembler
 {
-    bool byFee;
+private:
+    CBlockTemplate* pblocktemplate;
+    CCoinsViewCache& view;
+    SaplingMerkleTree& sapling_tree;
+
+    const int nHeight;
+    const int64_t nLockTimeCutoff;
+    const uint32_t consensusBranchId;
+    const unsigned int nBlockMaxSize;
+    const unsigned int nBlockMinSize;
+    const bool fPrintPriority;
+
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    CTxMemPool::setEntries inBlock;
+    //! Transactions that cannot go into this block, nor their descendants
+    CTxMemPool::setEntries invalidTx;
 
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
+    BlockAssembler(CBlockTemplate* pblocktemplateIn, CCoinsViewCache& viewIn, SaplingMerkleTree& sapling_treeIn,
+                   int nHeightIn, int64_t nLockTimeCutoffIn, uint32_t consensusBranchIdIn,
+                   unsigned int nBlockMaxSizeIn, unsigned int nBlockMinSizeIn) :
+        pblocktemplate(pblocktemplateIn), view(viewIn), sapling_tree(sapling_treeIn),
+        nHeight(nHeightIn), nLockTimeCutoff(nLockTimeCutoffIn), consensusBranchId(consensusBranchIdIn),
+        nBlockMaxSize(nBlockMaxSizeIn), nBlockMinSize(nBlockMinSizeIn),
+        fPrintPriority(GetBoolArg("-printpriority", false)),
+        nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0) {}
+
+    uint64_t GetBlockSize() const { return nBlockSize; }
+    uint64_t GetBlockTx() const { return nBlockTx; }
+    CAmount GetFees() const { return nFees; }
+
+    void addPriorityTxs(unsigned int nBlockPrioritySize);
+    void addPackageTxs();
+
+private:
+    bool isStillDependent(CTxMemPool::txiter iter) const;
+    void onlyUnconfirmed(CTxMemPool::setEntries& testSet) const;
+    bool TestPackage(uint64_t packageSize, unsigned int packageSigOps) const;
+    bool TestPackageTransactions(const std::vector<CTxMemPool::txiter>& package, std::vector<unsigned int>& vSigOps);
+    void AddToBlock(CTxMemPool::txiter iter, unsigned int nTxSigOps);
+    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx,
+                        const CTxMemPool::setEntries& failedTx) const;
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
+                                indexed_modified_transaction_set& mapModifiedTx) const;
+    void SortForBlock(const CTxMemPool::setEntries& package, std::vector<CTxMemPool::txiter>& sortedEntries) const;
+};
+
+bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter) const
+{
+    BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter)) {
+        if (!inBlock.count(parent))
+            return true;
+    }
+    return false;
+}
+
+void BlockAssembler::onlyUnconfirmed(CTxMemPool::setEntries& testSet) const
+{
+    for (CTxMemPool::setEntries::iterator iit = testSet.begin(); iit != testSet.end(); ) {
+        // Only test txs not already in the block
+        if (inBlock.count(*iit))
+            testSet.erase(iit++);
+        else
+            iit++;
+    }
+}
+
+bool BlockAssembler::TestPackage(uint64_t packageSize, unsigned int packageSigOps) const
+{
+    if (nBlockSize + packageSize >= nBlockMaxSize)
+        return false;
+    if (nBlockSigOps + packageSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+    return true;
+}
+
+// Check the transactions of a package, in block order, against the coins
+// of the block assembled so far, and count their sigops. The coins are only
+// updated when the whole package is valid. The mempool has checked these
+// transactions already, but the chain may have changed since, and the block
+// must only contain transactions that are valid in new blocks. A transaction
+// that fails is kept out of the rest of the block, with its descendants.
+bool BlockAssembler::TestPackageTransactions(const std::vector<CTxMemPool::txiter>& package, std::vector<unsigned int>& vSigOps)
+{
+    BOOST_FOREACH(CTxMemPool::txiter it, package) {
+        if (invalidTx.count(it))
+            return false;
+    }
+
+    CCoinsViewCache viewPackage(&view);
+    unsigned int nPackageSigOps = 0;
+    vSigOps.clear();
+    BOOST_FOREACH(CTxMemPool::txiter it, package) {
+        const CTransaction& tx = it->GetTx();
+        if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff) || IsExpiredTx(tx, nHeight) ||
+            !viewPackage.HaveInputs(tx)) {
+            invalidTx.insert(it);
+            return false;
+        }
+
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, viewPackage);
+        nPackageSigOps += nTxSigOps;
+        if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        CValidationState state;
+        PrecomputedTransactionData txdata(tx);
+        if (!ContextualCheckInputs(tx, state, viewPackage, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata, Params().GetConsensus(), consensusBranchId)) {
+            invalidTx.insert(it);
+            return false;
+        }
+
+        UpdateCoins(tx, viewPackage, nHeight);
+        vSigOps.push_back(nTxSigOps);
+    }
+    viewPackage.Flush();
+    return true;
+}
+
+void BlockAssembler::AddToBlock(CTxMemPool::txiter iter, unsigned int nTxSigOps)
+{
+    const CTransaction& tx = iter->GetTx();
+    BOOST_FOREACH(const OutputDescription &outDescription, tx.vShieldedOutput) {
+        sapling_tree.append(outDescription.cm);
+    }
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    pblocktemplate->block.vtx.push_back(iter->GetSharedTx());
+    pblocktemplate->vTxFees.push_back(iter->GetFee());
+    pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+    nBlockSize += iter->GetTxSize();
+    ++nBlockTx;
+    nBlockSigOps += nTxSigOps;
+    nFees += iter->GetFee();
+    inBlock.insert(iter);
+
+    if (fPrintPriority) {
+        double dPriority = iter->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(tx.GetHash(), dPriority, dummy);
+        LogPrintf("priority %.1f fee %s txid %s\n",
+                  dPriority,
+                  CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(),
+                  tx.GetHash().ToString());
+    }
+}
+
+void BlockAssembler::addPriorityTxs(unsigned int nBlockPrioritySize)
+{
+    if (nBlockPrioritySize == 0)
+        return;
+
+    // This vector will be sorted into a priority queue:
+    std::vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+    double actualPriority = -1;
+
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+         mi != mempool.mapTx.end(); ++mi)
     {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+    while (!vecPriority.empty()) {
+        CTxMemPool::txiter iter = vecPriority.front().second;
+        actualPriority = vecPriority.front().first;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        vecPriority.pop_back();
+
+        // If tx is dependent on other mempool txs which haven't yet been included
+        // then put it in the waitSet
+        if (isStillDependent(iter)) {
+            waitPriMap.insert(std::make_pair(iter, actualPriority));
+            continue;
         }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+
+        // If this tx fits in the block add it, otherwise keep looping
+        std::vector<CTxMemPool::txiter> package(1, iter);
+        std::vector<unsigned int> vSigOps;
+        if (TestPackage(iter->GetTxSize(), iter->GetSigOpCount()) &&
+            TestPackageTransactions(package, vSigOps)) {
+            AddToBlock(iter, vSigOps[0]);
+
+            // If now that this txs is added we've surpassed our desired priority size
+            // or have dropped below the AllowFreeThreshold, then we're done adding priority txs
+            if (nBlockSize >= nBlockPrioritySize || !AllowFree(actualPriority))
+                return;
+
+            // This tx was successfully added, so
+            // add transactions that depend on this one to the priority queue to try again
+            BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter)) {
+                waitPriIter wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end()) {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
+                }
+            }
         }
     }
-};
+}
+
+// Skip entries in mapTx that are already in a block or are present
+// in mapModifiedTx (which implies that the mapTx ancestor state is
+// stale due to ancestor inclusion in the block)
+// Also skip transactions that we've already failed to add.
+bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx,
+                                    const CTxMemPool::setEntries& failedTx) const
+{
+    assert(it != mempool.mapTx.end());
+    return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
+}
+
+// Give the descendants of the newly added transactions ancestor state that
+// leaves those transactions out.
+void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
+                                            indexed_modified_transaction_set& mapModifiedTx) const
+{
+    BOOST_FOREACH(const CTxMemPool::txiter it, alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        // Insert all descendants (not yet in block) into the modified set
+        BOOST_FOREACH(CTxMemPool::txiter desc, descendants) {
+            if (alreadyAdded.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                modEntry.nSigOpCountWithAncestors -= it->GetSigOpCount();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
+}
+
+void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, std::vector<CTxMemPool::txiter>& sortedEntries) const
+{
+    // Sort package by ancestor count
+    // If a transaction A depends on transaction B, then A's ancestor count
+    // must be greater than B's.  So this is sufficient to validly order the
+    // transactions for block inclusion.
+    sortedEntries.clear();
+    sortedEntries.insert(sortedEntries.begin(), package.begin(), package.end());
+    std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+}
+
+// This transaction selection algorithm orders the mempool based
+// on feerate of a transaction including all unconfirmed ancestors.
+// Since we don't remove transactions from the mempool as we select them
+// for block inclusion, we need an alternate method of updating the feerate
+// of a transaction with its not-yet-selected ancestors as we go.
+// This is accomplished by walking the in-mempool descendants of selected
+// transactions and storing a temporary modified state in mapModifiedTx.
+// Each time through the loop, we compare the best transaction in
+// mapModifiedTx with the next transaction in the mempool to decide what
+// transaction package to work on next.
+void BlockAssembler::addPackageTxs()
+{
+    // mapModifiedTx will store sorted packages after they are modified
+    // because some of their txs are already in the block
+    indexed_modified_transaction_set mapModifiedTx;
+    // Keep track of entries that failed inclusion, to avoid duplicate work
+    CTxMemPool::setEntries failedTx;
+
+    // Start by adding all descendants of previously added txs to mapModifiedTx
+    // and modifying them for their already included ancestors
+    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    CTxMemPool::txiter iter;
+    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty())
+    {
+        // First try to find a new transaction in mapTx to evaluate.
+        if (mi != mempool.mapTx.get<ancestor_score>().end() &&
+                SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
+            ++mi;
+            continue;
+        }
+
+        // Now that mi is not stale, determine which transaction to evaluate:
+        // the next entry from mapTx, or the best from mapModifiedTx?
+        bool fUsingModified = false;
+
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == mempool.mapTx.get<ancestor_score>().end()) {
+            // We're out of entries in mapTx; use the entry from mapModifiedTx
+            iter = modit->iter;
+            fUsingModified = true;
+        } else {
+            // Try to compare the mapTx entry to the mapModifiedTx entry
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                    CompareTxMemPoolEntryByAncestorFee()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                // The best entry in mapModifiedTx has higher score
+                // than the one from mapTx.
+                // Switch which transaction (package) to consider
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                // Either no entry in mapModifiedTx, or it's worse than mapTx.
+                // Increment mi for the next loop iteration.
+                ++mi;
+            }
+        }
+
+        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+        // contain anything that is inBlock.
+        assert(!inBlock.count(iter));
+
+        uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
+        unsigned int packageSigOps = iter->GetSigOpCountWithAncestors();
+        if (fUsingModified) {
+            packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
+            packageSigOps = modit->nSigOpCountWithAncestors;
+        }
+
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize) {
+            // Everything else we might consider has a lower fee rate
+            return;
+        }
+
+        CTxMemPool::setEntries ancestors;
+        std::vector<CTxMemPool::txiter> sortedEntries;
+        std::vector<unsigned int> vSigOps;
+        bool fPackageOk = TestPackage(packageSize, packageSigOps);
+        if (fPackageOk) {
+            uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+            std::string dummy;
+            mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+
+            onlyUnconfirmed(ancestors);
+            ancestors.insert(iter);
+
+            // Package can be added. Sort the entries in a valid order.
+            SortForBlock(ancestors, sortedEntries);
+            fPackageOk = TestPackageTransactions(sortedEntries, vSigOps);
+        }
+        if (!fPackageOk) {
+            if (fUsingModified) {
+                // Since we always look at the best entry in mapModifiedTx,
+                // we must erase failed entries so that we can consider the
+                // next best entry on the next loop iteration
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+            }
+            continue;
+        }
+
+        for (size_t i = 0; i < sortedEntries.size(); ++i) {
+            AddToBlock(sortedEntries[i], vSigOps[i]);
+            // Erase from the modified set, if present
+            mapModifiedTx.erase(sortedEntries[i]);
+        }
+
+        // Update transactions that depend on each of these
+        UpdatePackagesForAdded(ancestors, mapModifiedTx);
+    }
+}
+
+} // anonymous namespace
 
 void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
@@ -123,7 +574,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
 
     // Add dummy coinbase tx as first transaction
-    pblock->vtx.push_back(CTransaction());
+    pblock->vtx.push_back(MakeTransactionRef());
     pblocktemplate->vTxFees.push_back(-1); // updated at end
     pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
@@ -157,194 +608,18 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         SaplingMerkleTree sapling_tree;
         assert(view.GetSaplingAnchorAt(view.GetBestAnchor(SAPLING), sapling_tree));
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
-        {
-            const CTransaction& tx = mi->GetTx();
+        int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                                ? nMedianTimePast
+                                : pblock->GetBlockTime();
 
-            int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                                    ? nMedianTimePast
-                                    : pblock->GetBlockTime();
+        BlockAssembler assembler(pblocktemplate.get(), view, sapling_tree, nHeight, nLockTimeCutoff,
+                                 consensusBranchId, nBlockMaxSize, nBlockMinSize);
+        assembler.addPriorityTxs(nBlockPrioritySize);
+        assembler.addPackageTxs();
 
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff) || IsExpiredTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx.find(txin.prevout.hash)->GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            nTotalIn += tx.GetShieldedValueIn();
-
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &(mi->GetTx())));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            PrecomputedTransactionData txdata(tx);
-            if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata, Params().GetConsensus(), consensusBranchId))
-                continue;
-
-            UpdateCoins(tx, view, nHeight);
-
-            BOOST_FOREACH(const OutputDescription &outDescription, tx.vShieldedOutput) {
-                sapling_tree.append(outDescription.cm);
-            }
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        uint64_t nBlockTx = assembler.GetBlockTx();
+        uint64_t nBlockSize = assembler.GetBlockSize();
+        nFees = assembler.GetFees();
 
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
@@ -374,7 +649,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         txNew.vout[0].nValue += nFees;
         txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
 
-        pblock->vtx[0] = txNew;
+        pblock->vtx[0] = MakeTransactionRef(std::move(txNew));
         pblocktemplate->vTxFees[0] = -nFees;
 
         // Randomise nonce
@@ -390,7 +665,11 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
         pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, Params().GetConsensus());
         pblock->nSolution.clear();
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(*pblock->vtx[0]);
+        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        // The branch does not involve the coinbase, so extranonce updates
+        // only rehash the path to the root
+        pblocktemplate->vCoinbaseMerkleBranch = pblock->GetMerkleBranch(0);
 
         CValidationState state;
         if (!TestBlockValidity(state, *pblock, pindexPrev, false, false))
@@ -442,6 +721,190 @@ CBlockTemplate* CreateNewBlockWithKey()
     return CreateNewBlock(*scriptPubKey);
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Block template builder
+//
+// getblocktemplate hands out a copy of a cached template, instead of
+// assembling a block while holding cs_main and mempool.cs on every call. The
+// template is built on the RPC path only when the tip has changed since. A
+// background thread rebuilds it when the tip changes, and when a caller finds
+// that the mempool changed more than BLOCK_TEMPLATE_REFRESH_INTERVAL seconds
+// after it was built. The thread only works for a node that is being polled:
+// once no one has asked for a template for BLOCK_TEMPLATE_IDLE_TIMEOUT
+// seconds, it sleeps until the next request. Its merkle tree and coinbase
+// branch are built along with the template, so callers get them without
+// hashing.
+//
+
+namespace {
+
+CCriticalSection cs_blocktemplate;
+std::unique_ptr<CBlockTemplate> pcachedtemplate;
+const CBlockIndex* pindexCachedTemplate = NULL;
+unsigned int nCachedTemplateTxUpdated = 0;
+int64_t nCachedTemplateTime = 0;
+//! Time of the last request for a template
+std::atomic<int64_t> nLastTemplateRequest(0);
+
+boost::mutex mutexTemplateWake;
+boost::condition_variable cvTemplateWake;
+bool fTemplateWake = false;
+boost::thread* pthreadTemplateBuilder = NULL;
+
+void WakeBlockTemplateBuilder()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexTemplateWake);
+        fTemplateWake = true;
+    }
+    cvTemplateWake.notify_one();
+}
+
+class CBlockTemplateNotifier : public CValidationInterface
+{
+public:
+    virtual ~CBlockTemplateNotifier() {}
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindex)
+    {
+        // Have a template ready on the new tip for the next request
+        if (GetTime() - nLastTemplateRequest <= BLOCK_TEMPLATE_IDLE_TIMEOUT)
+            WakeBlockTemplateBuilder();
+    }
+};
+
+CBlockTemplateNotifier* pblocktemplatenotifier = NULL;
+
+// Build a template on the current tip. Requires cs_main.
+CBlockTemplate* CreateBlockTemplateForCache()
+{
+    AssertLockHeld(cs_main);
+#ifdef ENABLE_WALLET
+    if (!pwalletMain && GetArg("-mineraddress", "").empty())
+        return NULL;
+    CReserveKey reservekey(pwalletMain);
+    return CreateNewBlockWithKey(reservekey);
+#else
+    return CreateNewBlockWithKey();
+#endif
+}
+
+// Whether the cached template is stale: built on another tip, or built
+// BLOCK_TEMPLATE_REFRESH_INTERVAL seconds ago or more with the mempool
+// changed since. Requires cs_blocktemplate.
+bool IsCachedBlockTemplateStale(const CBlockIndex* pindexPrev, unsigned int nTxUpdated)
+{
+    AssertLockHeld(cs_blocktemplate);
+    return !pcachedtemplate || pindexCachedTemplate != pindexPrev ||
+           (nCachedTemplateTxUpdated != nTxUpdated && GetTime() - nCachedTemplateTime >= BLOCK_TEMPLATE_REFRESH_INTERVAL);
+}
+
+// Replace the cached template if it is stale. Requires cs_main.
+void RefreshCachedBlockTemplate()
+{
+    AssertLockHeld(cs_main);
+    const CBlockIndex* pindexPrev = chainActive.Tip();
+    unsigned int nTxUpdated = mempool.GetTransactionsUpdated();
+    {
+        LOCK(cs_blocktemplate);
+        if (!IsCachedBlockTemplateStale(pindexPrev, nTxUpdated))
+            return;
+    }
+
+    int64_t nStart = GetTime();
+    std::unique_ptr<CBlockTemplate> pblocktemplate(CreateBlockTemplateForCache());
+    if (!pblocktemplate)
+        return;
+
+    LOCK(cs_blocktemplate);
+    pcachedtemplate = std::move(pblocktemplate);
+    pindexCachedTemplate = pindexPrev;
+    nCachedTemplateTxUpdated = nTxUpdated;
+    nCachedTemplateTime = nStart;
+}
+
+void ThreadBlockTemplateBuilder()
+{
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutexTemplateWake);
+            while (!fTemplateWake)
+                cvTemplateWake.wait(lock);
+            fTemplateWake = false;
+        }
+        boost::this_thread::interruption_point();
+
+        try {
+            LOCK(cs_main);
+            RefreshCachedBlockTemplate();
+        } catch (const std::runtime_error& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+    }
+}
+
+} // anonymous namespace
+
+bool GetCachedBlockTemplate(CBlockTemplate& blocktemplate, const CBlockIndex*& pindexPrev, unsigned int& nTransactionsUpdated)
+{
+    AssertLockHeld(cs_main);
+    nLastTemplateRequest = GetTime();
+    for (int i = 0; i < 2; i++) {
+        {
+            LOCK(cs_blocktemplate);
+            if (pcachedtemplate && pindexCachedTemplate == chainActive.Tip()) {
+                // Only the mempool can have changed; the template stays valid
+                // while the builder catches up.
+                if (IsCachedBlockTemplateStale(chainActive.Tip(), mempool.GetTransactionsUpdated()))
+                    WakeBlockTemplateBuilder();
+                blocktemplate = *pcachedtemplate;
+                pindexPrev = pindexCachedTemplate;
+                nTransactionsUpdated = nCachedTemplateTxUpdated;
+                return true;
+            }
+        }
+        // The builder has not caught up with the tip yet
+        if (i == 0)
+            RefreshCachedBlockTemplate();
+    }
+    return false;
+}
+
+void StartBlockTemplateBuilder()
+{
+    LOCK(cs_blocktemplate);
+    if (pthreadTemplateBuilder)
+        return;
+    pblocktemplatenotifier = new CBlockTemplateNotifier();
+    RegisterValidationInterface(pblocktemplatenotifier);
+    pthreadTemplateBuilder = new boost::thread(boost::bind(&TraceThread<void (*)()>, "blocktemplate", &ThreadBlockTemplateBuilder));
+}
+
+void StopBlockTemplateBuilder()
+{
+    boost::thread* pthread;
+    {
+        LOCK(cs_blocktemplate);
+        pthread = pthreadTemplateBuilder;
+        pthreadTemplateBuilder = NULL;
+    }
+    if (!pthread)
+        return;
+
+    pthread->interrupt();
+    pthread->join();
+    delete pthread;
+    UnregisterValidationInterface(pblocktemplatenotifier);
+    delete pblocktemplatenotifier;
+    pblocktemplatenotifier = NULL;
+
+    LOCK(cs_blocktemplate);
+    pcachedtemplate.reset();
+    pindexCachedTemplate = NULL;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Internal miner
@@ -449,8 +912,9 @@ CBlockTemplate* CreateNewBlockWithKey()
 
 #ifdef ENABLE_MINING
 
-void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
+void IncrementExtraNonce(CBlockTemplate* pblocktemplate, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
+    CBlock* pblock = &pblocktemplate->block;
     // Update nExtraNonce
     static uint256 hashPrevBlock;
     if (hashPrevBlock != pblock->hashPrevBlock)
@@ -460,12 +924,14 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     }
     ++nExtraNonce;
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    CMutableTransaction txCoinbase(pblock->vtx[0]);
+    CMutableTransaction txCoinbase(*pblock->vtx[0]);
     txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(txCoinbase.vin[0].scriptSig.size() <= 100);
 
-    pblock->vtx[0] = txCoinbase;
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    pblock->vtx[0] = MakeTransactionRef(std::move(txCoinbase));
+    pblock->hashMerkleRoot = CBlock::CheckMerkleBranch(pblock->vtx[0]->GetHash(), pblocktemplate->vCoinbaseMerkleBranch, 0);
+    // The cached tree still holds the old coinbase hash
+    pblock->vMerkleTree.clear();
 }
 
 #ifdef ENABLE_WALLET
@@ -475,7 +941,7 @@ static bool ProcessBlockFound(CBlock* pblock)
 #endif // ENABLE_WALLET
 {
     LogPrintf("%s\n", pblock->ToString());
-    LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0].vout[0].nValue));
+    LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0]->vout[0].nValue));
 
     // Found a solution
     {
@@ -530,9 +996,21 @@ void static BitcoinMiner()
     unsigned int k = chainparams.EquihashK();
 
     std::string solver = GetArg("-equihashsolver", "default");
-    assert(solver == "tromp" || solver == "default");
+    assert(solver == "tromp" || solver == "default" || solver == "bucket");
+    if (solver == "bucket" && !EhBucketSolverSupported(n, k)) {
+        LogPrintf("Bucket solver does not support n = %u, k = %u, using the default solver\n", n, k);
+        solver = "default";
+    }
     LogPrint("pow", "Using Equihash solver \"%s\" with n = %u, k = %u\n", solver, n, k);
 
+    // The bucket solver's memory is allocated once and reused for every nonce
+    std::unique_ptr<EquihashBucketSolver<192,7>> bucketSolver;
+    if (solver == "bucket") {
+        bucketSolver.reset(new EquihashBucketSolver<192,7>(std::max(GetArg("-equihashsolverthreads", 1), (int64_t)1)));
+        LogPrint("pow", "Bucket solver uses %u threads and %u MiB\n",
+                 bucketSolver->Threads(), bucketSolver->MemoryUsage() >> 20);
+    }
+
     std::mutex m_cs;
     bool cancelSolver = false;
     boost::signals2::connection c = uiInterface.NotifyBlockTip.connect(
@@ -584,7 +1062,7 @@ void static BitcoinMiner()
                 return;
             }
             CBlock *pblock = &pblocktemplate->block;
-            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+            IncrementExtraNonce(pblocktemplate.get(), pindexPrev, nExtraNonce);
 
             LogPrintf("Running ZeroClassicMiner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
                 ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
@@ -701,7 +1179,9 @@ void static BitcoinMiner()
                 } else {
                     try {
                         // If we find a valid block, we rebuild
-                        bool found = EhOptimisedSolve(n, k, curr_state, validBlock, cancelled);
+                        bool found = bucketSolver ?
+                            bucketSolver->Solve(curr_state, validBlock, cancelled) :
+                            EhOptimisedSolve(n, k, curr_state, validBlock, cancelled);
                         ehSolverRuns.increment();
                         if (found) {
                             break;
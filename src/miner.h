@@ -24,6 +24,8 @@ struct CBlockTemplate
     CBlock block;
     std::vector<CAmount> vTxFees;
     std::vector<int64_t> vTxSigOps;
+    //! Hashes that combine with the coinbase hash into the merkle root
+    std::vector<uint256> vCoinbaseMerkleBranch;
 };
 
 /** Generate a new block, without valid proof-of-work */
@@ -37,8 +39,8 @@ CBlockTemplate* CreateNewBlockWithKey();
 #endif
 
 #ifdef ENABLE_MINING
-/** Modify the extranonce in a block */
-void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
+/** Modify the extranonce in a block, updating its merkle root from the coinbase branch */
+void IncrementExtraNonce(CBlockTemplate* pblocktemplate, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 /** Run the miner threads */
  #ifdef ENABLE_WALLET
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads);
@@ -47,6 +49,22 @@ void GenerateBitcoins(bool fGenerate, int nThreads);
  #endif
 #endif
 
+/** Seconds a cached block template is kept while only the mempool changes */
+static const int64_t BLOCK_TEMPLATE_REFRESH_INTERVAL = 5;
+/** Seconds after the last getblocktemplate call that templates are still built ahead */
+static const int64_t BLOCK_TEMPLATE_IDLE_TIMEOUT = 60;
+
+/**
+ * Copy the cached block template for getblocktemplate. It is only built here
+ * if the builder has no template on the current tip yet; a template that is
+ * only behind the mempool is returned while the builder replaces it. Returns
+ * false if none can be built. Requires cs_main.
+ */
+bool GetCachedBlockTemplate(CBlockTemplate& blocktemplate, const CBlockIndex*& pindexPrev, unsigned int& nTransactionsUpdated);
+/** Keep the cached block template up to date in the background */
+void StartBlockTemplateBuilder();
+void StopBlockTemplateBuilder();
+
 void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
 
 #endif // BITCOIN_MINER_H
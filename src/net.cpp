@@ -1523,6 +1523,11 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
+void WakeMessageHandler()
+{
+    messageHandlerCondition.notify_one();
+}
+
 void ThreadMessageHandler()
 {
     boost::mutex condition_mutex;
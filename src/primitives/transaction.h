@@ -15,6 +15,7 @@
 #include "consensus/consensus.h"
 
 #include <array>
+#include <memory>
 
 #include <boost/variant.hpp>
 
@@ -780,4 +781,13 @@ struct CMutableTransaction
     uint256 GetHash() const;
 };
 
+/**
+ * A transaction shared between the blocks, the memory pool and the wallet
+ * that hold it. Transactions are immutable, so sharing them is safe and
+ * spares copying their proofs and shielded descriptions.
+ */
+typedef std::shared_ptr<const CTransaction> CTransactionRef;
+static inline CTransactionRef MakeTransactionRef() { return std::make_shared<const CTransaction>(); }
+template <typename Tx> static inline CTransactionRef MakeTransactionRef(Tx&& txIn) { return std::make_shared<const CTransaction>(std::forward<Tx>(txIn)); }
+
 #endif // BITCOIN_PRIMITIVES_TRANSACTION_H
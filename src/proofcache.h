@@ -0,0 +1,33 @@
+// Copyright (c) 2018 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ZCASH_PROOFCACHE_H
+#define ZCASH_PROOFCACHE_H
+
+#include "uint256.h"
+
+#include <stdint.h>
+
+// DoS prevention: limit cache size to less than 8MB (over 100000
+// entries on 64-bit systems).
+static const unsigned int DEFAULT_MAX_PROOF_CACHE_SIZE = 8;
+
+/** The verifying key(s) a cached proof validity result was obtained with */
+enum ProofCacheKind {
+    PROOF_CACHE_SPROUT,
+    PROOF_CACHE_SAPLING,
+};
+
+/**
+ * Valid proof cache, to avoid verifying the zk-SNARKs of a transaction twice
+ * (once when accepted into memory pool, and again when accepted into the
+ * block chain). Entries are keyed on the txid, which commits to the proofs
+ * and signatures, and on the consensus branch the transaction was checked
+ * against. JoinSplit proofs do not depend on the consensus branch, so Sprout
+ * entries are recorded with a branch id of 0.
+ */
+bool ProofCacheContains(const uint256& txid, uint32_t consensusBranchId, ProofCacheKind kind);
+void ProofCacheInsert(const uint256& txid, uint32_t consensusBranchId, ProofCacheKind kind);
+
+#endif // ZCASH_PROOFCACHE_H
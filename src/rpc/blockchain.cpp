@@ -13,12 +13,15 @@
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "util.h"
 
 #include <stdint.h>
 
 #include <univalue.h>
 
+#include <boost/filesystem.hpp>
+
 #include <regex>
 
 using namespace std;
@@ -112,7 +115,7 @@ UniValue blockheaderToJSON(const CBlockIndex* blockindex)
     result.push_back(Pair("finalsaplingroot", blockindex->hashFinalSaplingRoot.GetHex()));
     result.push_back(Pair("time", (int64_t)blockindex->nTime));
     result.push_back(Pair("nonce", blockindex->nNonce.GetHex()));
-    result.push_back(Pair("solution", HexStr(blockindex->nSolution)));
+    result.push_back(Pair("solution", HexStr(blockindex->GetSolution())));
     result.push_back(Pair("bits", strprintf("%08x", blockindex->nBits)));
     result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
     result.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
@@ -140,8 +143,9 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
     result.push_back(Pair("finalsaplingroot", block.hashFinalSaplingRoot.GetHex()));
     UniValue txs(UniValue::VARR);
-    BOOST_FOREACH(const CTransaction&tx, block.vtx)
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx)
     {
+        const CTransaction& tx = *ptx;
         if(txDetails)
         {
             UniValue objTx(UniValue::VOBJ);
@@ -240,6 +244,12 @@ UniValue mempoolToJSON(bool fVerbose = false)
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
             info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
+            info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
+            info.push_back(Pair("descendantfees", e.GetModFeesWithDescendants()));
+            info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
+            info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
+            info.push_back(Pair("ancestorfees", e.GetModFeesWithAncestors()));
             const CTransaction& tx = e.GetTx();
             set<string> setDepends;
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
@@ -294,6 +304,12 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
             "    \"height\" : n,           (numeric) block height when transaction entered pool\n"
             "    \"startingpriority\" : n, (numeric) priority when transaction entered pool\n"
             "    \"currentpriority\" : n,  (numeric) transaction priority now\n"
+            "    \"descendantcount\" : n, (numeric) number of in-mempool descendant transactions (including this one)\n"
+            "    \"descendantsize\" : n,  (numeric) size of in-mempool descendants (including this one)\n"
+            "    \"descendantfees\" : n,  (numeric) fees in zatoshis, with prioritisetransaction deltas, of in-mempool descendants (including this one)\n"
+            "    \"ancestorcount\" : n,   (numeric) number of in-mempool ancestor transactions (including this one)\n"
+            "    \"ancestorsize\" : n,    (numeric) size of in-mempool ancestors (including this one)\n"
+            "    \"ancestorfees\" : n,    (numeric) fees in zatoshis, with prioritisetransaction deltas, of in-mempool ancestors (including this one)\n"
             "    \"depends\" : [           (array) unconfirmed transactions used as inputs for this transaction\n"
             "        \"transactionid\",    (string) parent transaction id\n"
             "       ... ]\n"
@@ -487,50 +503,83 @@ UniValue getblock(const UniValue& params, bool fHelp)
     if (mapBlockIndex.count(hash) == 0)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
     if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
 
-    if(!ReadBlockFromDisk(block, pblockindex))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
-
     if (verbosity == 0)
     {
-        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-        ssBlock << block;
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
+        std::shared_ptr<const std::vector<unsigned char> > data = ReadRawBlockFromDiskCached(pblockindex);
+        if (!data)
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+        return HexStr(*data);
     }
 
-    return blockToJSON(block, pblockindex, verbosity >= 2);
+    std::shared_ptr<const CBlock> pblock = ReadBlockFromDiskCached(pblockindex);
+    if (!pblock)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+
+    return blockToJSON(*pblock, pblockindex, verbosity >= 2);
 }
 
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( \"hash_type\" )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "With the default hash type the statistics are kept up to date as blocks are connected,\n"
+            "and returned at once. \"hash_serialized\" walks over all unspent outputs, which may take some time.\n"
+            "\nArguments:\n"
+            "1. \"hash_type\"         (string, optional, default=\"muhash\") Which UTXO set hash to compute, \"muhash\" or \"hash_serialized\"\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
-            "  \"transactions\": n,      (numeric) The number of transactions\n"
+            "  \"transactions\": n,      (numeric) The number of transactions (hash_serialized only)\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash (hash_serialized only)\n"
+            "  \"muhash\": \"hash\",    (string) The rolling hash of the unspent outputs, independent of their order\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "\"hash_serialized\"")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
+    std::string strHashType = "muhash";
+    if (params.size() > 0)
+        strHashType = params[0].get_str();
+
     UniValue ret(UniValue::VOBJ);
 
+    if (strHashType == "muhash") {
+        CCoinsSetStats stats;
+        uint256 hashBlock;
+        int nHeight;
+        {
+            LOCK(cs_main);
+            if (!pcoinsTip->GetRunningStats(stats))
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "UTXO set statistics are not available");
+            hashBlock = pcoinsTip->GetBestBlock();
+            nHeight = chainActive.Height();
+        }
+        uint256 hashMuHash;
+        stats.muhash.Finalize(hashMuHash.begin());
+        ret.push_back(Pair("height", (int64_t)nHeight));
+        ret.push_back(Pair("bestblock", hashBlock.GetHex()));
+        ret.push_back(Pair("txouts", stats.nTransactionOutputs));
+        ret.push_back(Pair("bytes_serialized", stats.nSerializedSize));
+        ret.push_back(Pair("muhash", hashMuHash.GetHex()));
+        ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+        return ret;
+    }
+    if (strHashType != "hash_serialized")
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown hash type: " + strHashType);
+
     CCoinsStats stats;
     FlushStateToDisk();
     if (pcoinsTip->GetStats(stats)) {
@@ -540,6 +589,7 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
         ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
         ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
         ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        ret.push_back(Pair("muhash", stats.hashMuHash.GetHex()));
         ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     }
     return ret;
@@ -570,7 +620,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,              (numeric) The version\n"
             "  \"coinbase\" : true|false     (boolean) Coinbase or not\n"
             "}\n"
 
@@ -594,37 +643,130 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    COutPoint out(hash, n);
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out)) // TODO: filtering spent coins should be done by the CCoinsViewMemPool
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin))
             return NullUniValue;
     }
-    if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", (int64_t)(pindex->nHeight - coin.nHeight + 1)));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
+    ret.push_back(Pair("coinbase", (bool)coin.fCoinBase));
 
     return ret;
 }
 
+static UniValue ChainStateSnapshotToJSON(const CChainStateSnapshot& snapshot)
+{
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("height", snapshot.nHeight));
+    ret.push_back(Pair("bestblock", snapshot.hashBlock.GetHex()));
+    ret.push_back(Pair("coins", (int64_t)snapshot.nCoins));
+    ret.push_back(Pair("anchors", (int64_t)snapshot.nAnchors));
+    ret.push_back(Pair("nullifiers", (int64_t)snapshot.nNullifiers));
+    ret.push_back(Pair("hash", snapshot.hashContents.GetHex()));
+    return ret;
+}
+
+UniValue dumpchainstate(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumpchainstate \"filename\"\n"
+            "\nWrites the unspent outputs, note commitment tree anchors and nullifiers as of the best block\n"
+            "to a snapshot file, which loadchainstate can bootstrap another node from.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"filename\"    (string, required) The file to write, relative to the data directory if not absolute\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\": n,          (numeric) The height of the block the snapshot was taken at\n"
+            "  \"bestblock\": \"hex\",   (string) The hash of that block\n"
+            "  \"coins\": n,           (numeric) The number of unspent outputs\n"
+            "  \"anchors\": n,         (numeric) The number of Sprout and Sapling anchors\n"
+            "  \"nullifiers\": n,      (numeric) The number of Sprout and Sapling nullifiers\n"
+            "  \"hash\": \"hex\",        (string) The hash committing to the snapshot contents\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumpchainstate", "\"chainstate.snapshot\"")
+            + HelpExampleRpc("dumpchainstate", "\"chainstate.snapshot\"")
+        );
+
+    boost::filesystem::path path = boost::filesystem::absolute(params[0].get_str(), GetDataDir());
+    boost::filesystem::path pathTemp = path.string() + ".incomplete";
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+
+    FlushStateToDisk();
+    CChainStateSnapshot snapshot;
+    {
+        CAutoFile file(fopen(pathTemp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open " + pathTemp.string() + " for writing");
+        if (!pcoinsdbview->WriteSnapshot(file, snapshot))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to write the chain state snapshot");
+        FileCommit(file.Get());
+    }
+    RenameOver(pathTemp, path);
+    return ChainStateSnapshotToJSON(snapshot);
+}
+
+UniValue loadchainstate(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "loadchainstate \"filename\" ( \"hash\" )\n"
+            "\nReplaces the chain state of a node that is still at the genesis block by a snapshot written by\n"
+            "dumpchainstate, and continues syncing from the block the snapshot was taken at. The header of\n"
+            "that block must have been received already. Blocks up to it are not downloaded or validated,\n"
+            "so only load snapshots from a trusted source, and check their hash.\n"
+            "\nArguments:\n"
+            "1. \"filename\"    (string, required) The snapshot file, relative to the data directory if not absolute\n"
+            "2. \"hash\"        (string, optional) The hash the snapshot must commit to\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\": n,          (numeric) The height of the block the snapshot was taken at\n"
+            "  \"bestblock\": \"hex\",   (string) The hash of that block\n"
+            "  \"coins\": n,           (numeric) The number of unspent outputs\n"
+            "  \"anchors\": n,         (numeric) The number of Sprout and Sapling anchors\n"
+            "  \"nullifiers\": n,      (numeric) The number of Sprout and Sapling nullifiers\n"
+            "  \"hash\": \"hex\",        (string) The hash committing to the snapshot contents\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("loadchainstate", "\"chainstate.snapshot\"")
+            + HelpExampleRpc("loadchainstate", "\"chainstate.snapshot\"")
+        );
+
+    boost::filesystem::path path = boost::filesystem::absolute(params[0].get_str(), GetDataDir());
+    uint256 hashExpected;
+    if (params.size() > 1)
+        hashExpected = ParseHashV(params[1], "hash");
+
+    CChainStateSnapshot snapshot;
+    CValidationState state;
+    if (!LoadChainStateSnapshot(path, hashExpected, snapshot, state))
+        throw JSONRPCError(RPC_MISC_ERROR, state.GetRejectReason());
+    // Connect the blocks after the snapshot block that were received already.
+    if (!ActivateBestChain(state))
+        throw JSONRPCError(RPC_DATABASE_ERROR, state.GetRejectReason());
+    return ChainStateSnapshotToJSON(snapshot);
+}
+
 UniValue verifychain(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
@@ -925,6 +1067,9 @@ UniValue mempoolInfoToJSON()
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
     ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
 
     return ret;
 }
@@ -940,6 +1085,8 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
             "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool (see -maxmempool)\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee per kB for a transaction to be accepted\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -949,6 +1096,35 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue getblockcacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockcacheinfo\n"
+            "\nReturns details on the cache of recently read blocks.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"blocks\": xxxxx              (numeric) Number of blocks in the cache\n"
+            "  \"usage\": xxxxx               (numeric) Memory used by the cache\n"
+            "  \"maxusage\": xxxxx            (numeric) Maximum memory for the cache (see -blockcachesize)\n"
+            "  \"hits\": xxxxx                (numeric) Reads answered from the cache since startup\n"
+            "  \"misses\": xxxxx              (numeric) Reads that went to disk since startup\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockcacheinfo", "")
+            + HelpExampleRpc("getblockcacheinfo", "")
+        );
+
+    CBlockCache::Stats stats = blockcache.GetStats();
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("blocks", (int64_t)stats.nBlocks));
+    ret.push_back(Pair("usage", (int64_t)stats.nUsage));
+    ret.push_back(Pair("maxusage", (int64_t)stats.nMaxUsage));
+    ret.push_back(Pair("hits", (int64_t)stats.nHits));
+    ret.push_back(Pair("misses", (int64_t)stats.nMisses));
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -1033,6 +1209,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getbestblockhash",       &getbestblockhash,       true  },
     { "blockchain",         "getblockcount",          &getblockcount,          true  },
     { "blockchain",         "getblock",               &getblock,               true  },
+    { "blockchain",         "getblockcacheinfo",      &getblockcacheinfo,      true  },
     { "blockchain",         "getblockhash",           &getblockhash,           true  },
     { "blockchain",         "getblockheader",         &getblockheader,         true  },
     { "blockchain",         "getchaintips",           &getchaintips,           true  },
@@ -1042,6 +1219,8 @@ static const CRPCCommand commands[] =
     { "blockchain",         "gettxout",               &gettxout,               true  },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
     { "blockchain",         "verifychain",            &verifychain,            true  },
+    { "blockchain",         "dumpchainstate",         &dumpchainstate,         true  },
+    { "blockchain",         "loadchainstate",         &loadchainstate,         false },
 
     /* Not shown in help */
     { "hidden",             "invalidateblock",        &invalidateblock,        true  },
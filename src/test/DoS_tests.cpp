@@ -28,15 +28,17 @@
 #include <boost/test/data/test_case.hpp>
 
 // Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
+extern bool AddOrphanTx(const CTransactionRef& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
 extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
 extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern bool QueueTxProofCheck(CNode* pfrom, const CTransactionRef& ptx);
+extern void ProcessCheckedTransactions(CNode* pfrom);
 
 CService ip(uint32_t i)
 {
@@ -116,7 +118,7 @@ CTransaction RandomOrphan()
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    return *it->second.tx;
 }
 
 // Parameterized testing over consensus branch ids
@@ -141,7 +143,7 @@ BOOST_DATA_TEST_CASE(DoS_mapOrphans, boost::unit_test::data::xrange(static_cast<
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx, i);
+        AddOrphanTx(MakeTransactionRef(tx), i);
     }
 
     // ... and 50 that depend on other orphans:
@@ -158,7 +160,7 @@ BOOST_DATA_TEST_CASE(DoS_mapOrphans, boost::unit_test::data::xrange(static_cast<
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0, SIGHASH_ALL, consensusBranchId);
 
-        AddOrphanTx(tx, i);
+        AddOrphanTx(MakeTransactionRef(tx), i);
     }
 
     // This really-big orphan should be ignored:
@@ -182,7 +184,7 @@ BOOST_DATA_TEST_CASE(DoS_mapOrphans, boost::unit_test::data::xrange(static_cast<
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx, i));
+        BOOST_CHECK(!AddOrphanTx(MakeTransactionRef(tx), i));
     }
 
     // Test EraseOrphansFor:
@@ -203,4 +205,151 @@ BOOST_DATA_TEST_CASE(DoS_mapOrphans, boost::unit_test::data::xrange(static_cast<
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
 }
 
+// A shielded transaction that CheckTransaction rejects with a DoS score of 100
+CTransactionRef InvalidShieldedTx(uint32_t n)
+{
+    CMutableTransaction tx;
+    tx.nVersion = 1;
+    tx.vjoinsplit.resize(1);
+    tx.nLockTime = n;
+    return MakeTransactionRef(tx);
+}
+
+// Process the checked transactions of node until one of them is rejected
+bool ProcessCheckedUntilReject(CNode& node)
+{
+    size_t nSendSize = node.nSendSize;
+    for (int i = 0; i < 1000 && node.nSendSize == nSendSize; i++) {
+        MilliSleep(10);
+        ProcessCheckedTransactions(&node);
+    }
+    return node.nSendSize > nSendSize;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_txproofcheck)
+{
+    CNode::ClearBanned();
+    BOOST_REQUIRE(nScriptCheckThreads > 0);
+
+    CAddress addr1(ip(0xa0b0c001));
+    CNode dummyNode1(INVALID_SOCKET, addr1, "", true);
+    dummyNode1.nVersion = 1;
+
+    // Transparent transactions are processed right away
+    CMutableTransaction transparent;
+    transparent.vin.resize(1);
+    transparent.vout.resize(1);
+    BOOST_CHECK(!QueueTxProofCheck(&dummyNode1, MakeTransactionRef(transparent)));
+
+    // A shielded transaction is queued; once checked on the -par threads it
+    // is rejected and its peer punished, as on the message handler thread
+    BOOST_CHECK(QueueTxProofCheck(&dummyNode1, InvalidShieldedTx(1)));
+    BOOST_CHECK(ProcessCheckedUntilReject(dummyNode1));
+    SendMessages(&dummyNode1, false);
+    BOOST_CHECK(CNode::IsBanned(addr1));
+}
+
+BOOST_AUTO_TEST_CASE(DoS_txproofcheck_duplicates)
+{
+    CNode::ClearBanned();
+    CTransactionRef ptx = InvalidShieldedTx(2);
+
+    CAddress addr1(ip(0xa0b0c001));
+    CNode dummyNode1(INVALID_SOCKET, addr1, "", true);
+    dummyNode1.nVersion = 1;
+    CAddress addr2(ip(0xa0b0c002));
+    CNode dummyNode2(INVALID_SOCKET, addr2, "", true);
+    dummyNode2.nVersion = 1;
+
+    // The second copy is not checked again; the transaction is processed
+    // for the first peer only
+    BOOST_CHECK(QueueTxProofCheck(&dummyNode1, ptx));
+    BOOST_CHECK(QueueTxProofCheck(&dummyNode2, ptx));
+    BOOST_CHECK(ProcessCheckedUntilReject(dummyNode1));
+    ProcessCheckedTransactions(&dummyNode2);
+    SendMessages(&dummyNode1, false);
+    SendMessages(&dummyNode2, false);
+    BOOST_CHECK(CNode::IsBanned(addr1));
+    BOOST_CHECK(!CNode::IsBanned(addr2));
+}
+
+BOOST_AUTO_TEST_CASE(DoS_txproofcheck_disconnect)
+{
+    CNode::ClearBanned();
+    CAddress addr2(ip(0xa0b0c002));
+    CNode dummyNode2(INVALID_SOCKET, addr2, "", true);
+    dummyNode2.nVersion = 1;
+
+    // The second peer takes the transaction over when the first disconnects
+    CTransactionRef ptx = InvalidShieldedTx(3);
+    {
+        CNode dummyNode1(INVALID_SOCKET, CAddress(ip(0xa0b0c001)), "", true);
+        dummyNode1.nVersion = 1;
+        BOOST_CHECK(QueueTxProofCheck(&dummyNode1, ptx));
+        BOOST_CHECK(QueueTxProofCheck(&dummyNode2, ptx));
+    }
+    BOOST_CHECK(ProcessCheckedUntilReject(dummyNode2));
+    SendMessages(&dummyNode2, false);
+    BOOST_CHECK(CNode::IsBanned(addr2));
+
+    // With no other peer, the transaction is forgotten, and can be asked
+    // for and checked again
+    CNode::ClearBanned();
+    ptx = InvalidShieldedTx(4);
+    CInv inv(MSG_TX, ptx->GetHash());
+    mapAlreadyAskedFor.insert(std::make_pair(inv, GetTimeMicros()));
+    {
+        CNode dummyNode1(INVALID_SOCKET, CAddress(ip(0xa0b0c001)), "", true);
+        dummyNode1.nVersion = 1;
+        BOOST_CHECK(QueueTxProofCheck(&dummyNode1, ptx));
+    }
+    BOOST_CHECK(!mapAlreadyAskedFor.count(inv));
+    CAddress addr3(ip(0xa0b0c003));
+    CNode dummyNode3(INVALID_SOCKET, addr3, "", true);
+    dummyNode3.nVersion = 1;
+    BOOST_CHECK(QueueTxProofCheck(&dummyNode3, ptx));
+    BOOST_CHECK(ProcessCheckedUntilReject(dummyNode3));
+    SendMessages(&dummyNode3, false);
+    BOOST_CHECK(CNode::IsBanned(addr3));
+}
+
+BOOST_AUTO_TEST_CASE(DoS_txproofcheck_limits)
+{
+    uint32_t n = 1000;
+    {
+        // A peer gets at most MAX_TX_PROOF_CHECK_PER_PEER transactions
+        // queued; the rest are processed right away, and other peers can
+        // still queue theirs
+        CNode dummyNode1(INVALID_SOCKET, CAddress(ip(0xa0b0c001)), "", true);
+        dummyNode1.nVersion = 1;
+        for (unsigned int i = 0; i < MAX_TX_PROOF_CHECK_PER_PEER; i++)
+            BOOST_CHECK(QueueTxProofCheck(&dummyNode1, InvalidShieldedTx(n++)));
+        BOOST_CHECK(!QueueTxProofCheck(&dummyNode1, InvalidShieldedTx(n++)));
+        CNode dummyNode2(INVALID_SOCKET, CAddress(ip(0xa0b0c002)), "", true);
+        dummyNode2.nVersion = 1;
+        BOOST_CHECK(QueueTxProofCheck(&dummyNode2, InvalidShieldedTx(n++)));
+    }
+
+    {
+        // Once MAX_TX_PROOF_CHECK_QUEUE transactions are queued, any more
+        // are processed right away
+        std::vector<std::shared_ptr<CNode> > vNodes;
+        unsigned int nQueued = 0;
+        while (nQueued < MAX_TX_PROOF_CHECK_QUEUE) {
+            vNodes.push_back(std::make_shared<CNode>(INVALID_SOCKET, CAddress(ip(0xa0b0c100 + vNodes.size())), "", true));
+            vNodes.back()->nVersion = 1;
+            for (unsigned int i = 0; i < MAX_TX_PROOF_CHECK_PER_PEER && nQueued < MAX_TX_PROOF_CHECK_QUEUE; i++, nQueued++)
+                BOOST_CHECK(QueueTxProofCheck(vNodes.back().get(), InvalidShieldedTx(n++)));
+        }
+        CNode dummyNode(INVALID_SOCKET, CAddress(ip(0xa0b0c0ff)), "", true);
+        dummyNode.nVersion = 1;
+        BOOST_CHECK(!QueueTxProofCheck(&dummyNode, InvalidShieldedTx(n++)));
+    }
+
+    // Disconnecting the peers frees their room in the queue
+    CNode dummyNode(INVALID_SOCKET, CAddress(ip(0xa0b0c0ff)), "", true);
+    dummyNode.nVersion = 1;
+    BOOST_CHECK(QueueTxProofCheck(&dummyNode, InvalidShieldedTx(n++)));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
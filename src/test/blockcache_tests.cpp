@@ -0,0 +1,99 @@
+// Copyright (c) 2018 The Zero developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+std::shared_ptr<const CBlock> MakeBlock(uint32_t nTime, size_t nOutputs)
+{
+    std::shared_ptr<CBlock> block = std::make_shared<CBlock>();
+    block->nTime = nTime;
+    CMutableTransaction tx;
+    tx.vout.resize(nOutputs);
+    for (size_t i = 0; i < nOutputs; i++)
+        tx.vout[i].scriptPubKey = CScript() << std::vector<unsigned char>(33, (unsigned char)i);
+    block->vtx.push_back(MakeTransactionRef(std::move(tx)));
+    block->hashMerkleRoot = block->BuildMerkleTree();
+    return block;
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(blockcache_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(blockcache_hits_and_misses)
+{
+    CBlockCache cache(1 << 20);
+    std::shared_ptr<const CBlock> block = MakeBlock(1, 10);
+    uint256 hash = block->GetHash();
+
+    BOOST_CHECK(!cache.GetBlock(hash));
+    cache.InsertBlock(hash, block);
+    BOOST_CHECK(cache.GetBlock(hash) == block);
+
+    // The two forms are cached apart.
+    BOOST_CHECK(!cache.GetRawBlock(hash));
+    std::shared_ptr<const std::vector<unsigned char> > raw = std::make_shared<const std::vector<unsigned char> >(100, 1);
+    cache.InsertRawBlock(hash, raw);
+    BOOST_CHECK(cache.GetRawBlock(hash) == raw);
+    BOOST_CHECK(cache.GetBlock(hash) == block);
+
+    CBlockCache::Stats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nBlocks, 1U);
+    BOOST_CHECK_EQUAL(stats.nHits, 3U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 2U);
+    BOOST_CHECK(stats.nUsage > 100);
+
+    cache.Clear();
+    BOOST_CHECK(!cache.GetBlock(hash));
+    BOOST_CHECK_EQUAL(cache.GetStats().nUsage, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_eviction)
+{
+    CBlockCache cache(1 << 20);
+    std::vector<std::shared_ptr<const CBlock> > blocks;
+    for (uint32_t i = 0; i < 3; i++) {
+        blocks.push_back(MakeBlock(i, 100));
+        cache.InsertBlock(blocks.back()->GetHash(), blocks.back());
+    }
+    size_t nBlockUsage = cache.GetStats().nUsage / 3;
+
+    // Use the oldest block, so that the second one is the least recently used.
+    BOOST_CHECK(cache.GetBlock(blocks[0]->GetHash()));
+    cache.SetMaxUsage(nBlockUsage * 2 + nBlockUsage / 2);
+    CBlockCache::Stats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nBlocks, 2U);
+    BOOST_CHECK(stats.nUsage <= stats.nMaxUsage);
+    BOOST_CHECK(cache.GetBlock(blocks[0]->GetHash()));
+    BOOST_CHECK(!cache.GetBlock(blocks[1]->GetHash()));
+    BOOST_CHECK(cache.GetBlock(blocks[2]->GetHash()));
+
+    // Blocks stay valid for their users once dropped.
+    std::shared_ptr<const CBlock> block = cache.GetBlock(blocks[2]->GetHash());
+    cache.SetMaxUsage(0);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 0U);
+    BOOST_CHECK_EQUAL(block->vtx[0]->vout.size(), 100U);
+
+    // A block larger than the whole cache is not kept.
+    cache.SetMaxUsage(nBlockUsage / 2);
+    cache.InsertBlock(blocks[0]->GetHash(), blocks[0]);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 0U);
+    BOOST_CHECK_EQUAL(cache.GetStats().nUsage, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_disabled)
+{
+    CBlockCache cache(0);
+    std::shared_ptr<const CBlock> block = MakeBlock(1, 1);
+    cache.InsertBlock(block->GetHash(), block);
+    BOOST_CHECK(!cache.GetBlock(block->GetHash()));
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
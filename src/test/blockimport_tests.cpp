@@ -0,0 +1,100 @@
+// Copyright (c) 2018 The Zero developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockimport.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+CBlock MakeBlock(uint32_t nTime)
+{
+    CBlock block;
+    block.nTime = nTime;
+    CMutableTransaction tx;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nTime;
+    block.vtx.push_back(MakeTransactionRef(std::move(tx)));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+void WriteFrame(CDataStream& ss, unsigned int nSize)
+{
+    ss << FLATDATA(Params().MessageStart()) << nSize;
+}
+
+void WriteBytes(CDataStream& ss, size_t nSize, unsigned char ch)
+{
+    std::vector<char> vch(nSize, ch);
+    ss.write(vch.data(), vch.size());
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(blockimport_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(blockimport_reads_blocks_in_order)
+{
+    std::vector<CBlock> blocks;
+    std::vector<uint64_t> vPos;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    // Bytes before the first block, including the first byte of the message start
+    ss << FLATDATA(Params().MessageStart()[0]) << (uint32_t)0x12345678;
+    for (uint32_t i = 0; i < 20; i++) {
+        blocks.push_back(MakeBlock(i));
+        WriteFrame(ss, ::GetSerializeSize(blocks.back(), SER_DISK, CLIENT_VERSION));
+        vPos.push_back(ss.size());
+        ss << blocks.back();
+        if (i == 5) {
+            // Something that looks like a block but does not deserialize
+            WriteFrame(ss, 100);
+            WriteBytes(ss, 100, 0xff);
+        }
+        if (i == 10) {
+            // A block shorter than its stated size, followed by another one
+            blocks.push_back(MakeBlock(100));
+            CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+            ssBlock << blocks.back();
+            WriteFrame(ss, ssBlock.size() + 90);
+            vPos.push_back(ss.size());
+            ss << blocks.back();
+            WriteFrame(ss, 80);
+            WriteBytes(ss, 80, 0);
+        }
+    }
+    // A block cut short by the end of the file
+    WriteFrame(ss, 1000);
+    ss << (uint32_t)1;
+
+    // Decoded on the reader thread, then on the -par threads of TestingSetup
+    for (int i = 0; i < 2; i++) {
+        bool fParallel = i == 1;
+        FILE* file = tmpfile();
+        BOOST_REQUIRE(file != NULL);
+        BOOST_REQUIRE_EQUAL(fwrite(&ss[0], 1, ss.size(), file), ss.size());
+        rewind(file);
+
+        CBlockFileReader reader(file, Params().MessageStart(), fParallel);
+        CImportedBlock imported;
+        size_t n = 0;
+        while (reader.Next(imported)) {
+            BOOST_REQUIRE(n < blocks.size());
+            BOOST_CHECK(imported.block);
+            BOOST_CHECK(imported.hash == blocks[n].GetHash());
+            BOOST_CHECK(imported.block->GetHash() == blocks[n].GetHash());
+            BOOST_CHECK_EQUAL(imported.nPos, vPos[n]);
+            // These blocks do not carry a valid Equihash solution.
+            BOOST_CHECK(!imported.fPOWValid);
+            n++;
+        }
+        BOOST_CHECK_EQUAL(n, blocks.size());
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,8 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "arith_uint256.h"
+#include "checkqueue.h"
 #include "clientversion.h"
 #include "consensus/validation.h"
 #include "main.h"
@@ -14,6 +16,7 @@
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 
 BOOST_FIXTURE_TEST_SUITE(CheckBlock_tests, BasicTestingSetup)
@@ -64,4 +67,58 @@ BOOST_AUTO_TEST_CASE(May15)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(HeaderCheckQueue)
+{
+    // A batch of headers checked on the header check queue must flag the
+    // same headers as invalid as the serial CheckBlockHeader does, so that
+    // they are rejected for the same reason when they are connected.
+    const CBlockHeader genesis = Params().GenesisBlock().GetBlockHeader();
+    std::vector<CBlockHeader> headers(16, genesis);
+    std::vector<std::string> reasons(headers.size());
+    // Invalid Equihash solution
+    headers[3].nSolution[0] ^= 1;
+    reasons[3] = "invalid-solution";
+    headers[9].nSolution.resize(headers[9].nSolution.size() - 1);
+    reasons[9] = "invalid-solution";
+    // Proof of work claimed for a different target or nonce than the
+    // solution was found for
+    headers[12].nBits = genesis.nBits - 1;
+    reasons[12] = "invalid-solution";
+    headers[15].nNonce = ArithToUint256(UintToArith256(headers[15].nNonce) + 1);
+    reasons[15] = "invalid-solution";
+
+    boost::thread_group threadGroup;
+    CCheckQueue<CHeaderCheck> headercheckqueue(4);
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CHeaderCheck>::Thread, boost::ref(headercheckqueue)));
+
+    std::unique_ptr<bool[]> vfPOWValid(new bool[headers.size()]());
+    {
+        std::vector<CHeaderCheck> vChecks;
+        for (unsigned int n = 0; n < headers.size(); n++)
+            vChecks.push_back(CHeaderCheck(headers[n], &vfPOWValid[n]));
+        CCheckQueueControl<CHeaderCheck> control(&headercheckqueue);
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+
+    for (unsigned int n = 0; n < headers.size(); n++) {
+        CValidationState serialState;
+        bool fSerial = CheckBlockHeader(headers[n], serialState);
+        BOOST_CHECK_EQUAL(vfPOWValid[n], fSerial);
+        BOOST_CHECK_EQUAL(serialState.GetRejectReason(), reasons[n]);
+
+        // What the headers handler does with the result of the batch
+        CValidationState batchState;
+        BOOST_CHECK_EQUAL(CheckBlockHeader(headers[n], batchState, !vfPOWValid[n]), fSerial);
+        BOOST_CHECK_EQUAL(batchState.GetRejectReason(), serialState.GetRejectReason());
+        int nSerialDoS = 0, nBatchDoS = 0;
+        BOOST_CHECK_EQUAL(batchState.IsInvalid(nBatchDoS), serialState.IsInvalid(nSerialDoS));
+        BOOST_CHECK_EQUAL(nBatchDoS, nSerialDoS);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
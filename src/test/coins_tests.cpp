@@ -10,6 +10,8 @@
 #include "test/test_bitcoin.h"
 #include "consensus/validation.h"
 #include "main.h"
+#include "streams.h"
+#include "txdb.h"
 #include "undo.h"
 #include "primitives/transaction.h"
 #include "pubkey.h"
@@ -22,16 +24,43 @@
 
 namespace
 {
+//! equality test
+bool operator==(const Coin &a, const Coin &b) {
+    // Empty Coin objects are always equal.
+    if (a.IsSpent() && b.IsSpent()) return true;
+    return a.fCoinBase == b.fCoinBase &&
+           a.nHeight == b.nHeight &&
+           a.out == b.out;
+}
+
+//! check running totals against totals computed from scratch
+void CheckRunningStats(CCoinsSetStats running, const std::map<COutPoint, Coin>& coins)
+{
+    CCoinsSetStats expected;
+    for (std::map<COutPoint, Coin>::const_iterator it = coins.begin(); it != coins.end(); it++) {
+        if (!it->second.IsSpent())
+            expected.AddCoin(it->first, it->second);
+    }
+    BOOST_CHECK_EQUAL(running.nTransactionOutputs, expected.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(running.nSerializedSize, expected.nSerializedSize);
+    BOOST_CHECK_EQUAL(running.nTotalAmount, expected.nTotalAmount);
+    uint256 hashRunning, hashExpected;
+    running.muhash.Finalize(hashRunning.begin());
+    expected.muhash.Finalize(hashExpected.begin());
+    BOOST_CHECK(hashRunning == hashExpected);
+}
+
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
     uint256 hashBestSproutAnchor_;
     uint256 hashBestSaplingAnchor_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
     std::map<uint256, SproutMerkleTree> mapSproutAnchors_;
     std::map<uint256, SaplingMerkleTree> mapSaplingAnchors_;
     std::map<uint256, bool> mapSproutNullifiers_;
     std::map<uint256, bool> mapSaplingNullifiers_;
+    CCoinsSetStats stats_;
 
 public:
     CCoinsViewTest() {
@@ -107,24 +136,24 @@ public:
         }
     }
 
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
+    bool HaveCoin(const COutPoint& outpoint) const
     {
-        CCoins coins;
-        return GetCoins(txid, coins);
+        Coin coin;
+        return GetCoin(outpoint, coin);
     }
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
@@ -170,13 +199,14 @@ public:
                     CAnchorsSproutMap& mapSproutAnchors,
                     CAnchorsSaplingMap& mapSaplingAnchors,
                     CNullifiersMap& mapSproutNullifiers,
-                    CNullifiersMap& mapSaplingNullifiers)
+                    CNullifiersMap& mapSaplingNullifiers,
+                    const CCoinsSetStats& statsDelta)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             if (it->second.flags & CCoinsCacheEntry::DIRTY) {
                 // Same optimization used in CCoinsViewDB is to only write dirty entries.
-                map_[it->first] = it->second.coins;
-                if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
+                map_[it->first] = it->second.coin;
+                if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
                     // Randomly delete empty entries on write.
                     map_.erase(it->first);
                 }
@@ -196,10 +226,17 @@ public:
             hashBestSproutAnchor_ = hashSproutAnchor;
         if (!hashSaplingAnchor.IsNull())
             hashBestSaplingAnchor_ = hashSaplingAnchor;
+        stats_ += statsDelta;
         return true;
     }
 
     bool GetStats(CCoinsStats& stats) const { return false; }
+
+    bool GetRunningStats(CCoinsSetStats& stats) const
+    {
+        stats = stats_;
+        return true;
+    }
 };
 
 class CCoinsViewCacheTest : public CCoinsViewCache
@@ -216,7 +253,7 @@ public:
                      memusage::DynamicUsage(cacheSproutNullifiers) +
                      memusage::DynamicUsage(cacheSaplingNullifiers);
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
-            ret += it->second.coins.DynamicMemoryUsage();
+            ret += it->second.coin.DynamicMemoryUsage();
         }
         BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
     }
@@ -768,7 +805,7 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
+// It will randomly create/update/delete Coin entries to a tip of caches, with
 // txids picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
@@ -780,13 +817,14 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool removed_all_caches = false;
     bool reached_4_caches = false;
     bool added_an_entry = false;
+    bool added_an_unspendable_entry = false;
     bool removed_an_entry = false;
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -804,36 +842,48 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
         // Do a random modification.
         {
             uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
-                    added_an_entry = true;
+            Coin& coin = result[COutPoint(txid, 0)];
+            const Coin& entry = (insecure_rand() % 500 == 0) ? AccessByTxid(*stack.back(), txid) : stack.back()->AccessCoin(COutPoint(txid, 0));
+            BOOST_CHECK(coin == entry);
+
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.nHeight = 1;
+                bool possible_overwrite = !coin.IsSpent() || insecure_rand() & 1;
+                if (insecure_rand() % 16 == 0 && coin.IsSpent()) {
+                    newcoin.out.scriptPubKey.assign(1 + (insecure_rand() & 0x3F), OP_RETURN);
+                    BOOST_CHECK(newcoin.out.scriptPubKey.IsUnspendable());
+                    added_an_unspendable_entry = true;
                 } else {
-                    updated_an_entry = true;
+                    newcoin.out.scriptPubKey.assign(insecure_rand() & 0x3F, 0); // Random sizes so we can test memory usage accounting
+                    if (coin.IsSpent()) {
+                        added_an_entry = true;
+                    } else {
+                        updated_an_entry = true;
+                    }
+                    coin = newcoin;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                stack.back()->AddCoin(COutPoint(txid, 0), std::move(newcoin), possible_overwrite);
             } else {
-                coins.Clear();
-                entry->Clear();
                 removed_an_entry = true;
+                coin.Clear();
+                stack.back()->SpendCoin(COutPoint(txid, 0));
             }
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoinInCache(it->first));
+                    found_an_entry = true;
                 }
             }
             BOOST_FOREACH(const CCoinsViewCacheTest *test, stack) {
@@ -873,6 +923,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(removed_all_caches);
     BOOST_CHECK(reached_4_caches);
     BOOST_CHECK(added_an_entry);
+    BOOST_CHECK(added_an_unspendable_entry);
     BOOST_CHECK(removed_an_entry);
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
@@ -929,7 +980,7 @@ BOOST_AUTO_TEST_CASE(coins_coinbase_spends)
 BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
 {
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -946,7 +997,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
             tx.vin.resize(1);
             tx.vout.resize(1);
             tx.vout[0].nValue = i; //Keep txs unique
-            unsigned int height = insecure_rand();
+            int height = insecure_rand() & 0x7FFFFFFF;
 
             // 1/10 times create a coinbase
             if (insecure_rand() % 10 == 0 || coinbaseids.size() < 10) {
@@ -968,8 +1019,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
                 tx.vin[0].prevout.n = 0;
 
                 // Update the expected result of prevouthash to know these coins are spent
-                CCoins& oldcoins = result[prevouthash];
-                oldcoins.Clear();
+                result[COutPoint(prevouthash, 0)].Clear();
 
                 alltxids.erase(prevouthash);
                 coinbaseids.erase(prevouthash);
@@ -980,22 +1030,27 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
             alltxids.insert(tx.GetHash());
 
             // Update the expected result to know about the new output coins
-            CCoins &coins = result[tx.GetHash()];
-            coins.FromTx(tx, height);
+            result[COutPoint(tx.GetHash(), 0)] = Coin(tx.vout[0], height, CTransaction(tx).IsCoinBase());
 
-            UpdateCoins(tx, *(stack.back()), height);
+            CTxUndo undo;
+            UpdateCoins(tx, *(stack.back()), undo, height);
+
+            // The undo data must hold the spent coin.
+            if (!CTransaction(tx).IsCoinBase()) {
+                BOOST_CHECK_EQUAL(undo.vprevout.size(), 1);
+                BOOST_CHECK(!undo.vprevout[0].IsSpent());
+            }
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                 } else {
-                    BOOST_CHECK(it->second.IsPruned());
-                 }
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(coin == it->second);
             }
+            CCoinsSetStats running;
+            BOOST_CHECK(stack.back()->GetRunningStats(running));
+            CheckRunningStats(running, result);
         }
 
         if (insecure_rand() % 100 == 0) {
@@ -1025,53 +1080,36 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
 BOOST_AUTO_TEST_CASE(ccoins_serialization)
 {
     // Good example
-    CDataStream ss1(ParseHex("0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e"), SER_DISK, CLIENT_VERSION);
-    CCoins cc1;
+    CDataStream ss1(ParseHex("97f23c835800816115944e077fe7c803cfa57f29b36bf87c1d35"), SER_DISK, CLIENT_VERSION);
+    Coin cc1;
     ss1 >> cc1;
-    BOOST_CHECK_EQUAL(cc1.nVersion, 1);
     BOOST_CHECK_EQUAL(cc1.fCoinBase, false);
     BOOST_CHECK_EQUAL(cc1.nHeight, 203998);
-    BOOST_CHECK_EQUAL(cc1.vout.size(), 2);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(0), false);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(1), true);
-    BOOST_CHECK_EQUAL(cc1.vout[1].nValue, 60000000000ULL);
-    BOOST_CHECK_EQUAL(HexStr(cc1.vout[1].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
+    BOOST_CHECK_EQUAL(cc1.out.nValue, 60000000000ULL);
+    BOOST_CHECK_EQUAL(HexStr(cc1.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
 
     // Good example
-    CDataStream ss2(ParseHex("0109044086ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4eebbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b"), SER_DISK, CLIENT_VERSION);
-    CCoins cc2;
+    CDataStream ss2(ParseHex("8ddf77bbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa4"), SER_DISK, CLIENT_VERSION);
+    Coin cc2;
     ss2 >> cc2;
-    BOOST_CHECK_EQUAL(cc2.nVersion, 1);
     BOOST_CHECK_EQUAL(cc2.fCoinBase, true);
     BOOST_CHECK_EQUAL(cc2.nHeight, 120891);
-    BOOST_CHECK_EQUAL(cc2.vout.size(), 17);
-    for (int i = 0; i < 17; i++) {
-        BOOST_CHECK_EQUAL(cc2.IsAvailable(i), i == 4 || i == 16);
-    }
-    BOOST_CHECK_EQUAL(cc2.vout[4].nValue, 234925952);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[4].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("61b01caab50f1b8e9c50a5057eb43c2d9563a4ee"))))));
-    BOOST_CHECK_EQUAL(cc2.vout[16].nValue, 110397);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[16].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
+    BOOST_CHECK_EQUAL(cc2.out.nValue, 110397);
+    BOOST_CHECK_EQUAL(HexStr(cc2.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
 
     // Smallest possible example
-    CDataStream ssx(SER_DISK, CLIENT_VERSION);
-    BOOST_CHECK_EQUAL(HexStr(ssx.begin(), ssx.end()), "");
-
-    CDataStream ss3(ParseHex("0002000600"), SER_DISK, CLIENT_VERSION);
-    CCoins cc3;
+    CDataStream ss3(ParseHex("000006"), SER_DISK, CLIENT_VERSION);
+    Coin cc3;
     ss3 >> cc3;
-    BOOST_CHECK_EQUAL(cc3.nVersion, 0);
     BOOST_CHECK_EQUAL(cc3.fCoinBase, false);
     BOOST_CHECK_EQUAL(cc3.nHeight, 0);
-    BOOST_CHECK_EQUAL(cc3.vout.size(), 1);
-    BOOST_CHECK_EQUAL(cc3.IsAvailable(0), true);
-    BOOST_CHECK_EQUAL(cc3.vout[0].nValue, 0);
-    BOOST_CHECK_EQUAL(cc3.vout[0].scriptPubKey.size(), 0);
+    BOOST_CHECK_EQUAL(cc3.out.nValue, 0);
+    BOOST_CHECK_EQUAL(cc3.out.scriptPubKey.size(), 0);
 
     // scriptPubKey that ends beyond the end of the stream
-    CDataStream ss4(ParseHex("0002000800"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss4(ParseHex("000007"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc4;
+        Coin cc4;
         ss4 >> cc4;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
@@ -1082,13 +1120,334 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     uint64_t x = 3000000000ULL;
     tmp << VARINT(x);
     BOOST_CHECK_EQUAL(HexStr(tmp.begin(), tmp.end()), "8a95c0bb00");
-    CDataStream ss5(ParseHex("0002008a95c0bb0000"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss5(ParseHex("00008a95c0bb00"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc5;
+        Coin cc5;
         ss5 >> cc5;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
     }
 }
 
+BOOST_AUTO_TEST_CASE(txundo_legacy_serialization)
+{
+    // Undo record of a non-final spend in the old format: height 0, no version.
+    Coin coin(CTxOut(1000, CScript() << OP_TRUE), 0, false);
+    CTxUndo undo;
+    undo.vprevout.push_back(coin);
+    // Undo record of a final spend: height 100, version dummy.
+    undo.vprevout.push_back(Coin(CTxOut(2000, CScript() << OP_TRUE), 100, true));
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << undo;
+    CTxUndo undo2;
+    ss >> undo2;
+    BOOST_CHECK_EQUAL(undo2.vprevout.size(), 2);
+    BOOST_CHECK(undo2.vprevout[0] == undo.vprevout[0]);
+    BOOST_CHECK_EQUAL(undo2.vprevout[0].nHeight, 0);
+    BOOST_CHECK(undo2.vprevout[1] == undo.vprevout[1]);
+    BOOST_CHECK_EQUAL(undo2.vprevout[1].fCoinBase, true);
+
+    // An old-style record carrying a non-zero transaction version still parses.
+    CDataStream ss2(ParseHex("01" "8049" "02" "00" "06"), SER_DISK, CLIENT_VERSION);
+    CTxUndo undo3;
+    ss2 >> undo3;
+    BOOST_CHECK_EQUAL(undo3.vprevout.size(), 1);
+    BOOST_CHECK_EQUAL(undo3.vprevout[0].nHeight, 100);
+    BOOST_CHECK_EQUAL(undo3.vprevout[0].fCoinBase, true);
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_background_flush, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true);
+    db.StartBackgroundWrites();
+
+    COutPoint outpoint1(GetRandHash(), 0);
+    COutPoint outpoint2(GetRandHash(), 1);
+    Coin coin(CTxOut(1000, CScript() << OP_TRUE), 10, false);
+    uint256 hashBlock1 = GetRandHash();
+    uint256 hashBlock2 = GetRandHash();
+
+    CCoinsViewCache cache(&db);
+    cache.AddCoin(outpoint1, Coin(coin), false);
+    cache.AddCoin(outpoint2, Coin(coin), false);
+    cache.SetBestBlock(hashBlock1);
+    BOOST_CHECK(cache.Flush());
+
+    // Flushed entries are visible whether or not they have been written yet.
+    Coin coin2;
+    BOOST_CHECK(db.GetCoin(outpoint1, coin2));
+    BOOST_CHECK(coin2 == coin);
+    BOOST_CHECK(db.GetBestBlock() == hashBlock1);
+
+    BOOST_CHECK(cache.SpendCoin(outpoint1));
+    cache.SetBestBlock(hashBlock2);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!db.HaveCoin(outpoint1));
+    BOOST_CHECK(db.HaveCoin(outpoint2));
+    BOOST_CHECK(db.GetBestBlock() == hashBlock2);
+
+    BOOST_CHECK(db.WaitForWrites());
+    BOOST_CHECK(!db.HaveCoin(outpoint1));
+    BOOST_CHECK(db.GetCoin(outpoint2, coin2));
+    BOOST_CHECK(coin2 == coin);
+    BOOST_CHECK(db.GetBestBlock() == hashBlock2);
+
+    CCoinsViewCache cache2(&db);
+    BOOST_CHECK(cache2.AccessCoin(outpoint1).IsSpent());
+    BOOST_CHECK(cache2.AccessCoin(outpoint2) == coin);
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_anchor_frontiers, TestingSetup)
+{
+    std::vector<SproutMerkleTree> trees;
+    SproutMerkleTree tree;
+    {
+        CCoinsViewDB db(1 << 20, false, true);
+        CCoinsViewCache cache(&db);
+        for (int i = 0; i < 100; i++) {
+            for (int j = insecure_rand() % 40; j > 0; j--)
+                tree.append(GetRandHash());
+            cache.PushAnchor(tree);
+            trees.push_back(tree);
+        }
+        BOOST_CHECK(cache.Flush());
+
+        // Popped anchors are gone from the database.
+        tree.append(GetRandHash());
+        cache.PushAnchor(tree);
+        BOOST_CHECK(cache.Flush());
+        cache.PopAnchor(trees.back().root(), SPROUT);
+        BOOST_CHECK(cache.Flush());
+        SproutMerkleTree result;
+        BOOST_CHECK(!db.GetSproutAnchorAt(tree.root(), result));
+    }
+
+    // Read the frontiers back from disk rather than from the anchor cache.
+    CCoinsViewDB db(1 << 20, false, false);
+    for (size_t i = 0; i < trees.size(); i++) {
+        SproutMerkleTree result;
+        BOOST_CHECK(db.GetSproutAnchorAt(trees[i].root(), result));
+        BOOST_CHECK(result == trees[i]);
+    }
+    BOOST_CHECK(db.GetBestAnchor(SPROUT) == trees.back().root());
+    SproutMerkleTree result;
+    BOOST_CHECK(!db.GetSproutAnchorAt(tree.root(), result));
+}
+
+BOOST_AUTO_TEST_CASE(nullifier_filter)
+{
+    CNullifierFilter filter;
+    std::vector<uint256> nullifiers;
+    // Enough to need several stages.
+    for (int i = 0; i < 300000; i++) {
+        nullifiers.push_back(GetRandHash());
+        filter.insert(nullifiers.back());
+    }
+    BOOST_CHECK_EQUAL(filter.size(), nullifiers.size());
+    for (size_t i = 0; i < nullifiers.size(); i++)
+        BOOST_CHECK(filter.contains(nullifiers[i]));
+
+    int nFalsePositives = 0;
+    for (int i = 0; i < 100000; i++) {
+        if (filter.contains(GetRandHash()))
+            nFalsePositives++;
+    }
+    BOOST_CHECK(nFalsePositives < 1000);
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_nullifier_filters, TestingSetup)
+{
+    TxWithNullifiers txOld;
+    {
+        CCoinsViewDB db(1 << 20, false, true);
+        CCoinsViewCache cache(&db);
+        cache.SetNullifiers(txOld.tx, true);
+        BOOST_CHECK(cache.Flush());
+    }
+
+    CCoinsViewDB db(1 << 20, false, false);
+    BOOST_CHECK(db.LoadNullifierFilters());
+    BOOST_CHECK(db.GetNullifier(txOld.sproutNullifier, SPROUT));
+    BOOST_CHECK(db.GetNullifier(txOld.saplingNullifier, SAPLING));
+    BOOST_CHECK(!db.GetNullifier(txOld.sproutNullifier, SAPLING));
+    BOOST_CHECK(!db.GetNullifier(GetRandHash(), SPROUT));
+
+    // Nullifiers written after loading are found, and disconnected ones are not.
+    TxWithNullifiers txNew;
+    CCoinsViewCache cache(&db);
+    cache.SetNullifiers(txNew.tx, true);
+    cache.SetNullifiers(txOld.tx, false);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(db.GetNullifier(txNew.sproutNullifier, SPROUT));
+    BOOST_CHECK(db.GetNullifier(txNew.saplingNullifier, SAPLING));
+    BOOST_CHECK(!db.GetNullifier(txOld.sproutNullifier, SPROUT));
+    BOOST_CHECK(!db.GetNullifier(txOld.saplingNullifier, SAPLING));
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_snapshot, TestingSetup)
+{
+    uint256 hashBlock = GetRandHash();
+    CBlockIndex index;
+    index.nHeight = 10;
+    index.nChainTx = 50;
+    mapBlockIndex.insert(std::make_pair(hashBlock, &index));
+
+    CCoinsViewDB db(1 << 20, true);
+    std::vector<std::pair<COutPoint, Coin> > coins;
+    std::vector<SproutMerkleTree> trees;
+    SaplingMerkleTree saplingTree;
+    TxWithNullifiers txNullifiers;
+    {
+        CCoinsViewCache cache(&db);
+        for (int i = 0; i < 100; i++) {
+            COutPoint outpoint(GetRandHash(), insecure_rand() % 4);
+            Coin coin(CTxOut(insecure_rand() % 1000000, CScript() << OP_RETURN), i, false);
+            coin.out.scriptPubKey = CScript() << ToByteVector(GetRandHash()) << OP_EQUAL;
+            cache.AddCoin(outpoint, Coin(coin), false);
+            coins.push_back(std::make_pair(outpoint, coin));
+        }
+        SproutMerkleTree tree;
+        for (int i = 0; i < 20; i++) {
+            for (int j = insecure_rand() % 400; j > 0; j--)
+                tree.append(GetRandHash());
+            cache.PushAnchor(tree);
+            trees.push_back(tree);
+        }
+        saplingTree.append(GetRandHash());
+        cache.PushAnchor(saplingTree);
+        cache.SetNullifiers(txNullifiers.tx, true);
+        cache.SetBestBlock(hashBlock);
+        BOOST_CHECK(cache.Flush());
+    }
+
+    boost::filesystem::path path = GetDataDir() / "chainstate.snapshot";
+    CChainStateSnapshot snapshot;
+    {
+        CAutoFile file(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(db.WriteSnapshot(file, snapshot));
+    }
+    BOOST_CHECK(snapshot.hashBlock == hashBlock);
+    BOOST_CHECK_EQUAL(snapshot.nHeight, 10);
+    BOOST_CHECK_EQUAL(snapshot.nChainTx, 50);
+    BOOST_CHECK_EQUAL(snapshot.nCoins, coins.size());
+    BOOST_CHECK_EQUAL(snapshot.nAnchors, trees.size() + 1);
+    // Both nullifiers of the JoinSplit, one of them null, and the Sapling one
+    BOOST_CHECK_EQUAL(snapshot.nNullifiers, 3);
+
+    CCoinsViewDB db2(1 << 20, true);
+    CChainStateSnapshot loaded;
+    {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(db2.ReadSnapshot(file, loaded, true));
+    }
+    BOOST_CHECK(loaded.hashContents == snapshot.hashContents);
+    BOOST_CHECK_EQUAL(loaded.nCoins, snapshot.nCoins);
+    BOOST_CHECK(db2.GetBestBlock() == hashBlock);
+    BOOST_CHECK(db2.GetBestAnchor(SPROUT) == trees.back().root());
+    BOOST_CHECK(db2.GetBestAnchor(SAPLING) == saplingTree.root());
+    for (size_t i = 0; i < coins.size(); i++) {
+        Coin coin;
+        BOOST_CHECK(db2.GetCoin(coins[i].first, coin));
+        BOOST_CHECK(coin == coins[i].second);
+    }
+    for (size_t i = 0; i < trees.size(); i++) {
+        SproutMerkleTree tree;
+        BOOST_CHECK(db2.GetSproutAnchorAt(trees[i].root(), tree));
+        BOOST_CHECK(tree == trees[i]);
+    }
+    BOOST_CHECK(db2.GetNullifier(txNullifiers.sproutNullifier, SPROUT));
+    BOOST_CHECK(db2.GetNullifier(txNullifiers.saplingNullifier, SAPLING));
+    CCoinsSetStats running;
+    BOOST_CHECK(db2.GetRunningStats(running));
+    BOOST_CHECK_EQUAL(running.nTransactionOutputs, coins.size());
+
+    // A snapshot is only loaded into a database without coins.
+    {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(!db2.ReadSnapshot(file, loaded, true));
+    }
+
+    // Any change to the contents is caught by the commitment.
+    std::vector<char> vch(boost::filesystem::file_size(path));
+    FILE *f = fopen(path.string().c_str(), "rb");
+    BOOST_CHECK_EQUAL(fread(vch.data(), 1, vch.size(), f), vch.size());
+    fclose(f);
+    vch[vch.size() / 2] ^= 1;
+    f = fopen(path.string().c_str(), "wb");
+    fwrite(vch.data(), 1, vch.size(), f);
+    fclose(f);
+    {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(!db2.ReadSnapshot(file, loaded, false));
+    }
+
+    mapBlockIndex.erase(hashBlock);
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_running_stats, TestingSetup)
+{
+    uint256 hashBlock = GetRandHash();
+    CBlockIndex index;
+    mapBlockIndex.insert(std::make_pair(hashBlock, &index));
+
+    // The first database keeps running totals all along, the second one
+    // computes them from its coins afterwards.
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewDB db2(1 << 20, true);
+    BOOST_CHECK(db.LoadRunningStats());
+    CCoinsSetStats running;
+    BOOST_CHECK(db.GetRunningStats(running));
+    BOOST_CHECK_EQUAL(running.nTransactionOutputs, 0);
+    BOOST_CHECK(!db2.GetRunningStats(running));
+
+    std::map<COutPoint, Coin> coins;
+    {
+        CCoinsViewCache cache(&db);
+        CCoinsViewCache cache2(&db2);
+        for (int i = 0; i < 200; i++) {
+            COutPoint outpoint(GetRandHash(), insecure_rand() % 4);
+            Coin coin(CTxOut(insecure_rand() % 1000000, CScript() << ToByteVector(GetRandHash()) << OP_EQUAL), i, i % 10 == 0);
+            cache.AddCoin(outpoint, Coin(coin), false);
+            cache2.AddCoin(outpoint, Coin(coin), false);
+            coins[outpoint] = coin;
+        }
+        for (std::map<COutPoint, Coin>::iterator it = coins.begin(); it != coins.end(); it++) {
+            if (insecure_rand() % 3 == 0) {
+                BOOST_CHECK(cache.SpendCoin(it->first));
+                BOOST_CHECK(cache2.SpendCoin(it->first));
+                it->second.Clear();
+            }
+        }
+        // A cache counts its own changes on top of its base.
+        BOOST_CHECK(cache.GetRunningStats(running));
+        CheckRunningStats(running, coins);
+        BOOST_CHECK(!cache2.GetRunningStats(running));
+
+        cache.SetBestBlock(hashBlock);
+        cache2.SetBestBlock(hashBlock);
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK(cache2.Flush());
+    }
+
+    BOOST_CHECK(db.GetRunningStats(running));
+    CheckRunningStats(running, coins);
+    BOOST_CHECK(db2.LoadRunningStats());
+    BOOST_CHECK(db2.GetRunningStats(running));
+    CheckRunningStats(running, coins);
+
+    // The totals agree with those of a walk over all coins.
+    CCoinsStats stats;
+    BOOST_CHECK(db.GetStats(stats));
+    BOOST_CHECK(db.GetRunningStats(running));
+    BOOST_CHECK_EQUAL(running.nTransactionOutputs, stats.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(running.nSerializedSize, stats.nSerializedSize);
+    BOOST_CHECK_EQUAL(running.nTotalAmount, stats.nTotalAmount);
+    uint256 hashMuHash;
+    running.muhash.Finalize(hashMuHash.begin());
+    BOOST_CHECK(hashMuHash == stats.hashMuHash);
+
+    mapBlockIndex.erase(hashBlock);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
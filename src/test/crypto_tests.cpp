@@ -8,7 +8,9 @@
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "crypto/muhash.h"
 #include "random.h"
+#include "streams.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
@@ -248,4 +250,53 @@ BOOST_AUTO_TEST_CASE(hmac_sha512_testvectors) {
                    "b6022cac3c4982b10d5eeb55c3e4de15134676fb6de0446065c97440fa8c6a58");
 }
 
+BOOST_AUTO_TEST_CASE(muhash_tests) {
+    unsigned char out[MuHash3072::OUTPUT_SIZE];
+    MuHash3072 empty;
+    empty.Finalize(out);
+    BOOST_CHECK_EQUAL(HexStr(out, out + sizeof(out)), "c85525462fdcf30a2c18d6f4b92923000974355c2477f59594d2c205a1d25add");
+
+    std::vector<unsigned char> zero(32, 0), one(32, 1);
+    MuHash3072 set;
+    set.Insert(zero.data()).Insert(one.data());
+    set.Finalize(out);
+    BOOST_CHECK_EQUAL(HexStr(out, out + sizeof(out)), "932bd6db5c551d78ac8dd6f18b6991a56c6f0c40b8f62a4d1e96173e06a50135");
+
+    // The order of updates does not matter, and removing undoes inserting.
+    std::vector<uint256> elements;
+    for (int i = 0; i < 8; i++)
+        elements.push_back(GetRandHash());
+    MuHash3072 forward, backward, both;
+    for (int i = 0; i < 8; i++) {
+        forward.Insert(elements[i].begin());
+        backward.Insert(elements[7 - i].begin());
+        both.Insert(elements[i].begin());
+    }
+    for (int i = 0; i < 8; i++)
+        both.Remove(elements[i].begin());
+    unsigned char outForward[MuHash3072::OUTPUT_SIZE], outBackward[MuHash3072::OUTPUT_SIZE];
+    forward.Finalize(outForward);
+    backward.Finalize(outBackward);
+    BOOST_CHECK(memcmp(outForward, outBackward, sizeof(outForward)) == 0);
+    both.Finalize(out);
+    BOOST_CHECK_EQUAL(HexStr(out, out + sizeof(out)), "c85525462fdcf30a2c18d6f4b92923000974355c2477f59594d2c205a1d25add");
+
+    // Sets combine, and survive serialization with pending removals.
+    MuHash3072 first, second;
+    for (int i = 0; i < 8; i++)
+        (i < 3 ? first : second).Insert(elements[i].begin());
+    second.Remove(elements[0].begin());
+    first *= second;
+    first.Insert(elements[0].begin());
+    CDataStream ss(SER_DISK, 0);
+    ss << first;
+    MuHash3072 copy;
+    ss >> copy;
+    copy.Finalize(out);
+    BOOST_CHECK(memcmp(out, outForward, sizeof(out)) == 0);
+    second /= second;
+    second.Finalize(out);
+    BOOST_CHECK_EQUAL(HexStr(out, out + sizeof(out)), "c85525462fdcf30a2c18d6f4b92923000974355c2477f59594d2c205a1d25add");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
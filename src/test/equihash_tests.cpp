@@ -10,6 +10,7 @@
 #include "arith_uint256.h"
 #include "crypto/sha256.h"
 #include "crypto/equihash.h"
+#include "crypto/equihash_bucket.h"
 #include "test/test_bitcoin.h"
 #include "uint256.h"
 
@@ -82,6 +83,22 @@ void TestEquihashSolvers(unsigned int n, unsigned int k, const std::string &I, c
     BOOST_TEST_MESSAGE(strm.str());
     BOOST_CHECK(retOpt == solns);
     BOOST_CHECK(retOpt == ret);
+
+    // So should the bucket solver, also when threads cooperate on the nonce
+    if (n == 96 && k == 5) {
+        for (unsigned int nThreads = 1; nThreads <= 3; nThreads++) {
+            EquihashBucketSolver<96,5> bucketSolver(nThreads);
+            std::set<std::vector<uint32_t>> retBucket;
+            bucketSolver.Solve(state,
+                               [&retBucket, cBitLen](std::vector<unsigned char> soln) {
+                                   retBucket.insert(GetIndicesFromMinimal(soln, cBitLen));
+                                   return false;
+                               },
+                               [](EhSolverCancelCheck pos) { return false; });
+            BOOST_TEST_MESSAGE("[Bucket, " << nThreads << " threads] Number of solutions: " << retBucket.size());
+            BOOST_CHECK(retBucket == ret);
+        }
+    }
 }
 #endif
 
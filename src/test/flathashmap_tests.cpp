@@ -0,0 +1,132 @@
+// Copyright (c) 2018 The Zero developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "flathashmap.h"
+
+#include "memusage.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <map>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+namespace {
+struct BadHasher
+{
+    // Puts every key into a few probe sequences, to exercise collisions.
+    size_t operator()(int k) const { return k % 7; }
+};
+
+template <typename Map>
+void CheckEqual(const Map& map, const std::map<int, std::string>& ref)
+{
+    BOOST_CHECK_EQUAL(map.size(), ref.size());
+    size_t n = 0;
+    for (typename Map::const_iterator it = map.begin(); it != map.end(); it++) {
+        std::map<int, std::string>::const_iterator itRef = ref.find(it->first);
+        BOOST_CHECK(itRef != ref.end());
+        if (itRef != ref.end())
+            BOOST_CHECK_EQUAL(it->second, itRef->second);
+        n++;
+    }
+    BOOST_CHECK_EQUAL(n, ref.size());
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(flathashmap_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(flathashmap_basic)
+{
+    flathashmap<int, std::string, std::hash<int> > map;
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.find(1) == map.end());
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), 0);
+
+    BOOST_CHECK(map.insert(std::make_pair(1, std::string("one"))).second);
+    BOOST_CHECK(!map.insert(std::make_pair(1, std::string("uno"))).second);
+    BOOST_CHECK_EQUAL(map.find(1)->second, "one");
+    map[2] = "two";
+    BOOST_CHECK_EQUAL(map.size(), 2);
+    BOOST_CHECK_EQUAL(map.count(2), 1);
+
+    // References survive rehashing.
+    std::string& one = map.find(1)->second;
+    for (int i = 3; i < 1000; i++)
+        map[i] = "many";
+    BOOST_CHECK_EQUAL(one, "one");
+    BOOST_CHECK(memusage::DynamicUsage(map) > 0);
+
+    BOOST_CHECK_EQUAL(map.erase(2), 1);
+    BOOST_CHECK_EQUAL(map.erase(2), 0);
+    BOOST_CHECK_EQUAL(map.size(), 998);
+
+    flathashmap<int, std::string, std::hash<int> > copy(map);
+    BOOST_CHECK_EQUAL(copy.size(), 998);
+    BOOST_CHECK_EQUAL(copy.find(1)->second, "one");
+
+    map.clear();
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), 0);
+    map.swap(copy);
+    BOOST_CHECK_EQUAL(map.size(), 998);
+    BOOST_CHECK(copy.empty());
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_erase_while_iterating)
+{
+    flathashmap<int, std::string, BadHasher> map;
+    std::map<int, std::string> ref;
+    for (int i = 0; i < 500; i++) {
+        map[i] = std::to_string(i);
+        ref[i] = std::to_string(i);
+    }
+
+    // Erasing odd keys while iterating visits every element exactly once.
+    size_t nVisited = 0;
+    for (flathashmap<int, std::string, BadHasher>::iterator it = map.begin(); it != map.end(); ) {
+        nVisited++;
+        if (it->first % 2) {
+            ref.erase(it->first);
+            it = map.erase(it);
+        } else {
+            it++;
+        }
+    }
+    BOOST_CHECK_EQUAL(nVisited, 500);
+    CheckEqual(map, ref);
+    for (int i = 0; i < 500; i++)
+        BOOST_CHECK_EQUAL(map.count(i), ref.count(i));
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_random)
+{
+    flathashmap<int, std::string, BadHasher> map;
+    std::map<int, std::string> ref;
+
+    for (int i = 0; i < 20000; i++) {
+        int k = insecure_rand() % 300;
+        switch (insecure_rand() % 4) {
+        case 0:
+        case 1: {
+            std::string v = std::to_string(insecure_rand());
+            bool fInserted = map.insert(std::make_pair(k, v)).second;
+            BOOST_CHECK_EQUAL(fInserted, ref.insert(std::make_pair(k, v)).second);
+            break;
+        }
+        case 2:
+            BOOST_CHECK_EQUAL(map.erase(k), ref.erase(k));
+            break;
+        case 3:
+            BOOST_CHECK_EQUAL(map.find(k) != map.end(), ref.count(k) != 0);
+            break;
+        }
+        if (i % 1000 == 0)
+            CheckEqual(map, ref);
+    }
+    CheckEqual(map, ref);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,83 @@
+// Copyright (c) 2018 The Zero developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "lrucache.h"
+
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <algorithm>
+#include <list>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(lrucache_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(lrucache_basic)
+{
+    lrucache<int, int> cache(3);
+    int v = 0;
+    BOOST_CHECK(!cache.get(1, v));
+
+    cache.insert(1, 10);
+    cache.insert(2, 20);
+    cache.insert(3, 30);
+    BOOST_CHECK_EQUAL(cache.size(), 3);
+
+    // Using 1 makes 2 the least recently used element.
+    BOOST_CHECK(cache.get(1, v));
+    BOOST_CHECK_EQUAL(v, 10);
+    cache.insert(4, 40);
+    BOOST_CHECK_EQUAL(cache.size(), 3);
+    BOOST_CHECK(!cache.contains(2));
+    BOOST_CHECK(cache.contains(1));
+    BOOST_CHECK(cache.contains(3));
+
+    // Replacing a value also counts as use.
+    cache.insert(3, 31);
+    cache.insert(5, 50);
+    BOOST_CHECK(!cache.contains(1));
+    BOOST_CHECK(cache.get(3, v));
+    BOOST_CHECK_EQUAL(v, 31);
+
+    cache.erase(3);
+    BOOST_CHECK(!cache.contains(3));
+    BOOST_CHECK_EQUAL(cache.size(), 2);
+    cache.clear();
+    BOOST_CHECK(cache.empty());
+}
+
+BOOST_AUTO_TEST_CASE(lrucache_random)
+{
+    const size_t MAX_SIZE = 50;
+    lrucache<int, int> cache(MAX_SIZE);
+    // Reference list of keys from most to least recently used.
+    std::list<int> order;
+
+    for (int i = 0; i < 10000; i++) {
+        int k = insecure_rand() % 200;
+        int v = 0;
+        std::list<int>::iterator it = std::find(order.begin(), order.end(), k);
+        if (insecure_rand() % 2) {
+            BOOST_CHECK_EQUAL(cache.get(k, v), it != order.end());
+            if (it != order.end()) {
+                BOOST_CHECK_EQUAL(v, k * 2);
+                order.erase(it);
+                order.push_front(k);
+            }
+        } else {
+            cache.insert(k, k * 2);
+            if (it != order.end())
+                order.erase(it);
+            order.push_front(k);
+            if (order.size() > MAX_SIZE)
+                order.pop_back();
+        }
+        BOOST_CHECK_EQUAL(cache.size(), order.size());
+    }
+    for (std::list<int>::iterator it = order.begin(); it != order.end(); it++)
+        BOOST_CHECK(cache.contains(*it));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
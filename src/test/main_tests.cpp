@@ -4,6 +4,7 @@
 
 #include "chainparams.h"
 #include "main.h"
+#include "txdb.h"
 
 #include "test/test_bitcoin.h"
 
@@ -101,4 +102,29 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(trimmed_block_solution)
+{
+    CBlockHeader header;
+    header.nTime = 1;
+    header.nSolution = std::vector<unsigned char>(400, 0x5a);
+    uint256 hash = header.GetHash();
+
+    CBlockIndex index(header);
+    index.phashBlock = &hash;
+    std::vector<const CBlockIndex*> vBlocks(1, &index);
+    BOOST_CHECK(pblocktree->WriteBatchSync(std::vector<std::pair<int, const CBlockFileInfo*> >(), 0, vBlocks));
+
+    index.TrimSolution();
+    BOOST_CHECK(index.nSolution.empty());
+    BOOST_CHECK(index.GetSolution() == header.nSolution);
+    BOOST_CHECK(index.GetBlockHeader().GetHash() == hash);
+
+    // Rewriting a trimmed entry keeps its solution on disk.
+    BOOST_CHECK(CDiskBlockIndex(&index).nSolution == header.nSolution);
+    BOOST_CHECK(pblocktree->WriteBatchSync(std::vector<std::pair<int, const CBlockFileInfo*> >(), 0, vBlocks));
+    std::vector<unsigned char> solution;
+    BOOST_CHECK(pblocktree->ReadBlockSolution(hash, solution));
+    BOOST_CHECK(solution == header.nSolution);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
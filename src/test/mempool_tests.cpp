@@ -10,6 +10,7 @@
 #include "test/test_bitcoin.h"
 
 #include <boost/test/unit_test.hpp>
+#include <limits>
 #include <list>
 
 BOOST_FIXTURE_TEST_SUITE(mempool_tests, TestingSetup)
@@ -55,7 +56,7 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
 
 
     CTxMemPool testPool(CFeeRate(0));
-    std::list<CTransaction> removed;
+    std::list<CTransactionRef> removed;
 
     // Nothing in pool, remove should do nothing:
     testPool.remove(txParent, removed, true);
@@ -157,6 +158,90 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     BOOST_CHECK(it == pool.mapTx.get<1>().end());
 }
 
+BOOST_AUTO_TEST_CASE(MempoolPackageTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // A parent paying nothing, with a child that pays for both
+    CMutableTransaction txParent = CMutableTransaction();
+    txParent.vout.resize(2);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 10 * COIN;
+    txParent.vout[1].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[1].nValue = 10 * COIN;
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(0LL).FromTx(txParent));
+
+    CMutableTransaction txChild = CMutableTransaction();
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 9 * COIN;
+    pool.addUnchecked(txChild.GetHash(), entry.Fee(20000LL).FromTx(txChild));
+
+    // An unrelated transaction with a lower fee rate than the package
+    CMutableTransaction txOther = CMutableTransaction();
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_12 << OP_EQUAL;
+    txOther.vout[0].nValue = 5 * COIN;
+    pool.addUnchecked(txOther.GetHash(), entry.Fee(1000LL).FromTx(txOther));
+
+    size_t nParentSize = ::GetSerializeSize(txParent, SER_NETWORK, PROTOCOL_VERSION);
+    size_t nChildSize = ::GetSerializeSize(txChild, SER_NETWORK, PROTOCOL_VERSION);
+
+    CTxMemPool::txiter parentIt = pool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter childIt = pool.mapTx.find(txChild.GetHash());
+    BOOST_CHECK_EQUAL(parentIt->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(parentIt->GetSizeWithDescendants(), nParentSize + nChildSize);
+    BOOST_CHECK_EQUAL(parentIt->GetModFeesWithDescendants(), 20000LL);
+    BOOST_CHECK_EQUAL(childIt->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(childIt->GetSizeWithAncestors(), nParentSize + nChildSize);
+    BOOST_CHECK_EQUAL(childIt->GetModFeesWithAncestors(), 20000LL);
+    BOOST_CHECK(pool.GetMemPoolChildren(parentIt).count(childIt));
+    BOOST_CHECK(pool.GetMemPoolParents(childIt).count(parentIt));
+
+    // The child package comes first by ancestor fee rate, the parent alone last
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator it = pool.mapTx.get<ancestor_score>().begin();
+    BOOST_CHECK_EQUAL(it++->GetTx().GetHash().ToString(), txChild.GetHash().ToString());
+    BOOST_CHECK_EQUAL(it++->GetTx().GetHash().ToString(), txOther.GetHash().ToString());
+    BOOST_CHECK_EQUAL(it++->GetTx().GetHash().ToString(), txParent.GetHash().ToString());
+    BOOST_CHECK(it == pool.mapTx.get<ancestor_score>().end());
+
+    // The parent is not the first to be evicted, as its child pays for it
+    BOOST_CHECK_EQUAL(pool.mapTx.get<descendant_score>().begin()->GetTx().GetHash().ToString(), txOther.GetHash().ToString());
+
+    // Prioritising the parent shows up in its child's ancestor state
+    pool.PrioritiseTransaction(txParent.GetHash(), txParent.GetHash().ToString(), 0.0, 5000LL);
+    BOOST_CHECK_EQUAL(childIt->GetModFeesWithAncestors(), 25000LL);
+    BOOST_CHECK_EQUAL(parentIt->GetModFeesWithDescendants(), 25000LL);
+
+    // A grandchild is limited by the ancestor count
+    CMutableTransaction txGrandChild = CMutableTransaction();
+    txGrandChild.vin.resize(1);
+    txGrandChild.vin[0].prevout = COutPoint(txChild.GetHash(), 0);
+    txGrandChild.vout.resize(1);
+    txGrandChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txGrandChild.vout[0].nValue = 8 * COIN;
+    CTxMemPoolEntry grandChildEntry = entry.Fee(10000LL).FromTx(txGrandChild);
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(grandChildEntry, setAncestors, 2, nNoLimit, nNoLimit, nNoLimit, errString));
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(grandChildEntry, setAncestors, 3, nNoLimit, nNoLimit, nNoLimit, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 2);
+
+    // Mining the parent leaves the child with only itself as ancestor
+    std::list<CTransactionRef> removed;
+    pool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(childIt->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(childIt->GetSizeWithAncestors(), nChildSize);
+    BOOST_CHECK_EQUAL(childIt->GetModFeesWithAncestors(), 20000LL);
+    BOOST_CHECK(pool.GetMemPoolParents(childIt).empty());
+}
+
 BOOST_AUTO_TEST_CASE(RemoveWithoutBranchId) {
     CTxMemPool pool(CFeeRate(0));
     TestMemPoolEntryHelper entry;
@@ -212,6 +297,51 @@ BOOST_AUTO_TEST_CASE(RemoveWithoutBranchId) {
     BOOST_CHECK_EQUAL(pool.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    TestMemPoolEntryHelper entry;
+    entry.hadNoDependencies = true;
+
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(10000LL).FromTx(tx1));
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    tx2.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(5000LL).FromTx(tx2));
+
+    // Nothing is evicted while the pool fits
+    pool.TrimToSize(pool.DynamicMemoryUsage());
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    // The transaction with the lowest fee rate goes first
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+
+    // and new transactions have to pay more than it did
+    CFeeRate evicted(5000LL, ::GetSerializeSize(tx2, SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), evicted.GetFeePerK() + 1000);
+
+    pool.TrimToSize(0);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK(pool.GetMinFee(1).GetFeePerK() > evicted.GetFeePerK() + 1000);
+
+    // After a block, the minimum fee decays, down to nothing
+    std::list<CTransactionRef> conflicts;
+    pool.removeForBlock(std::vector<CTransactionRef>(), 1, conflicts);
+    SetMockTime(GetTime() + CTxMemPool::ROLLING_FEE_HALFLIFE * 20);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+    SetMockTime(0);
+}
+
 // Test that nCheckFrequency is set correctly when calling setSanityCheck().
 // https://github.com/zcash/zcash/issues/3134
 BOOST_AUTO_TEST_CASE(SetSanityCheck) {
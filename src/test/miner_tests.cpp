@@ -4,9 +4,11 @@
 
 #include "arith_uint256.h"
 #include "consensus/validation.h"
+#include "key_io.h"
 #include "main.h"
 #include "miner.h"
 #include "pubkey.h"
+#include "script/standard.h"
 #include "uint256.h"
 #include "util.h"
 #include "crypto/equihash.h"
@@ -168,13 +170,13 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
         // one spacing ahead of the tip. Within 11 blocks of genesis, the median
         // will be closer to the tip, and blocks will appear slower.
         pblock->nTime = chainActive.Tip()->GetMedianTimePast()+6*Params().GetConsensus().nPowTargetSpacing;
-        CMutableTransaction txCoinbase(pblock->vtx[0]);
+        CMutableTransaction txCoinbase(*pblock->vtx[0]);
         txCoinbase.nVersion = 1;
         txCoinbase.vin[0].scriptSig = CScript() << (chainActive.Height()+1) << OP_0;
         txCoinbase.vout[0].scriptPubKey = CScript();
-        pblock->vtx[0] = CTransaction(txCoinbase);
+        pblock->vtx[0] = MakeTransactionRef(txCoinbase);
         if (txFirst.size() < 2)
-            txFirst.push_back(new CTransaction(pblock->vtx[0]));
+            txFirst.push_back(new CTransaction(*pblock->vtx[0]));
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
         pblock->nNonce = uint256S(blockinfo[i].nonce_hex);
         pblock->nSolution = ParseHex(blockinfo[i].solution_hex);
@@ -293,6 +295,16 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
         tx.vin[0].prevout.hash = hash;
     }
     BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    {
+        // The coinbase merkle branch gives the merkle root for any coinbase
+        CBlock *pblock = &pblocktemplate->block;
+        BOOST_CHECK(pblock->vtx.size() > 2);
+        BOOST_CHECK(CBlock::CheckMerkleBranch(pblock->vtx[0]->GetHash(), pblocktemplate->vCoinbaseMerkleBranch, 0) == pblock->hashMerkleRoot);
+        CMutableTransaction txCoinbase(*pblock->vtx[0]);
+        txCoinbase.vin[0].scriptSig = CScript() << (chainActive.Height()+1) << OP_1;
+        pblock->vtx[0] = MakeTransactionRef(txCoinbase);
+        BOOST_CHECK(CBlock::CheckMerkleBranch(pblock->vtx[0]->GetHash(), pblocktemplate->vCoinbaseMerkleBranch, 0) == pblock->BuildMerkleTree());
+    }
     delete pblocktemplate;
     mempool.clear();
 
@@ -453,4 +465,89 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCoinbaseEnforcedProtectionEnabled = true;
 }
 
+// The coinbase of a template paying -mineraddress
+static CScript GetCachedBlockTemplatePayee(const CBlockIndex*& pindexPrev, unsigned int& nTransactionsUpdated)
+{
+    LOCK(cs_main);
+    CBlockTemplate blocktemplate;
+    BOOST_REQUIRE(GetCachedBlockTemplate(blocktemplate, pindexPrev, nTransactionsUpdated));
+    return blocktemplate.block.vtx[0]->vout[0].scriptPubKey;
+}
+
+BOOST_AUTO_TEST_CASE(cached_block_template)
+{
+    // Templates pay -mineraddress; changing it tells a rebuilt template from
+    // the cached one
+    uint160 hashA, hashB;
+    *hashA.begin() = 1;
+    *hashB.begin() = 2;
+    CKeyID keyA(hashA), keyB(hashB);
+    CScript scriptA = GetScriptForDestination(keyA), scriptB = GetScriptForDestination(keyB);
+    const CBlockIndex* pindexPrev = NULL;
+    unsigned int nTransactionsUpdated = 0;
+    fCheckpointsEnabled = false;
+    fCoinbaseEnforcedProtectionEnabled = false;
+    int64_t nStart = GetTime();
+    SetMockTime(nStart);
+
+    // The first request builds the template
+    mapArgs["-mineraddress"] = EncodeDestination(keyA);
+    BOOST_CHECK(GetCachedBlockTemplatePayee(pindexPrev, nTransactionsUpdated) == scriptA);
+    BOOST_CHECK(pindexPrev == chainActive.Tip());
+    unsigned int nTransactionsUpdatedFirst = nTransactionsUpdated;
+
+    // It is served from the cache while the tip and the mempool do not
+    // change, and while the mempool has changed for less than
+    // BLOCK_TEMPLATE_REFRESH_INTERVAL seconds
+    mapArgs["-mineraddress"] = EncodeDestination(keyB);
+    BOOST_CHECK(GetCachedBlockTemplatePayee(pindexPrev, nTransactionsUpdated) == scriptA);
+    mempool.AddTransactionsUpdated(1);
+    SetMockTime(nStart + BLOCK_TEMPLATE_REFRESH_INTERVAL - 1);
+    BOOST_CHECK(GetCachedBlockTemplatePayee(pindexPrev, nTransactionsUpdated) == scriptA);
+    BOOST_CHECK_EQUAL(nTransactionsUpdated, nTransactionsUpdatedFirst);
+
+    // After that, the stale template is still served, while the builder
+    // thread replaces it
+    StartBlockTemplateBuilder();
+    SetMockTime(nStart + BLOCK_TEMPLATE_REFRESH_INTERVAL);
+    BOOST_CHECK(GetCachedBlockTemplatePayee(pindexPrev, nTransactionsUpdated) == scriptA);
+    for (int i = 0; i < 1000 && GetCachedBlockTemplatePayee(pindexPrev, nTransactionsUpdated) == scriptA; i++)
+        MilliSleep(10);
+    BOOST_CHECK(GetCachedBlockTemplatePayee(pindexPrev, nTransactionsUpdated) == scriptB);
+    BOOST_CHECK_EQUAL(nTransactionsUpdated, nTransactionsUpdatedFirst + 1);
+
+    // A template on the previous tip is never served
+    mapArgs["-mineraddress"] = EncodeDestination(keyA);
+    {
+        LOCK(cs_main);
+        CBlockTemplate* pblocktemplate;
+        BOOST_REQUIRE(pblocktemplate = CreateNewBlock(CScript() << OP_TRUE));
+        CBlock *pblock = &pblocktemplate->block;
+        pblock->nVersion = 4;
+        pblock->nTime = chainActive.Tip()->GetMedianTimePast()+6*Params().GetConsensus().nPowTargetSpacing;
+        CMutableTransaction txCoinbase(*pblock->vtx[0]);
+        txCoinbase.nVersion = 1;
+        txCoinbase.vin[0].scriptSig = CScript() << (chainActive.Height()+1) << OP_0;
+        txCoinbase.vout[0].scriptPubKey = CScript();
+        pblock->vtx[0] = MakeTransactionRef(txCoinbase);
+        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        pblock->nNonce = uint256S(blockinfo[0].nonce_hex);
+        pblock->nSolution = ParseHex(blockinfo[0].solution_hex);
+        pblock->hashFinalSaplingRoot = uint256();
+        CValidationState state;
+        BOOST_CHECK(ProcessNewBlock(state, NULL, pblock, true, NULL));
+        BOOST_CHECK_MESSAGE(state.IsValid(), state.GetRejectReason());
+        delete pblocktemplate;
+    }
+    BOOST_CHECK_EQUAL(chainActive.Height(), 1);
+    BOOST_CHECK(GetCachedBlockTemplatePayee(pindexPrev, nTransactionsUpdated) == scriptA);
+    BOOST_CHECK(pindexPrev == chainActive.Tip());
+
+    StopBlockTemplateBuilder();
+    mapArgs.erase("-mineraddress");
+    SetMockTime(0);
+    fCheckpointsEnabled = true;
+    fCoinbaseEnforcedProtectionEnabled = true;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -113,8 +113,9 @@ TestingSetup::TestingSetup()
         RegisterValidationInterface(pwalletMain);
 #endif
         nScriptCheckThreads = 3;
-        for (int i=0; i < nScriptCheckThreads-1; i++)
-            threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i < nScriptCheckThreads-1; i++) {
+            threadGroup.create_thread(&ThreadCheckQueue);
+        }
         RegisterNodeSignals(GetNodeSignals());
 }
 
@@ -147,7 +148,7 @@ TestingSetup::~TestingSetup()
 CTxMemPoolEntry TestMemPoolEntryHelper::FromTx(CMutableTransaction &tx, CTxMemPool *pool) {
     return CTxMemPoolEntry(tx, nFee, nTime, dPriority, nHeight,
                            pool ? pool->HasNoInputsOf(tx) : hadNoDependencies,
-                           spendsCoinbase, nBranchId);
+                           spendsCoinbase, sigOpCount, nBranchId);
 }
 
 void Shutdown(void* parg)
@@ -7,12 +7,20 @@
 
 #include "chainparams.h"
 #include "hash.h"
+#include "init.h"
 #include "main.h"
 #include "pow.h"
+#include "random.h"
+#include "streams.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "util.h"
 
+#include <deque>
 #include <stdint.h>
+#include <string.h>
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -21,8 +29,11 @@ using namespace std;
 // previously used by DB_SAPLING_ANCHOR and DB_BEST_SAPLING_ANCHOR.
 static const char DB_SPROUT_ANCHOR = 'A';
 static const char DB_SAPLING_ANCHOR = 'Z';
+static const char DB_SPROUT_OMMERS = 'o';
+static const char DB_SAPLING_OMMERS = 'p';
 static const char DB_NULLIFIER = 's';
 static const char DB_SAPLING_NULLIFIER = 'S';
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
@@ -31,16 +42,425 @@ static const char DB_BLOCK_INDEX = 'b';
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_BEST_SPROUT_ANCHOR = 'a';
 static const char DB_BEST_SAPLING_ANCHOR = 'z';
+static const char DB_COINS_STATS = 'U';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_SNAPSHOT_BLOCK = 'n';
 
+namespace {
 
-CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe) {
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN)  {}
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << key;
+        s << outpoint->hash;
+        s << VARINT(outpoint->n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s >> key;
+        s >> outpoint->hash;
+        s >> VARINT(outpoint->n);
+    }
+};
+
+//! First byte of an anchor record stored as a frontier. Anchor records
+//! written before hold the whole tree and start with 0 or 1.
+static const unsigned char ANCHOR_FRONTIER_RECORD = 2;
+
+//! Ommers from this level up are kept in a separate record, which changes
+//! only once every 2^ANCHOR_SHARED_LEVEL commitments or so.
+static const size_t ANCHOR_SHARED_LEVEL = 8;
+
+typedef std::vector<boost::optional<uint256> > OptionalHashes;
+
+/** Number of entries and a bitmask of the present ones, followed by those */
+struct CompactOptionalHashes {
+    OptionalHashes* hashes;
+    CompactOptionalHashes(const OptionalHashes* ptr) : hashes(const_cast<OptionalHashes*>(ptr)) {}
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        assert(hashes->size() <= 64);
+        uint64_t nMask = 0;
+        for (size_t i = 0; i < hashes->size(); i++) {
+            if ((*hashes)[i])
+                nMask |= (uint64_t)1 << i;
+        }
+        s << VARINT(hashes->size());
+        s << VARINT(nMask);
+        for (size_t i = 0; i < hashes->size(); i++) {
+            if ((*hashes)[i])
+                s << *(*hashes)[i];
+        }
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        uint64_t nSize = 0;
+        uint64_t nMask = 0;
+        s >> VARINT(nSize);
+        if (nSize > 64)
+            throw std::ios_base::failure("too many hashes");
+        s >> VARINT(nMask);
+        hashes->assign(nSize, boost::none);
+        for (size_t i = 0; i < nSize; i++) {
+            if (nMask & ((uint64_t)1 << i)) {
+                uint256 hash;
+                s >> hash;
+                (*hashes)[i] = hash;
+            }
+        }
+    }
+};
+
+/**
+ * An anchor in the database: the leaves and lower ommers of its tree, and
+ * the hash of the record holding the upper ommers, if any. Records holding
+ * a whole serialized tree are still read.
+ */
+struct AnchorRecord {
+    //! Left leaf, right leaf, then the ommers toward the root
+    OptionalHashes frontier;
+    uint256 hashUpper;
+
+    template<typename Tree>
+    static AnchorRecord FromTree(const Tree &tree, OptionalHashes &upper) {
+        // A serialized tree is what older records hold.
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << tree;
+        AnchorRecord record;
+        ss >> record;
+        upper.clear();
+        if (record.frontier.size() > 2 + ANCHOR_SHARED_LEVEL) {
+            upper.assign(record.frontier.begin() + 2 + ANCHOR_SHARED_LEVEL, record.frontier.end());
+            record.frontier.resize(2 + ANCHOR_SHARED_LEVEL);
+            record.hashUpper = SerializeHash(CompactOptionalHashes(&upper));
+        }
+        return record;
+    }
+
+    template<typename Tree>
+    void ToTree(Tree &tree, const OptionalHashes &upper) const {
+        OptionalHashes parents(frontier.begin() + 2, frontier.end());
+        parents.insert(parents.end(), upper.begin(), upper.end());
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << frontier[0] << frontier[1] << parents;
+        ss >> tree;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << ANCHOR_FRONTIER_RECORD;
+        s << CompactOptionalHashes(&frontier);
+        s << hashUpper;
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        unsigned char chFirst = 0;
+        s >> chFirst;
+        if (chFirst == ANCHOR_FRONTIER_RECORD) {
+            s >> REF(CompactOptionalHashes(&frontier));
+            if (frontier.size() < 2)
+                throw std::ios_base::failure("anchor frontier too short");
+            s >> hashUpper;
+        } else if (chFirst <= 1) {
+            // Whole tree; chFirst was the discriminant of its left leaf.
+            boost::optional<uint256> left, right;
+            OptionalHashes parents;
+            if (chFirst) {
+                uint256 hash;
+                s >> hash;
+                left = hash;
+            }
+            s >> right >> parents;
+            frontier.clear();
+            frontier.push_back(left);
+            frontier.push_back(right);
+            frontier.insert(frontier.end(), parents.begin(), parents.end());
+            hashUpper.SetNull();
+        } else {
+            throw std::ios_base::failure("unknown anchor record");
+        }
+    }
+};
+
+template<typename Tree>
+bool ReadAnchor(const CDBWrapper &db, char dbChar, char dbOmmersChar, const uint256 &rt, Tree &tree)
+{
+    AnchorRecord record;
+    if (!db.Read(make_pair(dbChar, rt), record))
+        return false;
+    OptionalHashes upper;
+    if (!record.hashUpper.IsNull()) {
+        CompactOptionalHashes ommers(&upper);
+        if (!db.Read(make_pair(dbOmmersChar, record.hashUpper), ommers))
+            throw runtime_error("Missing ommers of anchor " + rt.GetHex());
+    }
+    record.ToTree(tree, upper);
+    return true;
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) 
+void UpdateNullifierFilter(CNullifierFilter &filter, const CNullifiersMap &mapNullifiers)
 {
+    for (CNullifiersMap::const_iterator it = mapNullifiers.begin(); it != mapNullifiers.end(); it++) {
+        if ((it->second.flags & CNullifiersCacheEntry::DIRTY) && it->second.entered)
+            filter.insert(it->first);
+    }
+}
+
+template<typename Map, typename Cache>
+void UpdateAnchorCache(Cache &cache, const Map &mapAnchors)
+{
+    for (typename Map::const_iterator it = mapAnchors.begin(); it != mapAnchors.end(); it++) {
+        if (it->second.flags & Map::mapped_type::DIRTY) {
+            if (it->second.entered)
+                cache.insert(it->first, it->second.tree);
+            else
+                cache.erase(it->first);
+        }
+    }
+}
+
+}
+
+
+//! Filter bits per nullifier and hash functions, for about one false
+//! positive in a thousand lookups of new nullifiers
+static const size_t NULLIFIER_FILTER_BITS = 15;
+static const unsigned int NULLIFIER_FILTER_HASHES = 10;
+static const size_t NULLIFIER_FILTER_MIN_CAPACITY = 1 << 16;
+
+CNullifierFilter::CNullifierFilter(size_t nExpected) : salt(GetRandHash())
+{
+    if (nExpected)
+        AddStage(std::max(nExpected, NULLIFIER_FILTER_MIN_CAPACITY));
+}
+
+void CNullifierFilter::AddStage(size_t nCapacity)
+{
+    Stage stage;
+    stage.vBits.assign((nCapacity * NULLIFIER_FILTER_BITS + 63) / 64, 0);
+    stage.nElements = 0;
+    stage.nCapacity = nCapacity;
+    stages.push_back(stage);
+}
+
+void CNullifierFilter::insert(const uint256 &nf)
+{
+    if (stages.empty())
+        AddStage(NULLIFIER_FILTER_MIN_CAPACITY);
+    else if (stages.back().nElements >= stages.back().nCapacity)
+        AddStage(stages.back().nCapacity * 2);
+
+    Stage& stage = stages.back();
+    uint64_t h1 = nf.GetHash(salt);
+    uint64_t h2 = nf.GetHash(salt, 1) | 1;
+    uint64_t nBits = stage.vBits.size() * 64;
+    for (unsigned int i = 0; i < NULLIFIER_FILTER_HASHES; i++) {
+        uint64_t nPos = (h1 + i * h2) % nBits;
+        stage.vBits[nPos >> 6] |= (uint64_t)1 << (nPos & 63);
+    }
+    stage.nElements++;
+}
+
+bool CNullifierFilter::contains(const uint256 &nf) const
+{
+    if (stages.empty())
+        return false;
+
+    uint64_t h1 = nf.GetHash(salt);
+    uint64_t h2 = nf.GetHash(salt, 1) | 1;
+    for (std::vector<Stage>::const_iterator it = stages.begin(); it != stages.end(); it++) {
+        uint64_t nBits = it->vBits.size() * 64;
+        unsigned int i = 0;
+        for (; i < NULLIFIER_FILTER_HASHES; i++) {
+            uint64_t nPos = (h1 + i * h2) % nBits;
+            if (!(it->vBits[nPos >> 6] & ((uint64_t)1 << (nPos & 63))))
+                break;
+        }
+        if (i == NULLIFIER_FILTER_HASHES)
+            return true;
+    }
+    return false;
+}
+
+size_t CNullifierFilter::size() const
+{
+    size_t nElements = 0;
+    for (std::vector<Stage>::const_iterator it = stages.begin(); it != stages.end(); it++)
+        nElements += it->nElements;
+    return nElements;
+}
+
+size_t CNullifierFilter::DynamicMemoryUsage() const
+{
+    size_t nUsage = memusage::DynamicUsage(stages);
+    for (std::vector<Stage>::const_iterator it = stages.begin(); it != stages.end(); it++)
+        nUsage += memusage::DynamicUsage(it->vBits);
+    return nUsage;
+}
+
+CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : fWriteFailed(false), fStopWriter(false), fNullifierFilters(false), fRunningStats(false), cacheSproutAnchors(ANCHOR_CACHE_SIZE), cacheSaplingAnchors(ANCHOR_CACHE_SIZE), db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe) {
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : fWriteFailed(false), fStopWriter(false), fNullifierFilters(false), fRunningStats(false), cacheSproutAnchors(ANCHOR_CACHE_SIZE), cacheSaplingAnchors(ANCHOR_CACHE_SIZE), db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) 
+{
+}
+
+CCoinsViewDB::~CCoinsViewDB()
+{
+    if (writerThread.joinable()) {
+        {
+            boost::unique_lock<boost::mutex> lock(csLayer);
+            fStopWriter = true;
+            condLayer.notify_all();
+        }
+        // The writer finishes the pending layer before it exits.
+        writerThread.join();
+    }
+}
+
+void CCoinsViewDB::StartBackgroundWrites()
+{
+    if (!writerThread.joinable())
+        writerThread = boost::thread(boost::bind(&CCoinsViewDB::ThreadWriter, this));
+}
+
+void CCoinsViewDB::ThreadWriter()
+{
+    RenameThread("zcash-coinsflush");
+    boost::unique_lock<boost::mutex> lock(csLayer);
+    while (true) {
+        while (!fStopWriter && (!layer || fWriteFailed))
+            condLayer.wait(lock);
+        if (!layer || fWriteFailed)
+            return;
+
+        std::shared_ptr<const CCoinsFlushLayer> flushed = layer;
+        lock.unlock();
+        bool fOk = false;
+        try {
+            fOk = WriteLayer(*flushed);
+        } catch (const std::runtime_error& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        lock.lock();
+
+        // The layer stays visible to lookups if it could not be written.
+        if (fOk)
+            layer.reset();
+        else
+            fWriteFailed = true;
+        condLayer.notify_all();
+    }
+}
+
+bool CCoinsViewDB::LoadNullifierFilters()
+{
+    // Flushes wait for the filters, so that none of their nullifiers is missed.
+    boost::unique_lock<boost::mutex> lock(csNullifierFilters);
+    if (!WaitForWrites())
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    CNullifierFilter sprout, sapling;
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    std::pair<char, uint256> key;
+    pcursor->Seek(DB_NULLIFIER);
+    while (pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_NULLIFIER) {
+        sprout.insert(key.second);
+        pcursor->Next();
+    }
+    pcursor->Seek(DB_SAPLING_NULLIFIER);
+    while (pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_SAPLING_NULLIFIER) {
+        sapling.insert(key.second);
+        pcursor->Next();
+    }
+
+    sproutNullifierFilter = sprout;
+    saplingNullifierFilter = sapling;
+    fNullifierFilters = true;
+    LogPrintf("Loaded %u Sprout and %u Sapling nullifiers into memory (%.1fMiB) in %dms\n",
+        (unsigned int)sprout.size(), (unsigned int)sapling.size(),
+        (sprout.DynamicMemoryUsage() + sapling.DynamicMemoryUsage()) * (1.0 / (1 << 20)),
+        GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CCoinsViewDB::LoadRunningStats()
+{
+    if (!WaitForWrites())
+        return false;
+
+    uint256 hashBestBlock = GetBestBlock();
+    std::pair<uint256, CCoinsSetStats> record;
+    if (!db.Read(DB_COINS_STATS, record) || record.first != hashBestBlock) {
+        // Missing, or left behind by a version that did not keep them.
+        int64_t nStart = GetTimeMillis();
+        LogPrintf("Computing UTXO set statistics...\n");
+        uiInterface.ShowProgress(_("Computing UTXO set statistics"), 0);
+        record = std::make_pair(hashBestBlock, CCoinsSetStats());
+        boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+        pcursor->Seek(DB_COIN);
+        int64_t count = 0;
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            if (ShutdownRequested())
+                return false;
+            COutPoint outpoint;
+            CoinEntry entry(&outpoint);
+            if (!pcursor->GetKey(entry) || entry.key != DB_COIN)
+                break;
+            if (count++ % 4096 == 0)
+                uiInterface.ShowProgress(_("Computing UTXO set statistics"), (int)(*outpoint.hash.begin() * 100.0 / 256.0 + 0.5));
+            Coin coin;
+            if (!pcursor->GetValue(coin))
+                return error("%s: unable to read coin", __func__);
+            record.second.AddCoin(outpoint, coin);
+            pcursor->Next();
+        }
+        uiInterface.ShowProgress("", 100);
+        if (!db.Write(DB_COINS_STATS, record, true))
+            return error("%s: failed to write UTXO set statistics", __func__);
+        LogPrintf("Computed statistics of %u coins in %dms\n", (unsigned int)count, GetTimeMillis() - nStart);
+    }
+
+    boost::unique_lock<boost::mutex> lock(csStats);
+    fRunningStats = true;
+    hashStatsBlock = record.first;
+    statsTotal = record.second;
+    return true;
+}
+
+bool CCoinsViewDB::GetRunningStats(CCoinsSetStats &stats) const
+{
+    boost::unique_lock<boost::mutex> lock(csStats);
+    if (!fRunningStats)
+        return false;
+    stats = statsTotal;
+    return true;
+}
+
+bool CCoinsViewDB::WaitForWrites() const
+{
+    boost::unique_lock<boost::mutex> lock(csLayer);
+    while (layer && !fWriteFailed)
+        condLayer.wait(lock);
+    return !fWriteFailed;
+}
+
+std::shared_ptr<const CCoinsViewDB::CCoinsFlushLayer> CCoinsViewDB::GetLayer() const
+{
+    boost::unique_lock<boost::mutex> lock(csLayer);
+    return layer;
 }
 
 
@@ -51,9 +471,29 @@ bool CCoinsViewDB::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree)
         return true;
     }
 
-    bool read = db.Read(make_pair(DB_SPROUT_ANCHOR, rt), tree);
+    std::shared_ptr<const CCoinsFlushLayer> flushed = GetLayer();
+    if (flushed) {
+        CAnchorsSproutMap::const_iterator it = flushed->mapSproutAnchors.find(rt);
+        if (it != flushed->mapSproutAnchors.end()) {
+            if (!it->second.entered)
+                return false;
+            tree = it->second.tree;
+            return true;
+        }
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(csAnchorCache);
+        if (cacheSproutAnchors.get(rt, tree))
+            return true;
+    }
+
+    if (!ReadAnchor(db, DB_SPROUT_ANCHOR, DB_SPROUT_OMMERS, rt, tree))
+        return false;
 
-    return read;
+    boost::unique_lock<boost::mutex> lock(csAnchorCache);
+    cacheSproutAnchors.insert(rt, tree);
+    return true;
 }
 
 bool CCoinsViewDB::GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const {
@@ -63,36 +503,95 @@ bool CCoinsViewDB::GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree
         return true;
     }
 
-    bool read = db.Read(make_pair(DB_SAPLING_ANCHOR, rt), tree);
+    std::shared_ptr<const CCoinsFlushLayer> flushed = GetLayer();
+    if (flushed) {
+        CAnchorsSaplingMap::const_iterator it = flushed->mapSaplingAnchors.find(rt);
+        if (it != flushed->mapSaplingAnchors.end()) {
+            if (!it->second.entered)
+                return false;
+            tree = it->second.tree;
+            return true;
+        }
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(csAnchorCache);
+        if (cacheSaplingAnchors.get(rt, tree))
+            return true;
+    }
 
-    return read;
+    if (!ReadAnchor(db, DB_SAPLING_ANCHOR, DB_SAPLING_OMMERS, rt, tree))
+        return false;
+
+    boost::unique_lock<boost::mutex> lock(csAnchorCache);
+    cacheSaplingAnchors.insert(rt, tree);
+    return true;
 }
 
 bool CCoinsViewDB::GetNullifier(const uint256 &nf, ShieldedType type) const {
     bool spent = false;
     char dbChar;
+    const CNullifiersMap* mapFlushed = NULL;
+    const CNullifierFilter* filter = NULL;
+    std::shared_ptr<const CCoinsFlushLayer> flushed = GetLayer();
     switch (type) {
         case SPROUT:
             dbChar = DB_NULLIFIER;
+            if (flushed)
+                mapFlushed = &flushed->mapSproutNullifiers;
+            filter = &sproutNullifierFilter;
             break;
         case SAPLING:
             dbChar = DB_SAPLING_NULLIFIER;
+            if (flushed)
+                mapFlushed = &flushed->mapSaplingNullifiers;
+            filter = &saplingNullifierFilter;
             break;
         default:
             throw runtime_error("Unknown shielded type");
     }
+    if (mapFlushed) {
+        CNullifiersMap::const_iterator it = mapFlushed->find(nf);
+        if (it != mapFlushed->end())
+            return it->second.entered;
+    }
+    {
+        boost::unique_lock<boost::mutex> lock(csNullifierFilters);
+        if (fNullifierFilters && !filter->contains(nf))
+            return false;
+    }
     return db.Read(make_pair(dbChar, nf), spent);
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    std::shared_ptr<const CCoinsFlushLayer> flushed = GetLayer();
+    if (flushed) {
+        CCoinsMap::const_iterator it = flushed->mapCoins.find(outpoint);
+        if (it != flushed->mapCoins.end()) {
+            if (it->second.coin.IsSpent())
+                return false;
+            coin = it->second.coin;
+            return true;
+        }
+    }
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    std::shared_ptr<const CCoinsFlushLayer> flushed = GetLayer();
+    if (flushed) {
+        CCoinsMap::const_iterator it = flushed->mapCoins.find(outpoint);
+        if (it != flushed->mapCoins.end())
+            return !it->second.coin.IsSpent();
+    }
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
+    std::shared_ptr<const CCoinsFlushLayer> flushed = GetLayer();
+    if (flushed && !flushed->hashBlock.IsNull())
+        return flushed->hashBlock;
+
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
@@ -101,13 +600,18 @@ uint256 CCoinsViewDB::GetBestBlock() const {
 
 uint256 CCoinsViewDB::GetBestAnchor(ShieldedType type) const {
     uint256 hashBestAnchor;
-    
+    std::shared_ptr<const CCoinsFlushLayer> flushed = GetLayer();
+
     switch (type) {
         case SPROUT:
+            if (flushed && !flushed->hashSproutAnchor.IsNull())
+                return flushed->hashSproutAnchor;
             if (!db.Read(DB_BEST_SPROUT_ANCHOR, hashBestAnchor))
                 return SproutMerkleTree::empty_root();
             break;
         case SAPLING:
+            if (flushed && !flushed->hashSaplingAnchor.IsNull())
+                return flushed->hashSaplingAnchor;
             if (!db.Read(DB_BEST_SAPLING_ANCHOR, hashBestAnchor))
                 return SaplingMerkleTree::empty_root();
             break;
@@ -118,82 +622,284 @@ uint256 CCoinsViewDB::GetBestAnchor(ShieldedType type) const {
     return hashBestAnchor;
 }
 
-void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char& dbChar)
+void BatchWriteNullifiers(CDBBatch& batch, const CNullifiersMap& mapToUse, const char& dbChar)
 {
-    for (CNullifiersMap::iterator it = mapToUse.begin(); it != mapToUse.end();) {
+    for (CNullifiersMap::const_iterator it = mapToUse.begin(); it != mapToUse.end(); it++) {
         if (it->second.flags & CNullifiersCacheEntry::DIRTY) {
             if (!it->second.entered)
                 batch.Erase(make_pair(dbChar, it->first));
             else
                 batch.Write(make_pair(dbChar, it->first), true);
-            // TODO: changed++? ... See comment in CCoinsViewDB::BatchWrite. If this is needed we could return an int
+            // TODO: changed++? ... See comment in CCoinsViewDB::WriteLayer. If this is needed we could return an int
         }
-        CNullifiersMap::iterator itOld = it++;
-        mapToUse.erase(itOld);
     }
 }
 
 template<typename Map, typename MapIterator, typename MapEntry, typename Tree>
-void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar)
+void BatchWriteAnchors(CDBBatch& batch, const Map& mapToUse, const char& dbChar, const char& dbOmmersChar)
 {
-    for (MapIterator it = mapToUse.begin(); it != mapToUse.end();) {
+    std::set<uint256> setUpperWritten;
+    for (MapIterator it = mapToUse.begin(); it != mapToUse.end(); it++) {
         if (it->second.flags & MapEntry::DIRTY) {
             if (!it->second.entered)
                 batch.Erase(make_pair(dbChar, it->first));
             else {
                 if (it->first != Tree::empty_root()) {
-                    batch.Write(make_pair(dbChar, it->first), it->second.tree);
+                    // Upper ommers are never erased, as other anchors may
+                    // share them. A reorg leaves a few of them behind.
+                    OptionalHashes upper;
+                    AnchorRecord record = AnchorRecord::FromTree(it->second.tree, upper);
+                    if (!record.hashUpper.IsNull() && setUpperWritten.insert(record.hashUpper).second)
+                        batch.Write(make_pair(dbOmmersChar, record.hashUpper), CompactOptionalHashes(&upper));
+                    batch.Write(make_pair(dbChar, it->first), record);
                 }
             }
             // TODO: changed++?
         }
-        MapIterator itOld = it++;
-        mapToUse.erase(itOld);
     }
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
-                              const uint256 &hashBlock,
-                              const uint256 &hashSproutAnchor,
-                              const uint256 &hashSaplingAnchor,
-                              CAnchorsSproutMap &mapSproutAnchors,
-                              CAnchorsSaplingMap &mapSaplingAnchors,
-                              CNullifiersMap &mapSproutNullifiers,
-                              CNullifiersMap &mapSaplingNullifiers) {
+bool CCoinsViewDB::WriteLayer(const CCoinsFlushLayer &flushed) {
+    int64_t nStart = GetTimeMicros();
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    for (CCoinsMap::const_iterator it = flushed.mapCoins.begin(); it != flushed.mapCoins.end(); it++) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
             else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
 
-    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, mapSproutAnchors, DB_SPROUT_ANCHOR);
-    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR);
+    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::const_iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, flushed.mapSproutAnchors, DB_SPROUT_ANCHOR, DB_SPROUT_OMMERS);
+    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::const_iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, flushed.mapSaplingAnchors, DB_SAPLING_ANCHOR, DB_SAPLING_OMMERS);
 
-    ::BatchWriteNullifiers(batch, mapSproutNullifiers, DB_NULLIFIER);
-    ::BatchWriteNullifiers(batch, mapSaplingNullifiers, DB_SAPLING_NULLIFIER);
+    ::BatchWriteNullifiers(batch, flushed.mapSproutNullifiers, DB_NULLIFIER);
+    ::BatchWriteNullifiers(batch, flushed.mapSaplingNullifiers, DB_SAPLING_NULLIFIER);
 
-    if (!hashBlock.IsNull())
-        batch.Write(DB_BEST_BLOCK, hashBlock);
-    if (!hashSproutAnchor.IsNull())
-        batch.Write(DB_BEST_SPROUT_ANCHOR, hashSproutAnchor);
-    if (!hashSaplingAnchor.IsNull())
-        batch.Write(DB_BEST_SAPLING_ANCHOR, hashSaplingAnchor);
+    if (!flushed.hashBlock.IsNull())
+        batch.Write(DB_BEST_BLOCK, flushed.hashBlock);
+    if (!flushed.hashSproutAnchor.IsNull())
+        batch.Write(DB_BEST_SPROUT_ANCHOR, flushed.hashSproutAnchor);
+    if (!flushed.hashSaplingAnchor.IsNull())
+        batch.Write(DB_BEST_SAPLING_ANCHOR, flushed.hashSaplingAnchor);
+    if (flushed.fRunningStats)
+        batch.Write(DB_COINS_STATS, make_pair(flushed.hashStatsBlock, flushed.stats));
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    bool fOk = db.WriteBatch(batch);
+    LogPrint("bench", "    - Write coin database: %.2fms\n", 0.001 * (GetTimeMicros() - nStart));
+    return fOk;
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
+                              const uint256 &hashBlock,
+                              const uint256 &hashSproutAnchor,
+                              const uint256 &hashSaplingAnchor,
+                              CAnchorsSproutMap &mapSproutAnchors,
+                              CAnchorsSaplingMap &mapSaplingAnchors,
+                              CNullifiersMap &mapSproutNullifiers,
+                              CNullifiersMap &mapSaplingNullifiers,
+                              const CCoinsSetStats &statsDelta) {
+    {
+        // Popped anchors must not be found in the cache once the layer is
+        // gone; new ones are likely to be looked up soon.
+        boost::unique_lock<boost::mutex> lock(csAnchorCache);
+        UpdateAnchorCache(cacheSproutAnchors, mapSproutAnchors);
+        UpdateAnchorCache(cacheSaplingAnchors, mapSaplingAnchors);
+    }
+
+    {
+        // Added nullifiers go into the filters before they can be looked up
+        // past the layer. Erased ones stay in the filters.
+        boost::unique_lock<boost::mutex> lock(csNullifierFilters);
+        if (fNullifierFilters) {
+            UpdateNullifierFilter(sproutNullifierFilter, mapSproutNullifiers);
+            UpdateNullifierFilter(saplingNullifierFilter, mapSaplingNullifiers);
+        }
+    }
+
+    // Take over the caller's maps; they are left empty as if written out.
+    std::shared_ptr<CCoinsFlushLayer> flushed = std::make_shared<CCoinsFlushLayer>();
+    flushed->mapCoins.swap(mapCoins);
+    flushed->hashBlock = hashBlock;
+    flushed->hashSproutAnchor = hashSproutAnchor;
+    flushed->hashSaplingAnchor = hashSaplingAnchor;
+    flushed->mapSproutAnchors.swap(mapSproutAnchors);
+    flushed->mapSaplingAnchors.swap(mapSaplingAnchors);
+    flushed->mapSproutNullifiers.swap(mapSproutNullifiers);
+    flushed->mapSaplingNullifiers.swap(mapSaplingNullifiers);
+    {
+        boost::unique_lock<boost::mutex> lock(csStats);
+        if (fRunningStats)
+            statsTotal += statsDelta;
+        if (!hashBlock.IsNull())
+            hashStatsBlock = hashBlock;
+        flushed->fRunningStats = fRunningStats;
+        flushed->hashStatsBlock = hashStatsBlock;
+        flushed->stats = statsTotal;
+    }
+
+    if (!writerThread.joinable())
+        return WriteLayer(*flushed);
+
+    int64_t nStart = GetTimeMicros();
+    boost::unique_lock<boost::mutex> lock(csLayer);
+    while (layer && !fWriteFailed)
+        condLayer.wait(lock);
+    if (fWriteFailed)
+        return false;
+    LogPrint("bench", "    - Wait for previous coin database write: %.2fms\n", 0.001 * (GetTimeMicros() - nStart));
+    layer = flushed;
+    condLayer.notify_all();
+    return true;
+}
+
+namespace {
+
+//! Legacy class to deserialize pre-pertxout database entries without reindex.
+class CCoins
+{
+public:
+    //! whether transaction is a coinbase
+    bool fCoinBase;
+
+    //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
+    std::vector<CTxOut> vout;
+
+    //! at which height this transaction was included in the active block chain
+    int nHeight;
+
+    //! empty constructor
+    CCoins() : fCoinBase(false), vout(0), nHeight(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s) {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy));
+        // header code
+        ::Unserialize(s, VARINT(nCode));
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])));
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight));
+    }
+};
+
+}
+
+/** Upgrade the database from older formats.
+ *
+ * Currently implemented: from one CCoins record per transaction to one
+ * Coin record per unspent transaction output.
+ */
+bool CCoinsViewDB::Upgrade() {
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid()) {
+        return true;
+    }
+
+    int64_t count = 0;
+    LogPrintf("Upgrading utxo-set database...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    size_t batch_size = 1 << 24;
+    CDBBatch batch(db);
+    int reportDone = 0;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
+        std::pair<char, uint256> key;
+        if (pcursor->GetKey(key) && key.first == DB_COINS) {
+            if (count++ % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+                if (reportDone < percentageDone/10) {
+                    // report max. every 10% step
+                    LogPrintf("[%d%%]...", percentageDone);
+                    reportDone = percentageDone/10;
+                }
+            }
+            CCoins old_coins;
+            if (!pcursor->GetValue(old_coins)) {
+                return error("%s: cannot parse CCoins record", __func__);
+            }
+            COutPoint outpoint(key.second, 0);
+            for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+                if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                    Coin newcoin(std::move(old_coins.vout[i]), old_coins.nHeight, old_coins.fCoinBase);
+                    outpoint.n = i;
+                    CoinEntry entry(&outpoint);
+                    batch.Write(entry, newcoin);
+                }
+            }
+            batch.Erase(key);
+            if (batch.SizeEstimate() > batch_size) {
+                if (!db.WriteBatch(batch))
+                    return error("%s: failed to write upgraded coins", __func__);
+                batch.Clear();
+            }
+            pcursor->Next();
+        } else {
+            break;
+        }
+    }
+    if (!db.WriteBatch(batch))
+        return error("%s: failed to write upgraded coins", __func__);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe), cacheSolutions(SOLUTION_CACHE_SIZE) {
+}
+
+bool CBlockTreeDB::ReadBlockSolution(const uint256 &hash, std::vector<unsigned char> &solution) {
+    {
+        boost::unique_lock<boost::mutex> lock(csSolutionCache);
+        if (cacheSolutions.get(hash, solution))
+            return true;
+    }
+
+    CDiskBlockIndex diskindex;
+    if (!Read(make_pair(DB_BLOCK_INDEX, hash), diskindex))
+        return false;
+    solution.swap(diskindex.nSolution);
+
+    boost::unique_lock<boost::mutex> lock(csSolutionCache);
+    cacheSolutions.insert(hash, solution);
+    return true;
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -217,34 +923,46 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 }
 
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
+    // Statistics are computed from the database alone.
+    if (!WaitForWrites())
+        return false;
+
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
-    pcursor->Seek(DB_COINS);
+    pcursor->Seek(DB_COIN);
 
+    // Outputs are stored per outpoint, sorted by txid and output index. They
+    // are grouped back by txid here so that hashSerialized stays the same as
+    // it was with one record per transaction.
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
     CAmount nTotalAmount = 0;
+    CCoinsSetStats setStats;
+    uint256 prevTxid;
+    bool fHaveTx = false;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && key.first == DB_COINS) {
-            if (pcursor->GetValue(coins)) {
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+        COutPoint outpoint;
+        CoinEntry entry(&outpoint);
+        Coin coin;
+        if (pcursor->GetKey(entry) && entry.key == DB_COIN) {
+            if (pcursor->GetValue(coin)) {
+                if (!fHaveTx || outpoint.hash != prevTxid) {
+                    if (fHaveTx)
+                        ss << VARINT(0);
+                    stats.nTransactions++;
+                    prevTxid = outpoint.hash;
+                    fHaveTx = true;
                 }
+                stats.nTransactionOutputs++;
+                ss << VARINT(outpoint.n+1);
+                ss << coin.out;
+                nTotalAmount += coin.out.nValue;
                 stats.nSerializedSize += 32 + pcursor->GetValueSize();
-                ss << VARINT(0);
+                setStats.AddCoin(outpoint, coin);
             } else {
                 return error("CCoinsViewDB::GetStats() : unable to read value");
             }
@@ -253,15 +971,295 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
         }
         pcursor->Next();
     }
+    if (fHaveTx)
+        ss << VARINT(0);
     {
         LOCK(cs_main);
         stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
     }
     stats.hashSerialized = ss.GetHash();
+    setStats.muhash.Finalize(stats.hashMuHash.begin());
     stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
+namespace {
+
+//! Start of every chain state snapshot file
+static const unsigned char SNAPSHOT_MAGIC[4] = {'z', 's', 'n', 'p'};
+
+//! Database records copied into snapshots. Each record in a snapshot starts
+//! with its database prefix, and the records end with a zero byte.
+static const char SNAPSHOT_RECORD_TYPES[] = {
+    DB_COIN,
+    DB_SPROUT_ANCHOR, DB_SPROUT_OMMERS,
+    DB_SAPLING_ANCHOR, DB_SAPLING_OMMERS,
+    DB_NULLIFIER, DB_SAPLING_NULLIFIER,
+};
+static const char SNAPSHOT_END = 0;
+
+//! Size of the database batches a snapshot is loaded with
+static const size_t SNAPSHOT_BATCH_SIZE = 1 << 26;
+
+/** Snapshot file stream that hashes everything written to or read from it */
+class CHashedSnapshotFile
+{
+private:
+    CAutoFile &file;
+    CHashWriter hasher;
+
+public:
+    CHashedSnapshotFile(CAutoFile &fileIn) : file(fileIn), hasher(fileIn.GetType(), fileIn.GetVersion()) {}
+
+    int GetType() const { return file.GetType(); }
+    int GetVersion() const { return file.GetVersion(); }
+
+    void write(const char *pch, size_t nSize)
+    {
+        file.write(pch, nSize);
+        hasher.write(pch, nSize);
+    }
+
+    void read(char *pch, size_t nSize)
+    {
+        file.read(pch, nSize);
+        hasher.write(pch, nSize);
+    }
+
+    void ignore(size_t nSize)
+    {
+        char data[256];
+        while (nSize > 0) {
+            size_t nNow = std::min(nSize, sizeof(data));
+            read(data, nNow);
+            nSize -= nNow;
+        }
+    }
+
+    template<typename T>
+    CHashedSnapshotFile& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj);
+        return *this;
+    }
+
+    template<typename T>
+    CHashedSnapshotFile& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj);
+        return *this;
+    }
+
+    // invalidates the object
+    uint256 GetHash() { return hasher.GetHash(); }
+};
+
+bool ReadSingleRecord(CDBIterator &cursor, char chKey, uint256 &value)
+{
+    cursor.Seek(chKey);
+    char ch;
+    if (!cursor.Valid() || cursor.GetKeySize() != 1 || !cursor.GetKey(ch) || ch != chKey)
+        return false;
+    return cursor.GetValue(value);
+}
+
+}
+
+bool CCoinsViewDB::WriteSnapshot(CAutoFile &file, CChainStateSnapshot &snapshot) const {
+    if (!WaitForWrites())
+        return false;
+
+    // The iterator sees the database as it was when the iterator was
+    // created, so later flushes do not get mixed into the snapshot.
+    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
+    snapshot = CChainStateSnapshot();
+    if (!ReadSingleRecord(*pcursor, DB_BEST_BLOCK, snapshot.hashBlock))
+        return error("%s: no best block in the coin database", __func__);
+    ReadSingleRecord(*pcursor, DB_BEST_SPROUT_ANCHOR, snapshot.hashSproutAnchor);
+    ReadSingleRecord(*pcursor, DB_BEST_SAPLING_ANCHOR, snapshot.hashSaplingAnchor);
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(snapshot.hashBlock);
+        if (it == mapBlockIndex.end())
+            return error("%s: best block %s is not in the block index", __func__, snapshot.hashBlock.ToString());
+        snapshot.nHeight = it->second->nHeight;
+        snapshot.nChainTx = it->second->nChainTx;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    try {
+        CHashedSnapshotFile hashed(file);
+        hashed << FLATDATA(SNAPSHOT_MAGIC) << CHAINSTATE_SNAPSHOT_VERSION << FLATDATA(Params().MessageStart());
+        hashed << snapshot.hashBlock << snapshot.nHeight << snapshot.nChainTx;
+        hashed << snapshot.hashSproutAnchor << snapshot.hashSaplingAnchor;
+
+        for (size_t i = 0; i < sizeof(SNAPSHOT_RECORD_TYPES); i++) {
+            const char chType = SNAPSHOT_RECORD_TYPES[i];
+            for (pcursor->Seek(chType); pcursor->Valid(); pcursor->Next()) {
+                boost::this_thread::interruption_point();
+                char chKey;
+                if (!pcursor->GetKey(chKey) || chKey != chType)
+                    break;
+                hashed << chType;
+                if (chType == DB_COIN) {
+                    COutPoint outpoint;
+                    CoinEntry entry(&outpoint);
+                    Coin coin;
+                    if (!pcursor->GetKey(entry) || !pcursor->GetValue(coin))
+                        return error("%s: unable to read coin", __func__);
+                    hashed << outpoint.hash << VARINT(outpoint.n) << coin;
+                    snapshot.nCoins++;
+                    continue;
+                }
+                std::pair<char, uint256> key;
+                if (!pcursor->GetKey(key))
+                    return error("%s: unable to read key", __func__);
+                hashed << key.second;
+                if (chType == DB_SPROUT_ANCHOR || chType == DB_SAPLING_ANCHOR) {
+                    AnchorRecord record;
+                    if (!pcursor->GetValue(record))
+                        return error("%s: unable to read anchor %s", __func__, key.second.ToString());
+                    hashed << record;
+                    snapshot.nAnchors++;
+                } else if (chType == DB_SPROUT_OMMERS || chType == DB_SAPLING_OMMERS) {
+                    OptionalHashes upper;
+                    CompactOptionalHashes ommers(&upper);
+                    if (!pcursor->GetValue(ommers))
+                        return error("%s: unable to read ommers %s", __func__, key.second.ToString());
+                    hashed << ommers;
+                } else {
+                    snapshot.nNullifiers++;
+                }
+            }
+        }
+        hashed << SNAPSHOT_END;
+        snapshot.hashContents = hashed.GetHash();
+        file << snapshot.hashContents;
+    } catch (const std::exception& e) {
+        return error("%s: %s", __func__, e.what());
+    }
+
+    LogPrintf("Wrote snapshot of block %s with %u coins, %u anchors and %u nullifiers in %dms\n",
+        snapshot.hashBlock.ToString(), snapshot.nCoins, snapshot.nAnchors, snapshot.nNullifiers,
+        GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CCoinsViewDB::ReadSnapshot(CAutoFile &file, CChainStateSnapshot &snapshot, bool fLoad) {
+    // Nullifiers written here are added to the filters, if there are any.
+    boost::unique_lock<boost::mutex> lockFilters(csNullifierFilters, boost::defer_lock);
+    if (fLoad) {
+        lockFilters.lock();
+        if (!WaitForWrites())
+            return false;
+        boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+        for (size_t i = 0; i < sizeof(SNAPSHOT_RECORD_TYPES); i++) {
+            pcursor->Seek(SNAPSHOT_RECORD_TYPES[i]);
+            char chKey;
+            if (pcursor->Valid() && pcursor->GetKey(chKey) && chKey == SNAPSHOT_RECORD_TYPES[i])
+                return error("%s: the coin database is not empty", __func__);
+        }
+    }
+
+    int64_t nStart = GetTimeMillis();
+    snapshot = CChainStateSnapshot();
+    CDBBatch batch(db);
+    CCoinsSetStats stats;
+    uint256 hashContents;
+    try {
+        CHashedSnapshotFile hashed(file);
+        unsigned char pchMagic[sizeof(SNAPSHOT_MAGIC)];
+        int nVersion = 0;
+        hashed >> FLATDATA(pchMagic) >> nVersion;
+        if (memcmp(pchMagic, SNAPSHOT_MAGIC, sizeof(pchMagic)) != 0)
+            return error("%s: not a chain state snapshot", __func__);
+        if (nVersion != CHAINSTATE_SNAPSHOT_VERSION)
+            return error("%s: unsupported snapshot version %d", __func__, nVersion);
+        CMessageHeader::MessageStartChars pchMessageStart;
+        hashed >> FLATDATA(pchMessageStart);
+        if (memcmp(pchMessageStart, Params().MessageStart(), sizeof(pchMessageStart)) != 0)
+            return error("%s: snapshot of another network", __func__);
+        hashed >> snapshot.hashBlock >> snapshot.nHeight >> snapshot.nChainTx;
+        hashed >> snapshot.hashSproutAnchor >> snapshot.hashSaplingAnchor;
+
+        while (true) {
+            boost::this_thread::interruption_point();
+            char chType;
+            hashed >> chType;
+            if (chType == SNAPSHOT_END)
+                break;
+            if (chType == DB_COIN) {
+                COutPoint outpoint;
+                Coin coin;
+                hashed >> outpoint.hash >> VARINT(outpoint.n) >> coin;
+                if (fLoad) {
+                    batch.Write(CoinEntry(&outpoint), coin);
+                    stats.AddCoin(outpoint, coin);
+                }
+                snapshot.nCoins++;
+            } else if (chType == DB_SPROUT_ANCHOR || chType == DB_SAPLING_ANCHOR) {
+                uint256 rt;
+                AnchorRecord record;
+                hashed >> rt >> record;
+                if (fLoad)
+                    batch.Write(make_pair(chType, rt), record);
+                snapshot.nAnchors++;
+            } else if (chType == DB_SPROUT_OMMERS || chType == DB_SAPLING_OMMERS) {
+                uint256 hash;
+                OptionalHashes upper;
+                CompactOptionalHashes ommers(&upper);
+                hashed >> hash >> ommers;
+                if (fLoad)
+                    batch.Write(make_pair(chType, hash), ommers);
+            } else if (chType == DB_NULLIFIER || chType == DB_SAPLING_NULLIFIER) {
+                uint256 nf;
+                hashed >> nf;
+                if (fLoad) {
+                    batch.Write(make_pair(chType, nf), true);
+                    if (fNullifierFilters)
+                        (chType == DB_NULLIFIER ? sproutNullifierFilter : saplingNullifierFilter).insert(nf);
+                }
+                snapshot.nNullifiers++;
+            } else {
+                return error("%s: unknown record type %d", __func__, chType);
+            }
+            if (batch.SizeEstimate() > SNAPSHOT_BATCH_SIZE) {
+                if (!db.WriteBatch(batch))
+                    return error("%s: failed to write snapshot records", __func__);
+                batch.Clear();
+            }
+        }
+        hashContents = hashed.GetHash();
+        file >> snapshot.hashContents;
+    } catch (const std::exception& e) {
+        return error("%s: %s", __func__, e.what());
+    }
+    if (hashContents != snapshot.hashContents)
+        return error("%s: snapshot contents do not match their hash", __func__);
+
+    if (fLoad) {
+        // Only now does the database hold the chain state of the snapshot.
+        batch.Write(DB_BEST_BLOCK, snapshot.hashBlock);
+        if (!snapshot.hashSproutAnchor.IsNull())
+            batch.Write(DB_BEST_SPROUT_ANCHOR, snapshot.hashSproutAnchor);
+        if (!snapshot.hashSaplingAnchor.IsNull())
+            batch.Write(DB_BEST_SAPLING_ANCHOR, snapshot.hashSaplingAnchor);
+        batch.Write(DB_COINS_STATS, make_pair(snapshot.hashBlock, stats));
+        if (!db.WriteBatch(batch, true))
+            return error("%s: failed to write snapshot records", __func__);
+        {
+            boost::unique_lock<boost::mutex> lock(csStats);
+            fRunningStats = true;
+            hashStatsBlock = snapshot.hashBlock;
+            statsTotal = stats;
+        }
+        LogPrintf("Loaded snapshot of block %s with %u coins, %u anchors and %u nullifiers in %dms\n",
+            snapshot.hashBlock.ToString(), snapshot.nCoins, snapshot.nAnchors, snapshot.nNullifiers,
+            GetTimeMillis() - nStart);
+    }
+    return true;
+}
+
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
     CDBBatch batch(*this);
     for (std::vector<std::pair<int, const CBlockFileInfo*> >::const_iterator it=fileInfo.begin(); it != fileInfo.end(); it++) {
@@ -305,56 +1303,209 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+bool CBlockTreeDB::WriteSnapshotBlock(const uint256 &hash, uint64_t nChainTx) {
+    return Write(DB_SNAPSHOT_BLOCK, std::make_pair(hash, nChainTx), true);
+}
+
+bool CBlockTreeDB::ReadSnapshotBlock(uint256 &hash, uint64_t &nChainTx) {
+    std::pair<uint256, uint64_t> value;
+    if (!Read(DB_SNAPSHOT_BLOCK, value))
+        return false;
+    hash = value.first;
+    nChainTx = value.second;
+    return true;
+}
+
+namespace {
+
+//! Number of block index entries decoded together by a -par thread
+static const size_t BLOCK_INDEX_LOAD_BATCH = 1000;
+
+/** Raw block index entries, decoded and checked away from the thread reading the database. */
+struct CBlockIndexLoadBatch
+{
+    std::vector<uint256> vHash;
+    std::vector<std::vector<char> > vRaw;
+    std::vector<CDiskBlockIndex> vIndex;
+    //! Empty unless an entry failed to decode or check
+    std::string strError;
+    bool fDone;
+
+    CBlockIndexLoadBatch() : fDone(false) {}
+
+    void Decode()
+    {
+        const Consensus::Params& consensusParams = Params().GetConsensus();
+        vIndex.resize(vRaw.size());
+        for (size_t i = 0; i < vRaw.size(); i++) {
+            CDiskBlockIndex& diskindex = vIndex[i];
+            try {
+                CDataStream ssValue(vRaw[i].data(), vRaw[i].data() + vRaw[i].size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> diskindex;
+            } catch (const std::exception&) {
+                strError = "LoadBlockIndex() : failed to read value";
+                return;
+            }
+            std::vector<char>().swap(vRaw[i]);
+
+            // Consistency checks
+            uint256 hash = diskindex.GetBlockHash();
+            if (hash != vHash[i]) {
+                strError = strprintf("LoadBlockIndex(): block header inconsistency detected: key = %s, on-disk = %s",
+                    vHash[i].ToString(), hash.ToString());
+                return;
+            }
+            if (!CheckProofOfWork(hash, diskindex.nBits, consensusParams)) {
+                strError = strprintf("LoadBlockIndex(): CheckProofOfWork failed: %s", hash.ToString());
+                return;
+            }
+        }
+    }
+};
+
+/**
+ * Decodes batches of block index entries on the -par threads, in any order.
+ * Without -par threads, batches are decoded as they are pushed.
+ */
+class CBlockIndexLoader
+{
+private:
+    boost::mutex cs;
+    boost::condition_variable cond;
+    //! Number of pushed batches that are not decoded yet
+    int nPending;
+
+    void Decode(const std::shared_ptr<CBlockIndexLoadBatch>& batch)
+    {
+        batch->Decode();
+        boost::unique_lock<boost::mutex> lock(cs);
+        batch->fDone = true;
+        nPending--;
+        cond.notify_all();
+    }
+
+public:
+    CBlockIndexLoader() : nPending(0) {}
+
+    ~CBlockIndexLoader()
+    {
+        // The jobs still queued refer to this loader
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (nPending > 0)
+            cond.wait(lock);
+    }
+
+    void Push(const std::shared_ptr<CBlockIndexLoadBatch>& batch)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            nPending++;
+        }
+        if (!QueueCheckJob(std::bind(&CBlockIndexLoader::Decode, this, batch)))
+            Decode(batch);
+    }
+
+    bool IsDone(const CBlockIndexLoadBatch& batch)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        return batch.fDone;
+    }
+
+    void Wait(const CBlockIndexLoadBatch& batch)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (!batch.fDone)
+            cond.wait(lock);
+    }
+};
+
+}
+
+/** Wait for a batch to be decoded, and add its entries to mapBlockIndex. */
+static bool LoadBlockIndexBatch(CBlockIndexLoader& loader, CBlockIndexLoadBatch& batch)
+{
+    loader.Wait(batch);
+    if (!batch.strError.empty())
+        return error("%s", batch.strError);
+
+    for (size_t i = 0; i < batch.vIndex.size(); i++) {
+        CDiskBlockIndex& diskindex = batch.vIndex[i];
+        // Construct block index object
+        CBlockIndex* pindexNew = InsertBlockIndex(batch.vHash[i]);
+        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+        pindexNew->nHeight        = diskindex.nHeight;
+        pindexNew->nFile          = diskindex.nFile;
+        pindexNew->nDataPos       = diskindex.nDataPos;
+        pindexNew->nUndoPos       = diskindex.nUndoPos;
+        pindexNew->hashSproutAnchor     = diskindex.hashSproutAnchor;
+        pindexNew->nVersion       = diskindex.nVersion;
+        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+        pindexNew->hashFinalSaplingRoot   = diskindex.hashFinalSaplingRoot;
+        pindexNew->nTime          = diskindex.nTime;
+        pindexNew->nBits          = diskindex.nBits;
+        pindexNew->nNonce         = diskindex.nNonce;
+        pindexNew->nStatus        = diskindex.nStatus;
+        pindexNew->nCachedBranchId = diskindex.nCachedBranchId;
+        pindexNew->nTx            = diskindex.nTx;
+        pindexNew->nSproutValue   = diskindex.nSproutValue;
+        pindexNew->nSaplingValue  = diskindex.nSaplingValue;
+
+        // Once its scripts are checked, the solution is only needed to serve
+        // full headers, which read it back through ReadBlockSolution(). Entries
+        // that will still be written again keep it, so writing them does not
+        // read it back.
+        if (pindexNew->IsValid(BLOCK_VALID_SCRIPTS))
+            pindexNew->TrimSolution();
+        else
+            pindexNew->nSolution.swap(diskindex.nSolution);
+    }
+    return true;
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
 
+    // Entries are decoded and checked on the -par threads while the database
+    // is read, then added to mapBlockIndex in order on this thread.
+    CBlockIndexLoader loader;
+    std::deque<std::shared_ptr<CBlockIndexLoadBatch> > vInFlight;
+    const size_t nMaxInFlight = 4 * std::max(nScriptCheckThreads, 1);
+    std::shared_ptr<CBlockIndexLoadBatch> batch = std::make_shared<CBlockIndexLoadBatch>();
+
     pcursor->Seek(make_pair(DB_BLOCK_INDEX, uint256()));
 
     // Load mapBlockIndex
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         std::pair<char, uint256> key;
-        if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
-            CDiskBlockIndex diskindex;
-            if (pcursor->GetValue(diskindex)) {
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->hashSproutAnchor     = diskindex.hashSproutAnchor;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->hashFinalSaplingRoot   = diskindex.hashFinalSaplingRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nSolution      = diskindex.nSolution;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nCachedBranchId = diskindex.nCachedBranchId;
-                pindexNew->nTx            = diskindex.nTx;
-                pindexNew->nSproutValue   = diskindex.nSproutValue;
-                pindexNew->nSaplingValue  = diskindex.nSaplingValue;
-
-                // Consistency checks
-                auto header = pindexNew->GetBlockHeader();
-                if (header.GetHash() != pindexNew->GetBlockHash())
-                    return error("LoadBlockIndex(): block header inconsistency detected: on-disk = %s, in-memory = %s",
-                       diskindex.ToString(),  pindexNew->ToString());
-                if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
-                    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
-
-                pcursor->Next();
-            } else {
-                return error("LoadBlockIndex() : failed to read value");
-            }
-        } else {
+        if (!pcursor->GetKey(key) || key.first != DB_BLOCK_INDEX)
             break;
+        batch->vHash.push_back(key.second);
+        batch->vRaw.push_back(std::vector<char>());
+        pcursor->GetValueRaw(batch->vRaw.back());
+        pcursor->Next();
+
+        if (batch->vRaw.size() == BLOCK_INDEX_LOAD_BATCH) {
+            loader.Push(batch);
+            vInFlight.push_back(batch);
+            batch = std::make_shared<CBlockIndexLoadBatch>();
+            // Add the batches decoded so far, without letting them pile up.
+            while (!vInFlight.empty() && (vInFlight.size() > nMaxInFlight || loader.IsDone(*vInFlight.front()))) {
+                if (!LoadBlockIndexBatch(loader, *vInFlight.front()))
+                    return false;
+                vInFlight.pop_front();
+            }
         }
     }
+    if (!batch->vRaw.empty()) {
+        loader.Push(batch);
+        vInFlight.push_back(batch);
+    }
+    for (; !vInFlight.empty(); vInFlight.pop_front()) {
+        if (!LoadBlockIndexBatch(loader, *vInFlight.front()))
+            return false;
+    }
 
     return true;
 }
@@ -8,12 +8,19 @@
 
 #include "coins.h"
 #include "dbwrapper.h"
+#include "lrucache.h"
 
 #include <map>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+class CAutoFile;
 class CBlockFileInfo;
 class CBlockIndex;
 struct CDiskTxPos;
@@ -25,21 +32,145 @@ static const int64_t nDefaultDbCache = 450;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -dbbackgroundflush default
+static const bool DEFAULT_DB_BACKGROUND_FLUSH = true;
+//! Number of deserialized anchors of each type kept in memory by CCoinsViewDB
+static const size_t ANCHOR_CACHE_SIZE = 1000;
+//! Number of block solutions read back from disk kept in memory by CBlockTreeDB
+static const size_t SOLUTION_CACHE_SIZE = 4000;
+
+/**
+ * Bloom filter over the nullifiers of one type in the coin database. Nearly
+ * every nullifier looked up is new, and the filter answers those without
+ * reading the database. It grows by adding a stage twice the size of the
+ * last one when that is full, and it never forgets a nullifier: one erased
+ * by a disconnect only costs a database read from then on.
+ */
+class CNullifierFilter
+{
+private:
+    struct Stage {
+        std::vector<uint64_t> vBits;
+        size_t nElements;
+        size_t nCapacity;
+    };
+    std::vector<Stage> stages;
+    uint256 salt;
+
+    void AddStage(size_t nCapacity);
+
+public:
+    explicit CNullifierFilter(size_t nExpected = 0);
+
+    void insert(const uint256 &nf);
+    //! Returns false only if nf was never inserted
+    bool contains(const uint256 &nf) const;
+    size_t size() const;
+    size_t DynamicMemoryUsage() const;
+};
+
+//! Version of the chain state snapshot format written by dumpchainstate
+static const int CHAINSTATE_SNAPSHOT_VERSION = 1;
+
+/**
+ * Description of a chain state snapshot: the block it was taken at, the
+ * number of records of each kind it holds, and the hash committing to its
+ * whole contents.
+ */
+struct CChainStateSnapshot
+{
+    uint256 hashBlock;
+    int nHeight;
+    uint64_t nChainTx;
+    uint256 hashSproutAnchor;
+    uint256 hashSaplingAnchor;
+    uint64_t nCoins;
+    uint64_t nAnchors;
+    uint64_t nNullifiers;
+    uint256 hashContents;
+
+    CChainStateSnapshot() : nHeight(0), nChainTx(0), nCoins(0), nAnchors(0), nNullifiers(0) {}
+};
 
-/** CCoinsView backed by the coin database (chainstate/) */
+/**
+ * CCoinsView backed by the coin database (chainstate/)
+ *
+ * Once background writes are started, BatchWrite only takes over the flushed
+ * cache contents as an immutable layer and returns; the layer is written to
+ * the database by a separate thread. Lookups check the layer before the
+ * database until it has been written, and a further BatchWrite waits for the
+ * previous layer to be written first.
+ *
+ * Anchors are stored as the frontier of their tree. The upper ommers, which
+ * consecutive anchors mostly have in common, are stored once in a record of
+ * their own.
+ *
+ * After LoadNullifierFilters, nullifiers missing from the database are
+ * recognized in memory; BatchWrite keeps the filters up to date.
+ *
+ * After LoadRunningStats, the running totals over the coins are written
+ * along with the best block on every flush.
+ */
 class CCoinsViewDB : public CCoinsView
 {
+private:
+    /** Cache contents handed to BatchWrite, kept as they were flushed */
+    struct CCoinsFlushLayer {
+        CCoinsMap mapCoins;
+        uint256 hashBlock;
+        uint256 hashSproutAnchor;
+        uint256 hashSaplingAnchor;
+        CAnchorsSproutMap mapSproutAnchors;
+        CAnchorsSaplingMap mapSaplingAnchors;
+        CNullifiersMap mapSproutNullifiers;
+        CNullifiersMap mapSaplingNullifiers;
+        bool fRunningStats;
+        uint256 hashStatsBlock;
+        CCoinsSetStats stats;
+    };
+
+    mutable boost::mutex csLayer;
+    mutable boost::condition_variable condLayer;
+    //! Layer waiting to be written or being written, if any
+    std::shared_ptr<const CCoinsFlushLayer> layer;
+    //! Whether writing a layer failed; the layer is then kept for lookups
+    bool fWriteFailed;
+    bool fStopWriter;
+    boost::thread writerThread;
+
+    //! Recently used or written anchors, by root
+    mutable boost::mutex csAnchorCache;
+    mutable lrucache<uint256, SproutMerkleTree, CCoinsKeyHasher> cacheSproutAnchors;
+    mutable lrucache<uint256, SaplingMerkleTree, CCoinsKeyHasher> cacheSaplingAnchors;
+
+    //! Filters over the database nullifiers, once loaded
+    mutable boost::mutex csNullifierFilters;
+    bool fNullifierFilters;
+    CNullifierFilter sproutNullifierFilter;
+    CNullifierFilter saplingNullifierFilter;
+
+    //! Running totals over the coins as of hashStatsBlock, once loaded
+    mutable boost::mutex csStats;
+    bool fRunningStats;
+    uint256 hashStatsBlock;
+    CCoinsSetStats statsTotal;
+
+    std::shared_ptr<const CCoinsFlushLayer> GetLayer() const;
+    bool WriteLayer(const CCoinsFlushLayer &flushed);
+    void ThreadWriter();
+
 protected:
     CDBWrapper db;
     CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CCoinsViewDB();
 
     bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const;
     bool GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const;
     bool GetNullifier(const uint256 &nf, ShieldedType type) const;
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
     uint256 GetBestAnchor(ShieldedType type) const;
     bool BatchWrite(CCoinsMap &mapCoins,
@@ -49,8 +180,38 @@ public:
                     CAnchorsSproutMap &mapSproutAnchors,
                     CAnchorsSaplingMap &mapSaplingAnchors,
                     CNullifiersMap &mapSproutNullifiers,
-                    CNullifiersMap &mapSaplingNullifiers);
+                    CNullifiersMap &mapSaplingNullifiers,
+                    const CCoinsSetStats &statsDelta);
     bool GetStats(CCoinsStats &stats) const;
+    bool GetRunningStats(CCoinsSetStats &stats) const;
+
+    //! Attempt to update from an older database format. Returns false on error or when interrupted.
+    bool Upgrade();
+
+    //! Write flushed caches to the database on a background thread from now on.
+    void StartBackgroundWrites();
+    //! Wait until all flushed caches are written. Returns false if a write failed.
+    bool WaitForWrites() const;
+
+    //! Read all nullifiers into in-memory filters, so that lookups of new ones skip the database.
+    bool LoadNullifierFilters();
+
+    //! Read the running totals over the coins, computing them from all coins if they are missing or out of date.
+    bool LoadRunningStats();
+
+    /**
+     * Write the coins, anchors and nullifiers in the database, as of the
+     * last flush, to a snapshot file. Fills in snapshot.
+     */
+    bool WriteSnapshot(CAutoFile &file, CChainStateSnapshot &snapshot) const;
+    /**
+     * Read a snapshot file and check it against its commitment, filling in
+     * snapshot. With fLoad, also write its contents to the database, which
+     * must not hold any coins, anchors or nullifiers yet; the best block and
+     * the running totals are only set once the whole snapshot has been
+     * written.
+     */
+    bool ReadSnapshot(CAutoFile &file, CChainStateSnapshot &snapshot, bool fLoad);
 };
 
 /** Access to the block database (blocks/index/) */
@@ -61,6 +222,10 @@ public:
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
+
+    //! Recently read solutions of trimmed block index entries, by block hash
+    boost::mutex csSolutionCache;
+    lrucache<uint256, std::vector<unsigned char>, CCoinsKeyHasher> cacheSolutions;
 public:
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
     bool EraseBatchSync(const std::vector<const CBlockIndex*>& blockinfo);
@@ -72,7 +237,11 @@ public:
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    bool WriteSnapshotBlock(const uint256 &hash, uint64_t nChainTx);
+    bool ReadSnapshotBlock(uint256 &hash, uint64_t &nChainTx);
     bool LoadBlockIndexGuts();
+    //! Read the Equihash solution of an indexed block, which CBlockIndex drops from memory
+    bool ReadBlockSolution(const uint256 &hash, std::vector<unsigned char> &solution);
 };
 
 #endif // BITCOIN_TXDB_H
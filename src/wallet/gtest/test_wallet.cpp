@@ -115,7 +115,7 @@ std::pair<JSOutPoint, SaplingOutPoint> CreateValidBlock(TestWallet& wallet,
     auto saplingNotes = SetSaplingNoteData(wtx);
     wallet.AddToWallet(wtx, true, NULL);
 
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     wallet.IncrementNoteWitnesses(&index, &block, sproutTree, saplingTree);
 
     return std::make_pair(jsoutpt, saplingNotes[0]);
@@ -200,7 +200,7 @@ TEST(WalletTests, FindUnspentSproutNotes) {
     // Fake-mine the transaction
     EXPECT_EQ(-1, chainActive.Height());
     CBlock block;
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     block.hashMerkleRoot = block.BuildMerkleTree();
     auto blockHash = block.GetHash();
     CBlockIndex fakeIndex {block};
@@ -237,7 +237,7 @@ TEST(WalletTests, FindUnspentSproutNotes) {
     // Fake-mine a spend transaction
     EXPECT_EQ(0, chainActive.Height());
     CBlock block2;
-    block2.vtx.push_back(wtx2);
+    block2.vtx.push_back(MakeTransactionRef(wtx2));
     block2.hashMerkleRoot = block2.BuildMerkleTree();
     block2.hashPrevBlock = blockHash;
     auto blockHash2 = block2.GetHash();
@@ -296,7 +296,7 @@ TEST(WalletTests, FindUnspentSproutNotes) {
     // Fake-mine the new transaction
     EXPECT_EQ(1, chainActive.Height());
     CBlock block3;
-    block3.vtx.push_back(wtx3);
+    block3.vtx.push_back(MakeTransactionRef(wtx3));
     block3.hashMerkleRoot = block3.BuildMerkleTree();
     block3.hashPrevBlock = blockHash2;
     auto blockHash3 = block3.GetHash();
@@ -654,7 +654,7 @@ TEST(WalletTests, GetConflictedSaplingNotes) {
     EXPECT_EQ(-1, chainActive.Height());
     SproutMerkleTree sproutTree;
     CBlock block;
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     block.hashMerkleRoot = block.BuildMerkleTree();
     auto blockHash = block.GetHash();
     CBlockIndex fakeIndex {block};
@@ -764,7 +764,7 @@ TEST(WalletTests, SproutNullifierIsSpent) {
     // Fake-mine the transaction
     EXPECT_EQ(-1, chainActive.Height());
     CBlock block;
-    block.vtx.push_back(wtx2);
+    block.vtx.push_back(MakeTransactionRef(wtx2));
     block.hashMerkleRoot = block.BuildMerkleTree();
     auto blockHash = block.GetHash();
     CBlockIndex fakeIndex {block};
@@ -829,7 +829,7 @@ TEST(WalletTests, SaplingNullifierIsSpent) {
     // Fake-mine the transaction
     EXPECT_EQ(-1, chainActive.Height());
     CBlock block;
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     block.hashMerkleRoot = block.BuildMerkleTree();
     auto blockHash = block.GetHash();
     CBlockIndex fakeIndex {block};
@@ -927,7 +927,7 @@ TEST(WalletTests, NavigateFromSaplingNullifierToNote) {
     EXPECT_EQ(-1, chainActive.Height());
     SproutMerkleTree sproutTree;
     CBlock block;
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     block.hashMerkleRoot = block.BuildMerkleTree();
     auto blockHash = block.GetHash();
     CBlockIndex fakeIndex {block};
@@ -1055,7 +1055,7 @@ TEST(WalletTests, SpentSaplingNoteIsFromMe) {
     EXPECT_EQ(-1, chainActive.Height());
     SproutMerkleTree sproutTree;
     CBlock block;
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     block.hashMerkleRoot = block.BuildMerkleTree();
     auto blockHash = block.GetHash();
     CBlockIndex fakeIndex {block};
@@ -1130,7 +1130,7 @@ TEST(WalletTests, SpentSaplingNoteIsFromMe) {
     // Fake-mine this tx into the next block
     EXPECT_EQ(0, chainActive.Height());
     CBlock block2;
-    block2.vtx.push_back(wtx2);
+    block2.vtx.push_back(MakeTransactionRef(wtx2));
     block2.hashMerkleRoot = block2.BuildMerkleTree();
     block2.hashPrevBlock = blockHash;
     auto blockHash2 = block2.GetHash();
@@ -1206,7 +1206,7 @@ TEST(WalletTests, CachedWitnessesEmptyChain) {
     EXPECT_FALSE((bool) saplingWitnesses[0]);
 
     CBlock block;
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     CBlockIndex index(block);
     SproutMerkleTree sproutTree;
     SaplingMerkleTree saplingTree;
@@ -1275,7 +1275,7 @@ TEST(WalletTests, CachedWitnessesChainTip) {
         // Second block
         CBlock block2;
         block2.hashPrevBlock = block1.GetHash();
-        block2.vtx.push_back(wtx);
+        block2.vtx.push_back(MakeTransactionRef(wtx));
         CBlockIndex index2(block2);
         index2.nHeight = 2;
         SproutMerkleTree sproutTree2 {sproutTree};
@@ -1759,7 +1759,7 @@ TEST(WalletTests, UpdatedSaplingNoteData) {
     EXPECT_EQ(-1, chainActive.Height());
     SproutMerkleTree sproutTree;
     CBlock block;
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     block.hashMerkleRoot = block.BuildMerkleTree();
     auto blockHash = block.GetHash();
     CBlockIndex fakeIndex {block};
@@ -1913,7 +1913,7 @@ TEST(WalletTests, MarkAffectedSaplingTransactionsDirty) {
     SaplingMerkleTree saplingTree;
     SproutMerkleTree sproutTree;
     CBlock block;
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     block.hashMerkleRoot = block.BuildMerkleTree();
     auto blockHash = block.GetHash();
     CBlockIndex fakeIndex {block};
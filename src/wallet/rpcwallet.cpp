@@ -6,6 +6,7 @@
 #include "amount.h"
 #include "consensus/upgrades.h"
 #include "core_io.h"
+#include "crypto/equihash_bucket.h"
 #include "init.h"
 #include "key_io.h"
 #include "main.h"
@@ -2755,11 +2756,16 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
 
     if (fHelp || params.size() < 2) {
         throw runtime_error(
-            "zcbenchmark benchmarktype samplecount\n"
+            "zcbenchmark benchmarktype samplecount ( arg )\n"
             "\n"
             "Runs a benchmark of the selected type samplecount times,\n"
             "returning the running times of each sample.\n"
             "\n"
+            "For verifysaplingspend and verifysaplingoutput, the optional arg is\n"
+            "a number of threads: each sample then runs that many verifications\n"
+            "at the same time, one per thread, and returns the running time of\n"
+            "each of them.\n"
+            "\n"
             "Output: [\n"
             "  {\n"
             "    \"runningtime\": runningtime\n"
@@ -2784,6 +2790,10 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
     std::vector<double> sample_times;
 
     JSDescription samplejoinsplit;
+#ifdef ENABLE_MINING
+    // Shared by all samples, like the per-thread solver of the miner
+    std::unique_ptr<EquihashBucketSolver<192,7>> bucketSolver;
+#endif
 
     if (benchmarktype == "verifyjoinsplit") {
         CDataStream ss(ParseHexV(params[2].get_str(), "js"), SER_NETWORK, SAPLING_TX_VERSION | (1 << 31));
@@ -2816,9 +2826,20 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
                 std::vector<double> vals = benchmark_solve_equihash_threaded(nThreads);
                 sample_times.insert(sample_times.end(), vals.begin(), vals.end());
             }
+        } else if (benchmarktype == "solveequihashbucket") {
+            if (!bucketSolver) {
+                int nSolverThreads = params.size() < 3 ? 1 : params[2].get_int();
+                if (nSolverThreads <= 0) {
+                    throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid number of solver threads");
+                }
+                bucketSolver.reset(new EquihashBucketSolver<192,7>(nSolverThreads));
+            }
+            sample_times.push_back(benchmark_solve_equihash(bucketSolver.get()));
 #endif
         } else if (benchmarktype == "verifyequihash") {
             sample_times.push_back(benchmark_verify_equihash());
+        } else if (benchmarktype == "verifyinvalidequihash") {
+            sample_times.push_back(benchmark_verify_invalid_equihash());
         } else if (benchmarktype == "validatelargetx") {
             // Number of inputs in the spending transaction that we will simulate
             int nInputs = 11130;
@@ -2837,6 +2858,13 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
                 throw JSONRPCError(RPC_TYPE_ERROR, "Benchmark must be run in regtest mode");
             }
             sample_times.push_back(benchmark_connectblock_slow());
+        } else if (benchmarktype == "coinscache" || benchmarktype == "coinscacheunordered") {
+            // Compares the coins cache map with the boost::unordered_map it replaced
+            int nCoins = 1000000;
+            if (params.size() >= 3) {
+                nCoins = params[2].get_int();
+            }
+            sample_times.push_back(benchmark_coins_cache(nCoins, benchmarktype == "coinscacheunordered"));
         } else if (benchmarktype == "sendtoaddress") {
             if (Params().NetworkIDString() != "regtest") {
                 throw JSONRPCError(RPC_TYPE_ERROR, "Benchmark must be run in regtest mode");
@@ -2855,9 +2883,28 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
         } else if (benchmarktype == "createsaplingoutput") {
             sample_times.push_back(benchmark_create_sapling_output());
         } else if (benchmarktype == "verifysaplingspend") {
-            sample_times.push_back(benchmark_verify_sapling_spend());
+            if (params.size() < 3) {
+                sample_times.push_back(benchmark_verify_sapling_spend());
+            } else {
+                // The time of each of nThreads verifications run on their own threads
+                int nThreads = params[2].get_int();
+                if (nThreads <= 0) {
+                    throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid number of threads");
+                }
+                std::vector<double> vals = benchmark_verify_sapling_spend_threaded(nThreads);
+                sample_times.insert(sample_times.end(), vals.begin(), vals.end());
+            }
         } else if (benchmarktype == "verifysaplingoutput") {
-            sample_times.push_back(benchmark_verify_sapling_output());
+            if (params.size() < 3) {
+                sample_times.push_back(benchmark_verify_sapling_output());
+            } else {
+                int nThreads = params[2].get_int();
+                if (nThreads <= 0) {
+                    throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid number of threads");
+                }
+                std::vector<double> vals = benchmark_verify_sapling_output_threaded(nThreads);
+                sample_times.insert(sample_times.end(), vals.begin(), vals.end());
+            }
         } else {
             throw JSONRPCError(RPC_TYPE_ERROR, "Invalid benchmarktype");
         }
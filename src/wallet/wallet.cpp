@@ -1053,13 +1053,16 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
     }
 
     const CBlock* pblock {pblockIn};
-    CBlock block;
+    std::shared_ptr<const CBlock> pblockRead;
     if (!pblock) {
-        ReadBlockFromDisk(block, pindex);
-        pblock = &block;
+        pblockRead = ReadBlockFromDiskCached(pindex);
+        if (!pblockRead)
+            pblockRead = std::make_shared<const CBlock>();
+        pblock = pblockRead.get();
     }
 
-    for (const CTransaction& tx : pblock->vtx) {
+    for (const CTransactionRef& ptx : pblock->vtx) {
+        const CTransaction& tx = *ptx;
         auto hash = tx.GetHash();
         bool txIsOurs = mapWallet.count(hash);
         // Sprout
@@ -1414,7 +1417,8 @@ void CWallet::UpdateSaplingNullifierNoteMapWithTx(CWalletTx& wtx) {
 void CWallet::UpdateSaplingNullifierNoteMapForBlock(const CBlock *pblock) {
     LOCK(cs_wallet);
 
-    for (const CTransaction& tx : pblock->vtx) {
+    for (const CTransactionRef& ptx : pblock->vtx) {
+        const CTransaction& tx = *ptx;
         auto hash = tx.GetHash();
         bool txIsOurs = mapWallet.count(hash);
         if (txIsOurs) {
@@ -2338,11 +2342,14 @@ void CWallet::WitnessNoteCommitment(std::vector<uint256> commitments,
     SproutMerkleTree tree;
 
     while (pindex) {
-        CBlock block;
-        ReadBlockFromDisk(block, pindex);
+        // Old blocks are read once; do not let them push recent blocks out of the cache.
+        std::shared_ptr<const CBlock> pblock = ReadBlockFromDiskCached(pindex, false);
+        if (!pblock)
+            pblock = std::make_shared<const CBlock>();
 
-        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        BOOST_FOREACH(const CTransactionRef& ptx, pblock->vtx)
         {
+            const CTransaction& tx = *ptx;
             BOOST_FOREACH(const JSDescription& jsdesc, tx.vjoinsplit)
             {
                 BOOST_FOREACH(const uint256 &note_commitment, jsdesc.commitments)
@@ -2426,11 +2433,14 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
                 ShowProgress(_("Rescanning..."), (int)(*dRescanProgress));
             }
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            // Old blocks are read once; do not let them push recent blocks out of the cache.
+            std::shared_ptr<const CBlock> pblock = ReadBlockFromDiskCached(pindex, false);
+            if (!pblock)
+                pblock = std::make_shared<const CBlock>();
+            BOOST_FOREACH(const CTransactionRef& ptx, pblock->vtx)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate)) {
+                const CTransaction& tx = *ptx;
+                if (AddToWalletIfInvolvingMe(tx, pblock.get(), fUpdate)) {
                     myTxHashes.push_back(tx.GetHash());
                     ret++;
                 }
@@ -2447,7 +2457,7 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
                 }
             }
             // Increment note witness caches
-            ChainTip(pindex, &block, sproutTree, saplingTree, true);
+            ChainTip(pindex, pblock.get(), sproutTree, saplingTree, true);
 
             pindex = chainActive.Next(pindex);
             if (GetTime() >= nNow + 60) {
@@ -4401,7 +4411,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock& block)
 
     // Locate the transaction
     for (nIndex = 0; nIndex < (int)block.vtx.size(); nIndex++)
-        if (block.vtx[nIndex] == *(CTransaction*)this)
+        if (*block.vtx[nIndex] == *(CTransaction*)this)
             break;
     if (nIndex == (int)block.vtx.size())
     {
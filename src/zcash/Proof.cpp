@@ -5,6 +5,7 @@
 #include <boost/static_assert.hpp>
 #include <libsnark/common/default_types/r1cs_ppzksnark_pp.hpp>
 #include <libsnark/zk_proof_systems/ppzksnark/r1cs_ppzksnark/r1cs_ppzksnark.hpp>
+#include <map>
 #include <mutex>
 
 using namespace libsnark;
@@ -16,6 +17,8 @@ typedef alt_bn128_pp::GT_type curve_GT;
 typedef alt_bn128_pp::Fp_type curve_Fr;
 typedef alt_bn128_pp::Fq_type curve_Fq;
 typedef alt_bn128_pp::Fqe_type curve_Fq2;
+typedef alt_bn128_pp::G1_precomp_type curve_G1_precomp;
+typedef alt_bn128_pp::G2_precomp_type curve_G2_precomp;
 
 BOOST_STATIC_ASSERT(sizeof(mp_limb_t) == 8);
 
@@ -223,6 +226,29 @@ void initialize_curve_params()
     std::call_once (init_public_params_once_flag, curve_pp::init_public_params);
 }
 
+// A PHGR proof whose pairing checks were deferred by a batch verifier.
+// The verification keys are not copied, and must outlive the batch.
+struct PHGRBatchEntry {
+    const r1cs_ppzksnark_verification_key<curve_pp>* vk;
+    const r1cs_ppzksnark_processed_verification_key<curve_pp>* pvk;
+    r1cs_primary_input<curve_Fr> primary_input;
+    r1cs_ppzksnark_proof<curve_pp> proof;
+    // The primary input encoded by the IC query
+    curve_G1 acc;
+};
+
+struct PHGRProofBatch {
+    std::vector<PHGRBatchEntry> entries;
+};
+
+ProofVerifier::ProofVerifier(bool perform_verification, bool batched) :
+    perform_verification(perform_verification),
+    batch(batched ? new PHGRProofBatch() : nullptr) { }
+
+ProofVerifier::ProofVerifier(ProofVerifier&&) = default;
+ProofVerifier& ProofVerifier::operator=(ProofVerifier&&) = default;
+ProofVerifier::~ProofVerifier() = default;
+
 ProofVerifier ProofVerifier::Strict() {
     initialize_curve_params();
     return ProofVerifier(true);
@@ -233,6 +259,22 @@ ProofVerifier ProofVerifier::Disabled() {
     return ProofVerifier(false);
 }
 
+ProofVerifier ProofVerifier::Batch() {
+    initialize_curve_params();
+    return ProofVerifier(true, true);
+}
+
+// The pairing product checks of a proof can only be folded into a
+// batch if the pairings involving g_B are bilinear, which requires
+// g_B to be a non-zero element of the order r subgroup. Points that
+// were decompressed from a PHGRProof always are; anything else is
+// verified on its own so that the result cannot differ.
+static bool is_batchable(const r1cs_ppzksnark_proof<curve_pp>& proof)
+{
+    return !proof.g_B.g.is_zero() &&
+           (curve_Fr::mod * proof.g_B.g).is_zero();
+}
+
 template<>
 bool ProofVerifier::check(
     const r1cs_ppzksnark_verification_key<curve_pp>& vk,
@@ -241,11 +283,143 @@ bool ProofVerifier::check(
     const r1cs_ppzksnark_proof<curve_pp>& proof
 )
 {
-    if (perform_verification) {
-        return r1cs_ppzksnark_online_verifier_strong_IC<curve_pp>(pvk, primary_input, proof);
-    } else {
+    if (!perform_verification) {
+        return true;
+    }
+
+    if (batch &&
+        pvk.encoded_IC_query.domain_size() == primary_input.size() &&
+        proof.is_well_formed() &&
+        is_batchable(proof))
+    {
+        PHGRBatchEntry entry;
+        entry.vk = &vk;
+        entry.pvk = &pvk;
+        entry.primary_input = primary_input;
+        entry.proof = proof;
+        entry.acc = pvk.encoded_IC_query.template accumulate_chunk<curve_Fr>(
+            primary_input.begin(), primary_input.end(), 0).first;
+        batch->entries.push_back(std::move(entry));
+        return true;
+    }
+
+    return r1cs_ppzksnark_online_verifier_strong_IC<curve_pp>(pvk, primary_input, proof);
+}
+
+static void add_pairing(
+    std::vector<curve_G1_precomp>& prec_P,
+    std::vector<curve_G2_precomp>& prec_Q,
+    const curve_G1& P,
+    const curve_G2_precomp& prec)
+{
+    // e(0, Q) = 1, so there is nothing to accumulate
+    if (!P.is_zero()) {
+        prec_P.push_back(curve_pp::precompute_G1(P));
+        prec_Q.push_back(prec);
+    }
+}
+
+// Each proof is valid iff the five pairing product checks performed by
+// r1cs_ppzksnark_online_verifier_weak_IC hold. Raising every check of
+// every proof to an independent random 128-bit power and multiplying
+// them together gives a single product which is one if all the proofs
+// are valid, and otherwise is one with probability at most 2^-128.
+//
+// The random exponents are moved into the G1 arguments, which lets the
+// pairings be grouped by their G2 argument: only six of those come from
+// the verification key, leaving one pairing per proof (for g_B) plus
+// six shared ones, evaluated in a single multi-Miller-loop followed by
+// a single final exponentiation.
+static bool verify_phgr_batch(const std::vector<const PHGRBatchEntry*>& entries)
+{
+    const r1cs_ppzksnark_verification_key<curve_pp>& vk = *entries[0]->vk;
+    const r1cs_ppzksnark_processed_verification_key<curve_pp>& pvk = *entries[0]->pvk;
+
+    curve_G1 alphaA_sum = curve_G1::zero();
+    curve_G1 one_sum = curve_G1::zero();
+    curve_G1 alphaC_sum = curve_G1::zero();
+    curve_G1 rC_Z_sum = curve_G1::zero();
+    curve_G1 gamma_sum = curve_G1::zero();
+    curve_G1 gamma_beta_sum = curve_G1::zero();
+
+    std::vector<curve_G1_precomp> prec_P;
+    std::vector<curve_G2_precomp> prec_Q;
+    prec_P.reserve(entries.size() + 6);
+    prec_Q.reserve(entries.size() + 6);
+
+    for (const PHGRBatchEntry* entry : entries) {
+        const r1cs_ppzksnark_proof<curve_pp>& proof = entry->proof;
+
+        // Exponents for the kc_A, kc_B, kc_C, QAP and K checks
+        bigint<2> r[5];
+        for (size_t i = 0; i < 5; i++) {
+            do {
+                r[i].randomize();
+            } while (r[i].is_zero());
+        }
+
+        const curve_G1 g_A_acc = proof.g_A.g + entry->acc;
+
+        alphaA_sum = alphaA_sum + r[0] * proof.g_A.g;
+        one_sum = one_sum + r[0] * proof.g_A.h
+                          + r[1] * proof.g_B.h
+                          + r[2] * proof.g_C.h
+                          + r[3] * proof.g_C.g;
+        alphaC_sum = alphaC_sum + r[2] * proof.g_C.g;
+        rC_Z_sum = rC_Z_sum + r[3] * proof.g_H;
+        gamma_sum = gamma_sum + r[4] * proof.g_K;
+        gamma_beta_sum = gamma_beta_sum + r[4] * (g_A_acc + proof.g_C.g);
+
+        add_pairing(prec_P, prec_Q,
+                    r[1] * vk.alphaB_g1 + r[3] * g_A_acc - r[4] * vk.gamma_beta_g1,
+                    curve_pp::precompute_G2(proof.g_B.g));
+    }
+
+    add_pairing(prec_P, prec_Q, alphaA_sum, pvk.vk_alphaA_g2_precomp);
+    add_pairing(prec_P, prec_Q, -one_sum, pvk.pp_G2_one_precomp);
+    add_pairing(prec_P, prec_Q, alphaC_sum, pvk.vk_alphaC_g2_precomp);
+    add_pairing(prec_P, prec_Q, -rC_Z_sum, pvk.vk_rC_Z_g2_precomp);
+    add_pairing(prec_P, prec_Q, gamma_sum, pvk.vk_gamma_g2_precomp);
+    add_pairing(prec_P, prec_Q, -gamma_beta_sum, pvk.vk_gamma_beta_g2_precomp);
+
+    return curve_pp::final_exponentiation(curve_pp::multi_miller_loop(prec_P, prec_Q)) == curve_GT::one();
+}
+
+bool ProofVerifier::verify_batch()
+{
+    if (!batch) {
         return true;
     }
+
+    std::vector<PHGRBatchEntry> entries;
+    entries.swap(batch->entries);
+
+    // Proofs can only be combined if they share a verification key
+    std::map<const void*, std::vector<const PHGRBatchEntry*>> groups;
+    for (const PHGRBatchEntry& entry : entries) {
+        groups[entry.pvk].push_back(&entry);
+    }
+
+    bool result = true;
+    for (const auto& group : groups) {
+        if (verify_phgr_batch(group.second)) {
+            continue;
+        }
+
+        // At least one proof is invalid; verify them individually so
+        // that the result is exactly that of the strict verifier.
+        for (const PHGRBatchEntry* entry : group.second) {
+            if (!r1cs_ppzksnark_online_verifier_strong_IC<curve_pp>(*entry->pvk, entry->primary_input, entry->proof)) {
+                result = false;
+                break;
+            }
+        }
+        if (!result) {
+            break;
+        }
+    }
+
+    return result;
 }
 
 }
@@ -4,6 +4,8 @@
 #include "serialize.h"
 #include "uint256.h"
 
+#include <memory>
+
 namespace libzcash {
 
 const unsigned char G1_PREFIX_MASK = 0x02;
@@ -237,11 +239,17 @@ public:
 
 void initialize_curve_params();
 
+struct PHGRProofBatch;
+
 class ProofVerifier {
 private:
     bool perform_verification;
 
-    ProofVerifier(bool perform_verification) : perform_verification(perform_verification) { }
+    // PHGR proofs whose pairing checks were deferred by check(), or
+    // null if proofs are verified as soon as they are checked.
+    std::unique_ptr<PHGRProofBatch> batch;
+
+    ProofVerifier(bool perform_verification, bool batched = false);
 
 public:
     // ProofVerifier should never be copied
@@ -249,6 +257,7 @@ public:
     ProofVerifier& operator=(const ProofVerifier&) = delete;
     ProofVerifier(ProofVerifier&&);
     ProofVerifier& operator=(ProofVerifier&&);
+    ~ProofVerifier();
 
     // Creates a verification context that strictly verifies
     // all proofs using libsnark's API.
@@ -259,6 +268,12 @@ public:
     // such as during reindexing.
     static ProofVerifier Disabled();
 
+    // Creates a verification context that only performs the
+    // cheap structural checks in check(), and defers the pairing
+    // checks of PHGR proofs to verify_batch(), which verifies
+    // all of them with a single final exponentiation.
+    static ProofVerifier Batch();
+
     template <typename VerificationKey,
               typename ProcessedVerificationKey,
               typename PrimaryInput,
@@ -270,6 +285,11 @@ public:
         const PrimaryInput& pi,
         const Proof& p
     );
+
+    // Verifies the proofs deferred by check() since the last call,
+    // returning true if every one of them is valid. Always returns
+    // true for verifiers not created with Batch().
+    bool verify_batch();
 };
 
 }
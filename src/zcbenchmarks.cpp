@@ -11,6 +11,7 @@
 #include "primitives/transaction.h"
 #include "base58.h"
 #include "crypto/equihash.h"
+#include "crypto/equihash_bucket.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "consensus/upgrades.h"
@@ -133,17 +134,18 @@ double benchmark_create_joinsplit()
     return ret;
 }
 
-std::vector<double> benchmark_create_joinsplit_threaded(int nThreads)
+// Runs nThreads copies of a benchmark concurrently, returning the time taken
+// by each copy.
+static std::vector<double> benchmark_threaded(double (*benchmark)(), int nThreads)
 {
     std::vector<double> ret;
     std::vector<std::future<double>> tasks;
     std::vector<std::thread> threads;
     for (int i = 0; i < nThreads; i++) {
-        std::packaged_task<double(void)> task(&benchmark_create_joinsplit);
+        std::packaged_task<double(void)> task(benchmark);
         tasks.emplace_back(task.get_future());
         threads.emplace_back(std::move(task));
     }
-    std::future_status status;
     for (auto it = tasks.begin(); it != tasks.end(); it++) {
         it->wait();
         ret.push_back(it->get());
@@ -154,6 +156,11 @@ std::vector<double> benchmark_create_joinsplit_threaded(int nThreads)
     return ret;
 }
 
+std::vector<double> benchmark_create_joinsplit_threaded(int nThreads)
+{
+    return benchmark_threaded(&benchmark_create_joinsplit, nThreads);
+}
+
 double benchmark_verify_joinsplit(const JSDescription &joinsplit)
 {
     struct timeval tv_start;
@@ -165,7 +172,7 @@ double benchmark_verify_joinsplit(const JSDescription &joinsplit)
 }
 
 #ifdef ENABLE_MINING
-double benchmark_solve_equihash()
+double benchmark_solve_equihash(EquihashBucketSolver<192,7>* bucketSolver)
 {
     CBlock pblock;
     CEquihashInput I{pblock};
@@ -187,8 +194,15 @@ double benchmark_solve_equihash()
     struct timeval tv_start;
     timer_start(tv_start);
     std::set<std::vector<unsigned int>> solns;
-    EhOptimisedSolveUncancellable(n, k, eh_state,
-                                  [](std::vector<unsigned char> soln) { return false; });
+    if (bucketSolver) {
+        assert(n == 192 && k == 7);
+        bucketSolver->Solve(eh_state,
+                            [](std::vector<unsigned char> soln) { return false; },
+                            [](EhSolverCancelCheck pos) { return false; });
+    } else {
+        EhOptimisedSolveUncancellable(n, k, eh_state,
+                                      [](std::vector<unsigned char> soln) { return false; });
+    }
     return timer_stop(tv_start);
 }
 
@@ -198,7 +212,7 @@ std::vector<double> benchmark_solve_equihash_threaded(int nThreads)
     std::vector<std::future<double>> tasks;
     std::vector<std::thread> threads;
     for (int i = 0; i < nThreads; i++) {
-        std::packaged_task<double(void)> task(&benchmark_solve_equihash);
+        std::packaged_task<double(void)> task([] { return benchmark_solve_equihash(); });
         tasks.emplace_back(task.get_future());
         threads.emplace_back(std::move(task));
     }
@@ -225,6 +239,18 @@ double benchmark_verify_equihash()
     return timer_stop(tv_start);
 }
 
+double benchmark_verify_invalid_equihash()
+{
+    CChainParams params = Params(CBaseChainParams::MAIN);
+    CBlock genesis = Params(CBaseChainParams::MAIN).GenesisBlock();
+    CBlockHeader genesis_header = genesis.GetBlockHeader();
+    genesis_header.nSolution[0] ^= 0x01;
+    struct timeval tv_start;
+    timer_start(tv_start);
+    assert(!CheckEquihashSolution(&genesis_header, params));
+    return timer_stop(tv_start);
+}
+
 double benchmark_large_tx(size_t nInputs)
 {
     // Create priv/pub key
@@ -320,7 +346,7 @@ double benchmark_increment_note_witnesses(size_t nTxs)
 
         wtx.SetSproutNoteData(noteData);
         wallet.AddToWallet(wtx, true, NULL);
-        block1.vtx.push_back(wtx);
+        block1.vtx.push_back(MakeTransactionRef(wtx));
     }
     CBlockIndex index1(block1);
     index1.nHeight = 1;
@@ -343,7 +369,7 @@ double benchmark_increment_note_witnesses(size_t nTxs)
 
         wtx.SetSproutNoteData(noteData);
         wallet.AddToWallet(wtx, true, NULL);
-        block2.vtx.push_back(wtx);
+        block2.vtx.push_back(MakeTransactionRef(wtx));
     }
     CBlockIndex index2(block2);
     index2.nHeight = 2;
@@ -434,6 +460,58 @@ double benchmark_connectblock_slow()
     return duration;
 }
 
+/**
+ * Runs the access pattern of a coins cache over a block's worth of outputs at
+ * a time: look up inputs (half of them missing), add the new outputs, and
+ * spend the inputs, then flush everything in one pass like BatchWrite.
+ */
+template <typename Map>
+static double benchmark_coins_cache_map(size_t nCoins)
+{
+    std::vector<COutPoint> outpoints;
+    for (size_t i = 0; i < nCoins; i++)
+        outpoints.push_back(COutPoint(GetRandHash(), i % 4));
+    CTxOut txout(1000, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0) << OP_EQUALVERIFY << OP_CHECKSIG);
+    const size_t nPerBlock = 2000;
+
+    struct timeval tv_start;
+    timer_start(tv_start);
+    Map map;
+    size_t nFound = 0;
+    for (size_t i = 0; i < nCoins; i += nPerBlock) {
+        size_t nEnd = std::min(nCoins, i + nPerBlock);
+        for (size_t j = i; j < nEnd; j++) {
+            if (map.find(outpoints[j / 2]) != map.end())
+                nFound++;
+        }
+        for (size_t j = i; j < nEnd; j++) {
+            CCoinsCacheEntry& entry = map[outpoints[j]];
+            entry.coin = Coin(txout, j, false);
+            entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+        }
+        for (size_t j = i / 2; j < nEnd / 2; j++) {
+            typename Map::iterator it = map.find(outpoints[j]);
+            if (it != map.end() && (it->second.flags & CCoinsCacheEntry::FRESH))
+                map.erase(it);
+        }
+    }
+    size_t nUsage = memusage::DynamicUsage(map);
+    for (typename Map::iterator it = map.begin(); it != map.end(); ) {
+        typename Map::iterator itOld = it++;
+        map.erase(itOld);
+    }
+    double duration = timer_stop(tv_start);
+    LogPrint("bench", "%s: %u coins, %u found, %u bytes before flushing\n", __func__, nCoins, nFound, nUsage);
+    return duration;
+}
+
+double benchmark_coins_cache(size_t nCoins, bool fUnorderedMap)
+{
+    if (fUnorderedMap)
+        return benchmark_coins_cache_map<boost::unordered_map<COutPoint, CCoinsCacheEntry, CCoinsKeyHasher> >(nCoins);
+    return benchmark_coins_cache_map<CCoinsMap>(nCoins);
+}
+
 extern UniValue getnewaddress(const UniValue& params, bool fHelp); // in rpcwallet.cpp
 extern UniValue sendtoaddress(const UniValue& params, bool fHelp);
 
@@ -628,5 +706,15 @@ double benchmark_verify_sapling_output()
     if (!result) {
         throw JSONRPCError(RPC_INTERNAL_ERROR, "librustzcash_sapling_check_output() should return true");
     }
-    return timer_stop(tv_start);
+    return t;
+}
+
+std::vector<double> benchmark_verify_sapling_spend_threaded(int nThreads)
+{
+    return benchmark_threaded(&benchmark_verify_sapling_spend, nThreads);
+}
+
+std::vector<double> benchmark_verify_sapling_output_threaded(int nThreads)
+{
+    return benchmark_threaded(&benchmark_verify_sapling_output, nThreads);
 }
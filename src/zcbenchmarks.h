@@ -4,18 +4,23 @@
 #include <sys/time.h>
 #include <stdlib.h>
 
+template<unsigned int N, unsigned int K>
+class EquihashBucketSolver;
+
 extern double benchmark_sleep();
 extern double benchmark_parameter_loading();
 extern double benchmark_create_joinsplit();
 extern std::vector<double> benchmark_create_joinsplit_threaded(int nThreads);
-extern double benchmark_solve_equihash();
+extern double benchmark_solve_equihash(EquihashBucketSolver<192,7>* bucketSolver = NULL);
 extern std::vector<double> benchmark_solve_equihash_threaded(int nThreads);
 extern double benchmark_verify_joinsplit(const JSDescription &joinsplit);
 extern double benchmark_verify_equihash();
+extern double benchmark_verify_invalid_equihash();
 extern double benchmark_large_tx(size_t nInputs);
 extern double benchmark_try_decrypt_notes(size_t nAddrs);
 extern double benchmark_increment_note_witnesses(size_t nTxs);
 extern double benchmark_connectblock_slow();
+extern double benchmark_coins_cache(size_t nCoins, bool fUnorderedMap);
 extern double benchmark_sendtoaddress(CAmount amount);
 extern double benchmark_loadwallet();
 extern double benchmark_listunspent();
@@ -23,5 +28,7 @@ extern double benchmark_create_sapling_spend();
 extern double benchmark_create_sapling_output();
 extern double benchmark_verify_sapling_spend();
 extern double benchmark_verify_sapling_output();
+extern std::vector<double> benchmark_verify_sapling_spend_threaded(int nThreads);
+extern std::vector<double> benchmark_verify_sapling_output_threaded(int nThreads);
 
 #endif